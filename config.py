@@ -17,6 +17,9 @@ disable_aff = True
 disable_curl = True
 
 ## This can be any combination of ('lock','resolver','object')
+##
+## 'lockstats' records how long every call site waits for and holds
+## the global lock and prints a report at aff4_end().
 DEBUG = []
 
 ## This enables the external interprocess locks. If it is disabled,
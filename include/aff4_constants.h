@@ -200,6 +200,11 @@
 #define RESOLVER_MODE_NONPERSISTANT 1
 #define RESOLVER_MODE_DEBUG_MEMORY 2
 
+/* Volume graphs are only indexed when a volume is opened - the
+   triples about a subject are loaded the first time it is used.
+*/
+#define RESOLVER_MODE_LAZY 4
+
 /** Objects can be marked as dirty in a number of cases: */
 #define DIRTY_STATE_UNKNOWN 0
 
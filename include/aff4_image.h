@@ -1,6 +1,14 @@
 #include "aff4_internal.h"
 
 
+/* The number of decompressed chunks we keep for reading. */
+#define AFF4_IMAGE_CHUNK_CACHE_SIZE 64
+
+/* The number of chunks we decompress at once when reading
+   sequentially.
+*/
+#define AFF4_IMAGE_READAHEAD 4
+
 /* This is the worker object itself (private) */
 struct ImageWorker_t;
 
@@ -9,31 +17,51 @@ CLASS(AFF4Image, FileLikeObject)
 /* This is the volume where the image is stored */
   RDFURN stored;
 
-  /* Chunks are cached here for faster randoom reading performance.
+  /* Decompressed chunks are cached here (keyed by the uint64_t chunk
+     id) for faster random reading performance.
   */
   Cache chunk_cache;
 
+  /* The last chunk we read - sequential reads read ahead. */
+  uint64_t last_chunk;
+
   /* Thats the current worker we are using - when it gets full, we
      simply dump its bevy and take a new worker here.
   */
   struct ImageWorker_t *current;
 
-  /* The thread pool that will be used to compress bevies. */
+  /* The thread pool that will be used to compress bevies. This is
+     the process wide pool unless thread_count is set.
+  */
   ThreadPool thread_pool;
 
+  /* Workers which were scheduled but not yet completed. */
+  struct list_head outstanding;
+
   /** Some parameters about this image */
   int chunk_size;
   int compression;
   int chunks_in_segment;
   uint32_t bevy_size;
 
+  /* The size of the stream. This is loaded from the resolver when
+     reading, and recorded there again when a written image is closed.
+  */
+  uint64_t size;
+
   /* The current bevy we are working on. */
   int segment_count;
 
+  /* The number of bevies our workers failed to write - close() fails
+     if there were any.
+  */
+  int failed_bevies;
+
   EVP_MD_CTX digest;
 
-  /* The number of threads to use in the threadpool. Set this before
-     calling finish().
+  /* The number of threads to use in a private threadpool. Set this
+     before calling finish() - by default we share the process wide
+     pool.
    */
   int thread_count;
 
@@ -32,6 +32,10 @@ CLASS(AFFObject, Object)
      // completed properly before using it.
      int complete;
 
+     // Protects the private state of this object while the global
+     // lock is released - see the notes in aff4_utils.h.
+     pthread_mutex_t *lock;
+
      /** Any object may be asked to be constructed from its URI.
 
          DEFAULT(urn) = NULL;
@@ -87,6 +91,16 @@ END_CLASS
 
 PROXY_CLASS(AFFObject);
 
+/* Acquire an object's lock. The global lock must be held on entry; it
+   is released while we wait so we never block other threads while
+   holding it.
+*/
+#define AFF4_OBJECT_LOCK(obj) AFF4_BEGIN_ALLOW_THREADS                 \
+  pthread_mutex_lock(((AFFObject)(obj))->lock);                         \
+  AFF4_END_ALLOW_THREADS
+
+#define AFF4_OBJECT_UNLOCK(obj) pthread_mutex_unlock(((AFFObject)(obj))->lock);
+
 
 // Base class for file like objects
 #define MAX_CACHED_FILESIZE 1e6
@@ -102,6 +116,13 @@ CLASS(FileLikeObject, AFFObject)
      int METHOD(FileLikeObject, read, OUT char *buffer, \
                 unsigned int length);
 
+     /* Read at the offset without moving the readptr, like
+        pread(). Streams which can not do this themselves seek and
+        restore the readptr under the object lock.
+     */
+     int METHOD(FileLikeObject, read_at, OUT char *buffer, \
+                unsigned int length, uint64_t offset);
+
      /* A variant of read above that will read upto the next \r or
         \r\n.
 
@@ -132,6 +153,109 @@ END_CLASS
 // This file like object is backed by a real disk file:
 CLASS(FileBackedObject, FileLikeObject)
      int fd;
+
+     /* The size of the backing file. This is read with fstat() when
+        the file is opened and maintained by write() and truncate()
+        so size queries do not need to touch the file.
+     */
+     uint64_t size;
+END_CLASS
+
+/* A write-behind buffer which may be placed in front of any other
+   FileLikeObject. Small sequential writes are collected in memory
+   and written to the backing store in one large write when the
+   buffer fills, when a non-sequential write is made, or when
+   flush() is called. Reads flush any pending data first so they
+   always see what was written.
+
+   The buffer owns the backing store and closes it in close(). A
+   failed or short write keeps the unwritten data in the buffer and
+   flush() returns 0. Pending data is lost if the buffer is freed
+   without calling flush() or close().
+*/
+CLASS(BufferedWriter, FileLikeObject)
+     FileLikeObject backing_store;
+
+     char *buffer;
+     unsigned int buffer_size;
+
+     /* The number of bytes currently pending in the buffer, and the
+        offset in the backing store they belong at.
+     */
+     unsigned int buffer_used;
+     uint64_t buffer_offset;
+
+     /* DEFAULT(buffer_size) = 1048576; */
+     BufferedWriter METHOD(BufferedWriter, Con, FileLikeObject backing_store, \
+                           unsigned int buffer_size);
+
+     /* Write all pending data to the backing store. Returns 1 on
+        success, 0 on error.
+     */
+     int METHOD(BufferedWriter, flush);
+END_CLASS
+
+struct ReadBatch_t;
+
+/* A single asynchronous read of length bytes at offset in stream
+   into buffer. The read runs on a worker of the thread pool and does
+   not disturb anyone else's readptr. The buffer must stay valid until
+   the request completes.
+
+   result is the number of bytes read, or -1 if the read failed.
+
+   For a per request callback, subclass this and override
+   complete(). complete() runs in whichever thread calls the pool's
+   complete() (or the batch's poll()) with the global lock held.
+*/
+CLASS(AsyncRead, ThreadPoolJob)
+     FileLikeObject stream;
+     uint64_t offset;
+     char *buffer;
+     unsigned int length;
+     int result;
+
+     /* The batch we were submitted through, if any. */
+     struct ReadBatch_t *batch;
+     struct list_head list;
+
+     AsyncRead METHOD(AsyncRead, Con, FileLikeObject stream, uint64_t offset,
+                      char *buffer, unsigned int length);
+END_CLASS
+
+/* A batch of asynchronous reads with a completion queue. Requests
+   are executed by the pool in any order - poll() returns them as
+   they complete. Freeing the batch waits for outstanding requests.
+*/
+CLASS(ReadBatch, Object)
+     /* By default the process wide pool. */
+     ThreadPool pool;
+
+     /* Requests submitted but not yet returned by poll(). */
+     int outstanding;
+
+     struct list_head pending;
+     struct list_head completed;
+
+     ReadBatch METHOD(ReadBatch, Con, ThreadPool pool);
+
+     /* Create and submit a new request. Returns the request (owned
+        by the batch until poll() returns it) or NULL on error.
+     */
+     AsyncRead METHOD(ReadBatch, read, FileLikeObject stream, uint64_t offset,
+                      char *buffer, unsigned int length);
+
+     /* Submit a request which was constructed by the caller (e.g. a
+        subclass with its own complete() callback). The batch takes
+        ownership of it.
+     */
+     int METHOD(ReadBatch, submit, AsyncRead request);
+
+     /* Return the next completed request, stolen to ctx. Waits up to
+        timeout seconds - returns NULL on timeout or when nothing is
+        outstanding.
+     */
+     AsyncRead METHOD(ReadBatch, poll, void *ctx, int timeout);
 END_CLASS
 
 PROXY_CLASS(FileLikeObject);
@@ -148,6 +148,60 @@ END_CLASS
 PROXY_CLASS(MapDriver);
 PROXY_CLASS(Image);
 
+/** A source reader for acquiring damaged media.
+
+    The RescueReader wraps a source FileLikeObject (usually a
+    FileBackedObject on a device) and reads it in large blocks. When
+    a block can not be read it is filled with zeros, its region is
+    recorded as bad and reading carries on, so the healthy parts of a
+    failing disk are acquired at full speed.
+
+    Once the first pass is complete, retry() goes back over the bad
+    regions with ever smaller block sizes (halving each pass down to
+    min_block_size). Data recovered this way is appended to a
+    separate stream. Finally get_map() describes the whole source as
+    a text map (in the same format as MapValue's map segment):
+    readable runs point at the image itself, recovered runs point at
+    the rescued stream and runs which could never be read point at
+    AFF4_SPECIAL_URN_ZERO.
+*/
+CLASS(RescueReader, FileLikeObject)
+     // The source we read from - this is borrowed.
+     FileLikeObject source;
+
+     // The size of the source (0 if it can not be determined).
+     uint64_t size;
+
+     unsigned int block_size;
+     unsigned int min_block_size;
+
+     // Sorted lists of struct rescue_region_t
+     struct list_head bad_regions;
+     struct list_head rescued_regions;
+
+     // The total number of bytes currently unreadable
+     uint64_t bad_bytes;
+
+     /* DEFAULT(block_size) = 1048576;
+        DEFAULT(min_block_size) = 512;
+     */
+     RescueReader METHOD(RescueReader, Con, FileLikeObject source, \
+                         unsigned int block_size, unsigned int min_block_size);
+
+     /* Retry all bad regions with shrinking block sizes. Recovered
+        data is written sequentially to rescued. Returns the number of
+        bytes which are still unreadable.
+     */
+     uint64_t METHOD(RescueReader, retry, FileLikeObject rescued);
+
+     /* Returns a text map of the source, allocated with ctx. image is
+        the URN of the stream the first pass was written to, and
+        rescued is the stream given to retry() (may be NULL if retry
+        was not called).
+     */
+     char *METHOD(RescueReader, get_map, void *ctx, RDFURN image, RDFURN rescued);
+END_CLASS
+
 #ifdef HAVE_OPENSSL
 #include "aff4_crypto.h"
 #endif
@@ -15,7 +15,10 @@ CLASS(URLParse, Object)
       char *query;
       char *fragment;
 
-      void *ctx;
+      /* The components above are null terminated spans of this
+         buffer.
+      */
+      char *buffer;
 
       URLParse METHOD(URLParse, Con, char *url);
 
@@ -26,6 +29,11 @@ CLASS(URLParse, Object)
          URL.
       */
       char *METHOD(URLParse, string, void *ctx);
+
+      /* Appends length bytes of path as new elements of the query
+         without parsing everything again.
+      */
+      void METHOD(URLParse, append, char *path, int length);
 END_CLASS
 
 
@@ -150,6 +158,11 @@ CLASS(RDFURN, RDFValue)
      */
      URLParse parser;
 
+     /* Set on the shared handles returned by intern(). These may not
+        be changed or freed.
+     */
+     int interned;
+
      /* A convenience constructor.
 
         DEFAULT(urn) = NULL;
@@ -173,6 +186,11 @@ CLASS(RDFURN, RDFValue)
 
      /* This method returns the relative name */
      char *METHOD(RDFURN, relative_name, RDFURN volume);
+
+     /* Returns the process wide shared handle for this URN (see
+        intern_urn()).
+     */
+     BORROWED RDFURN METHOD(RDFURN, intern);
 END_CLASS
 
 
@@ -223,6 +241,15 @@ RDFValue rdfvalue_from_urn(void *ctx, char *value);
 RDFValue rdfvalue_from_string(void *ctx, char *value);
 
 DLL_PUBLIC RDFURN new_RDFURN(void *ctx);
+
+/* Returns the process wide handle for the urn. There is only one
+   handle for each normalised URN, so interned URNs are equal exactly
+   when they are the same pointer, and copying one does not need to
+   parse it again. Handles are immutable and live as long as the
+   process - intern URNs which are kept and shared (e.g. map targets),
+   not transient ones.
+*/
+DLL_PUBLIC BORROWED RDFURN intern_urn(char *urn);
 DLL_PUBLIC XSDInteger new_XSDInteger(void *ctx);
 DLL_PUBLIC XSDString new_XSDString(void *ctx);
 DLL_PUBLIC XSDDatetime new_XSDDateTime(void *ctx);
@@ -9,6 +9,11 @@
 #include "aff4_rdf.h"
 #include "aff4_io.h"
 
+/* The serialiser collects its output and writes it to the
+   FileLikeObject in chunks of this size.
+*/
+#define RDF_SERIALIZER_BUFFER_SIZE (256 * 1024)
+
 /***** Following is an implementation of a serialiser */
 CLASS(RDFSerializer, Object)
      raptor_serializer *rdf_serializer;
@@ -16,13 +21,15 @@ CLASS(RDFSerializer, Object)
      FileLikeObject fd;
      int count;
 
-     char buff[BUFF_SIZE*2];
+     char buff[RDF_SERIALIZER_BUFFER_SIZE];
      int i;
 
      Cache attributes;
      Resolver resolver;
      RDFSerializer METHOD(RDFSerializer, Con, char *base_urn, \
                           FileLikeObject fd, Resolver resolver);
+     /* Write out all the attributes stored for the urn, except the
+        volatile ones. */
      int METHOD(RDFSerializer, serialize_urn, RDFURN urn);
      int METHOD(RDFSerializer, serialize_statement, Object *iter, RDFURN urn, \
                 RDFURN attribute);
@@ -30,6 +37,79 @@ CLASS(RDFSerializer, Object)
      DESTRUCTOR void METHOD(RDFSerializer, close);
 END_CLASS
 
+/* A compact binary form of the graph. Capable readers load it
+   straight into the DataStore instead of parsing Turtle. It starts
+   with RDF_BINARY_MAGIC and is followed by records of
+
+     subject, attribute, type   - string references
+     value                      - a varint for XSDInteger and the
+                                  types derived from it (e.g.
+                                  XSDDatetime), otherwise a varint
+                                  length and the value as encoded in
+                                  the DataStore.
+
+   All numbers are unsigned LEB128 varints, so the graph does not
+   depend on the byte order of the host which wrote it. A string reference of 0
+   is followed by a new string (varint length and bytes) which takes
+   the next id, starting from 1. Any other reference is the id of an
+   earlier string.
+*/
+#define RDF_BINARY_FORMAT "binary"
+#define RDF_BINARY_MAGIC "AFF4RDF2"
+
+CLASS(RDFBinarySerializer, Object)
+     FileLikeObject fd;
+     Resolver resolver;
+
+     /* The ids of the strings written so far. */
+     Cache strings;
+     uint64_t string_count;
+
+     /* Output is collected here and written to fd in chunks of
+        RDF_SERIALIZER_BUFFER_SIZE. */
+     StringIO buffer;
+
+     RDFBinarySerializer METHOD(RDFBinarySerializer, Con, FileLikeObject fd, \
+                                Resolver resolver);
+
+     /* Write out all the attributes stored for the urn, except the
+        volatile ones. */
+     int METHOD(RDFBinarySerializer, serialize_urn, RDFURN urn);
+     DESTRUCTOR void METHOD(RDFBinarySerializer, close);
+END_CLASS
+
+struct binary_parser_t;
+
+/* A binary graph loaded with RESOLVER_MODE_LAZY. Opening it only
+   finds where the records of each subject are - they are decoded
+   into the store when the resolver first asks for the subject.
+*/
+CLASS(BinaryGraph, DeferredGraph)
+     /* The whole graph. Records are decoded straight from here. */
+     char *data;
+     struct binary_parser_t *parser;
+
+     /* The records of each subject (struct binary_range_t) keyed by
+        the subject.
+     */
+     Cache ranges;
+
+     /* The string ids of all the subjects, each listed once. */
+     uint64_t *subjects;
+     int subject_count;
+
+     /* The volume's contains triples for all the subjects are added
+        when the volume is loaded.
+     */
+     char *volume;
+     int contains_loaded;
+
+     /* Indexes the graph in data (which we steal). Returns NULL if
+        it is corrupted.
+     */
+     BinaryGraph METHOD(BinaryGraph, Con, char *data, int length, char *volume);
+END_CLASS
+
 CLASS(RDFParser, Object)
      char message[BUFF_SIZE];
      jmp_buf env;
@@ -45,6 +125,11 @@ CLASS(RDFParser, Object)
 
 // Parses data stored in fd using the format specified. fd is assumed
 // to contain a base URN specified (or NULL if non specified).
+//
+// Turtle and N-Triples in the subset AFF4 writes are parsed natively
+// straight into the resolver's batch - anything else falls back to
+// raptor. RDF_BINARY_FORMAT is loaded directly into the DataStore,
+// or only indexed with RESOLVER_MODE_LAZY.
      int METHOD(RDFParser, parse, FileLikeObject fd, char *format, char *base);
 RDFParser METHOD(RDFParser, Con, Resolver resolver);
 END_CLASS
@@ -43,8 +43,20 @@ CLASS(DataStoreObject, Object)
                          unsigned int length, char *rdf_type);
 END_CLASS
 
+/* A single triple for DataStore.add_batch() */
+struct datastore_triple_t {
+  char *uri;
+  char *attribute;
+  DataStoreObject value;
+};
+
 /** The abstract data store. */
 CLASS(DataStore, Object)
+  /* Set by stores whose lock() lets several threads get() at once
+     without the global lock.
+  */
+  int shared_reads;
+
   /* constructor.
 
      DEFAULT(logger) = NULL;
@@ -67,6 +79,26 @@ CLASS(DataStore, Object)
   void METHOD(DataStore, add, char *uri, char *attribute, \
               DataStoreObject value);
 
+  /* Add many values at once, in order. The values are stolen. The
+   * default just calls add() for each triple - stores which can do
+   * better should override this.
+   */
+  void METHOD(DataStore, add_batch, struct datastore_triple_t *triples, \
+              int count);
+
+  /* Atoms are small integers standing for a uri or attribute
+   * string. A store which supports them does not need to hash the
+   * strings again when the atoms are used. Returns 0 if the store does
+   * not support atoms.
+   */
+  uint32_t METHOD(DataStore, intern, char *string);
+
+  /* Like set() and add() but with atoms from intern(). */
+  void METHOD(DataStore, set_atoms, uint32_t uri, uint32_t attribute, \
+              DataStoreObject value);
+  void METHOD(DataStore, add_atoms, uint32_t uri, uint32_t attribute, \
+              DataStoreObject value);
+
   /* Get a borrowed reference to the first object. The DataStore must remain
    * locked as long as the returned object is used.
    */
@@ -77,24 +109,177 @@ CLASS(DataStore, Object)
    */
   Object METHOD(DataStore, iter, char *uri, char *attribute);
 
+  /* Like iter() but with atoms from intern(). */
+  Object METHOD(DataStore, iter_atoms, uint32_t uri, uint32_t attribute);
+
   /* Receive the next item with an iterator. Reference is borrowed. The
    * DataStore must be locked for the duration of the iteration.
    */
   DataStoreObject METHOD(DataStore, next, Object *iter);
+
+  /* Reverse indexes. Once an attribute is indexed the subjects
+   * which have a particular value for it can be found without
+   * looking at every triple. Returns 0 if the store can not index.
+   */
+  int METHOD(DataStore, add_index, char *attribute);
+
+  /* Iterate over the subjects with this value for the indexed
+   * attribute. The value is matched on its data. Stores which can not
+   * index scan all their triples instead. The DataStore must be
+   * locked for the duration of the iteration.
+   */
+  Object METHOD(DataStore, iter_subjects, char *attribute, \
+                DataStoreObject value);
+
+  /* Receive the next subject. Reference is borrowed. */
+  char *METHOD(DataStore, next_subject, Object *iter);
+
+  /* Iterate over the attributes the subject has values for, in the
+   * order they were first added. Attributes whose values were
+   * deleted may still be returned. The DataStore must be locked for
+   * the duration of the iteration.
+   */
+  Object METHOD(DataStore, iter_attributes, char *uri);
+
+  /* Receive the next attribute. Reference is borrowed. */
+  char *METHOD(DataStore, next_attribute, Object *iter);
 END_CLASS
 
 
+struct memory_atom_t;
+
+/** A DataStore kept in memory.
+
+    The store has its own reader/writer lock so readers do not need
+    the global lock: lock() takes a read lock which is held while
+    borrowed objects are in use, and set(), add() and del() take the
+    write lock. get(), iter() and next() do not allocate or take the
+    global lock.
+
+    Lock order: the global lock must be taken before the store
+    lock. A thread holding a read lock must not take the global lock
+    unless it already held it, and can not write to the store -
+    writes raise EProgrammingError until it is unlocked.
+*/
 CLASS(MemoryDataStore, DataStore)
     int id_counter;
-    Cache urn_db;
-    Cache attribute_db;
+
+    /* Maps uris and attributes to their ids - these are also our
+       atoms.
+    */
+    Cache atom_db;
     Cache data_db;
+
+    /* The names of the ids and whether they are indexed */
+    struct memory_atom_t *atom_info;
+
+    /* The reverse indexes: (attribute, value) to a list of subjects,
+       and (attribute, subject, value) to the subject's place in the
+       list.
+    */
+    Cache index_db;
+    Cache index_members;
+
+    pthread_rwlock_t rwlock;
+
+    /* Write the contents of the store to a snapshot file which can be
+       loaded with a SnapshotDataStore. volumes is a NULL terminated
+       list of the files the metadata came from - the snapshot is
+       only valid as long as they do not change.
+
+       DEFAULT(volumes) = NULL;
+    */
+    int METHOD(MemoryDataStore, snapshot, char *filename, char **volumes);
 END_CLASS
 
 
 DLL_PUBLIC DataStore new_MemoryDataStore(void *ctx);
 
 
+/** A DataStore kept in a tdb file. The metadata persists across runs,
+    does not have to fit in memory and may be shared between
+    processes.
+
+    Objects returned by get() and next() are only valid while the
+    store remains locked - they are freed when the outermost lock is
+    released.
+*/
+CLASS(TDBDataStore, DataStore)
+    struct tdb_context *db;
+    char *filename;
+
+    /* Borrowed objects are allocated under this context */
+    void *borrowed;
+    int lock_depth;
+
+    /* Open (creating if needed) the tdb file */
+    TDBDataStore METHOD(TDBDataStore, Con, char *filename);
+END_CLASS
+
+
+DLL_PUBLIC DataStore new_TDBDataStore(void *ctx, char *filename);
+
+
+struct snapshot_header_t;
+struct snapshot_triple_t;
+
+/** A read only DataStore loaded from a file written by
+    MemoryDataStore.snapshot(). The file is mapped into memory and used
+    in place, so loading it does not need to parse anything.
+
+    All strings are interned in a sorted table and the triples are
+    sorted by subject and attribute, so lookups are binary
+    searches. Loading fails if any of the volumes the snapshot was
+    made from have changed since.
+
+    As with the TDBDataStore, objects returned by get() and next()
+    are only valid while the store remains locked.
+*/
+CLASS(SnapshotDataStore, DataStore)
+    char *filename;
+
+    /* The mapped file */
+    char *base;
+    uint64_t size;
+
+    struct snapshot_header_t *header;
+    uint32_t *string_index;
+    struct snapshot_triple_t *triples;
+
+    /* Borrowed objects are allocated under this context */
+    void *borrowed;
+    int lock_depth;
+
+    SnapshotDataStore METHOD(SnapshotDataStore, Con, char *filename);
+END_CLASS
+
+
+DLL_PUBLIC DataStore new_SnapshotDataStore(void *ctx, char *filename);
+
+
+struct resolver_atom_t;
+struct Resolver_t;
+
+/* A graph whose triples are only loaded into the store when their
+   subject is first used through the resolver (see Resolver.defer()).
+*/
+CLASS(DeferredGraph, Object)
+     struct list_head list;
+
+     /* The number of loads still outstanding. The resolver frees the
+        graph when this drops to 0.
+     */
+     int pending;
+
+     /* Loads all the triples about subject into the resolver's
+        store. Returns 1 if there were any.
+     */
+     int METHOD(DeferredGraph, load, struct Resolver_t *resolver, char *subject);
+
+     /* Loads everything which is not loaded yet. */
+     void METHOD(DeferredGraph, load_all, struct Resolver_t *resolver);
+END_CLASS
+
 /** The resolver is at the heart of the AFF4 specification - it is
     responsible for returning objects keyed by attribute from a
     globally unique identifier (URI) and managing the central
@@ -104,17 +289,47 @@ CLASS(Resolver, Object)
        /** This is where we store all our data */
        DataStore store;
 
+       /* Triples queued by batch_add() which have not been given to
+          the store yet. They all live in batch_ctx.
+       */
+       struct datastore_triple_t *batch;
+       int batch_count;
+       void *batch_ctx;
+
+       /* Strings registered with intern(). An atom is an index into
+          atoms plus 1.
+       */
+       Cache atom_db;
+       struct resolver_atom_t *atoms;
+       uint32_t atom_count;
+
+       /* The mode we were constructed with (RESOLVER_MODE_*) */
+       int mode;
+
+       /* Graphs registered with defer() which still have triples to
+          load.
+       */
+       struct list_head deferred;
+
        /** This is used to restore state if the RDF parser fails */
        jmp_buf env;
        char *message;
 
        /* Read and write caches. These have different policies. The
-          read cache is just for efficiency - if an object is not in
-          the cache or is used by another thread, we just create a new
-          one of those.
+          read cache is just for efficiency - it holds a bounded number
+          of idle readers which open() hands out again. If an object is
+          not in the cache or is used by another thread, we just create
+          a new one of those.
        */
        Cache read_cache;
 
+       /* Readers handed to manage() (e.g. volumes) live here until the
+          resolver is flushed. Other objects hold on to them through
+          own() so they can never be expired, and open() never hands
+          them out.
+       */
+       Cache managed;
+
        /* Write cache is used for locks - it is not possible to have
           multiple write objects at the same time, and all writers are
           opened exclusively. Attempting to open an already locked
@@ -164,7 +379,8 @@ CLASS(Resolver, Object)
 
        /* This causes the resolver to take ownership of the object. The object
         * is locked to the calling thread and can be returned to the resolver at
-        * any time using cache_return().
+        * any time using cache_return(). Managed readers are kept until the
+        * resolver is flushed.
         */
        void METHOD(Resolver, manage, AFFObject obj);
 
@@ -192,6 +408,28 @@ CLASS(Resolver, Object)
        RDFValue METHOD(Resolver, resolve, void *ctx, \
                        RDFURN uri, char *attribute);
 
+       /* Decodes the first value for the uri and attribute into an
+          existing RDFValue instead of allocating new ones. The stored
+          value must be of the same type. Returns 1 if a value was
+          found.
+       */
+       int METHOD(Resolver, resolve_value, RDFURN uri, char *attribute, \
+                  RDFValue value);
+
+       /* Like resolve_value() but for an XSDInteger, which is read
+          straight into result.
+
+          Integer lookups (this and resolve_value() into an
+          XSDInteger) only take the store's read lock if it has
+          shared_reads, so threads may run them concurrently. They
+          still take the global lock while deferred graphs or batched
+          triples are waiting to be loaded. All other lookups decode
+          with the global lock held since decoding may call back into
+          the library.
+       */
+       int METHOD(Resolver, resolve_uint64, RDFURN uri, char *attribute, \
+                  OUT uint64_t *result);
+
        /* Deletes all values for this attribute from the resolver
 
           DEFAULT(attribute) = NULL;
@@ -226,6 +464,61 @@ CLASS(Resolver, Object)
        int METHOD(Resolver, add, \
                   RDFURN uri, char *attribute, RDFValue value);
 
+       /* Queues a value to be added. This is much faster than add()
+          for loading many triples: the value is encoded straight
+          away but it is only given to the store, together with the
+          rest of the batch, when the batch fills up or flush_batch()
+          is called. Any other call which touches the store flushes
+          the batch first so the order of operations is kept.
+       */
+       void METHOD(Resolver, batch_add, \
+                   RDFURN uri, char *attribute, RDFValue value);
+
+       /* Adds all the queued triples to the store. */
+       void METHOD(Resolver, flush_batch);
+
+       /* Takes ownership of a graph whose triples are loaded the first
+          time their subject is used through the resolver. Anything
+          which needs every subject (e.g. resolve_subjects()) loads
+          all deferred graphs first.
+       */
+       void METHOD(Resolver, defer, DeferredGraph graph);
+
+       /* Loads the deferred triples about subject now, or about all
+          subjects if subject is NULL. Only code which reads the store
+          directly needs to call this.
+       */
+       void METHOD(Resolver, load_deferred, char *subject);
+
+       /* Registers a URN or attribute and returns an atom for it. The
+          atom is a small integer which can be used with the *_atom
+          methods below instead of the string - these do not need to
+          hash the strings again. Atoms are only valid for this
+          resolver. Returns 0 on error.
+       */
+       uint32_t METHOD(Resolver, intern, char *string);
+
+       /* Like set(), add() and resolve() but with atoms from intern() */
+       int METHOD(Resolver, set_atom, uint32_t urn, uint32_t attribute, \
+                  RDFValue value);
+       int METHOD(Resolver, add_atom, uint32_t urn, uint32_t attribute, \
+                  RDFValue value);
+       RDFValue METHOD(Resolver, resolve_atom, void *ctx, uint32_t urn, \
+                       uint32_t attribute);
+
+       /* Indexes the attribute so resolve_subjects() can be used with
+          it. AFF4_TYPE and the stored attributes are always
+          indexed. Returns 0 if the store can not index.
+       */
+       int METHOD(Resolver, add_index, char *attribute);
+
+       /* Returns all the subjects which have the value for the indexed
+          attribute. They are allocated with a context of ctx and are
+          chained though their list member.
+       */
+       RDFURN METHOD(Resolver, resolve_subjects, void *ctx, \
+                     char *attribute, RDFValue value);
+
        /** This function is used to register a new RDFValue class with
            the RDF subsystem. It can then be serialised, and parsed.
 
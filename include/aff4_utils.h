@@ -37,14 +37,39 @@
      lock is completely released using the AFF4_BEGIN_ALLOW_THREADS
      and re-acquired with AFF4_END_ALLOW_THREADS. Note that it is
      imperative that no memory allocation is performed with threads
-     allowed or race conditions can occur.
+     allowed or race conditions can occur - the only exception is the
+     thread's own arena (see aff4_arena() below).
 
    4 All new threads which require access to AFF4 data structures must
      acquire the lock before starting and release it when
      finishing. This restriction is consistent with rule 2 above.
 
+   5 Each AFFObject also carries its own recursive lock which protects
+     its private state (e.g. the readptr or a decompressed buffer)
+     while the global lock is released. Stream read paths hold their
+     object lock for the whole call and release the global lock
+     around system calls, copies and decompression - so independent
+     streams can be read in parallel. Take it with
+     AFF4_OBJECT_LOCK/AFF4_OBJECT_UNLOCK only - never call
+     pthread_mutex_lock on it directly. A caller which needs a
+     seek()/read() pair on a shared object to be atomic should hold
+     that object's lock around both calls.
+
+   The lock order is:
+
+      object locks (outer stream before inner stream/backing store)
+        -> the global lock
+          -> the data store lock (MemoryDataStore rwlock)
+
+   A thread must never wait for an object lock while holding the
+   global lock - AFF4_OBJECT_LOCK releases the global lock while it
+   waits and re-acquires it afterwards to preserve this order. Object
+   locks are only nested from a container stream towards its backing
+   store (e.g. AFF4Image -> ZipSegment -> FileBackedObject), never the
+   other way.
+
    This strategy ensures that there is only a single thread at a time
-   which can touch any aff4 data structures. This is done to protect
+   which can touch any shared aff4 data structures. This is done to protect
    talloc contexts from data races. It is usually sufficient to allow
    threads to run when performing cpu intensive operations
    (e.g. crypto or compression), or waiting in system calls. In
@@ -70,8 +95,22 @@ END_CLASS
 
 extern AFF4GlobalLock aff4_gl_lock;
 
+/* When built with AFF4_LOCK_STATS every acquisition of the global
+   lock is recorded against its call site - the time spent waiting
+   for it, the time it was held for and the recursion depth. The
+   report is printed by aff4_end() or may be requested at any time.
+*/
+#ifdef AFF4_LOCK_STATS
+int aff4_lock_site(const char *location, int times);
+void aff4_lock_stats_report(FILE *fd);
+
+#define AFF4_LOCK_SITE(times) aff4_lock_site(__location__, times)
+#else
+#define AFF4_LOCK_SITE(times) (times)
+#endif
+
    /* Use these on entry and exit from each function. */
-#define AFF4_GL_LOCK CALL(aff4_gl_lock, lock, 1);
+#define AFF4_GL_LOCK CALL(aff4_gl_lock, lock, AFF4_LOCK_SITE(1));
 #define AFF4_GL_UNLOCK CALL(aff4_gl_lock, unlock, 1);
 
    /* Use these when it is safe to allow other threads to run
@@ -79,7 +118,28 @@ extern AFF4GlobalLock aff4_gl_lock;
       allocate any AFF4 memory or access any AFF4 objects.
    */
 #define AFF4_BEGIN_ALLOW_THREADS {int _depth = CALL(aff4_gl_lock, allow_threads);
-#define AFF4_END_ALLOW_THREADS   CALL(aff4_gl_lock, lock, _depth); };
+#define AFF4_END_ALLOW_THREADS   CALL(aff4_gl_lock, lock, AFF4_LOCK_SITE(_depth)); };
+
+/* Thread local arenas.
+
+   Each thread may have a private talloc context which only it ever
+   touches. Since talloc only modifies the tree it works on, memory
+   may be allocated from (and freed into) the arena with threads
+   allowed. The arena is created on first use and freed when the
+   thread exits.
+
+   Arena memory must not be shared with other threads until it is
+   handed off to a shared owner with aff4_arena_handoff(), which
+   takes the global lock to steal it. Only the owning thread may
+   hand its memory off.
+*/
+void *aff4_arena(void);
+
+/* Move ptr from the calling thread's arena to ctx. Returns ptr. */
+void *aff4_arena_handoff(void *ctx, void *ptr);
+
+/* Free everything left in the calling thread's arena. */
+void aff4_arena_reset(void);
 
 
 /* This is a function that will be run when the library is imported. It
@@ -98,6 +158,11 @@ extern AFF4GlobalLock aff4_gl_lock;
   inline void name ## _init_2()
 
 #define HASH_TABLE_SIZE 256
+
+/* The hash table is doubled when the cache holds more than this many
+   objects per slot.
+*/
+#define CACHE_MAX_LOAD_FACTOR 2
 #define CACHE_SIZE 15
 
 /** A cache is an object which automatically expires data which is
@@ -110,6 +175,47 @@ PRIVATE enum Cache_policy {
   CACHE_EXPIRE_LEAST_USED
 };
 
+/* Keys up to this size are stored inside the cache entry itself */
+#define CACHE_INLINE_KEY_SIZE 64
+
+/* Cache entries are allocated this many at a time */
+#define CACHE_SLAB_SIZE 256
+
+/** A single entry in a Cache. Entries are not objects - they are
+    carved out of slabs owned by the Cache and recycled through its
+    free list, so adding to the cache does not need to allocate.
+*/
+struct cache_entry_t {
+  /* The key which is used to access the data. This points at
+     key_buffer for short keys.
+  */
+  char *key;
+  int key_len;
+
+  /* The full hash of the key - we keep it so we do not need to
+     recalculate it when rehashing or comparing keys.
+  */
+  unsigned int key_hash;
+
+  /* An opaque data object. The object will be talloc_stealed into the
+     cache object as we will be manging its memory.
+  */
+  Object data;
+
+  /* Entries are put into two lists - the cache_list contains all the
+     entries currently managed by us in order of least used to most
+     used at the tail of the list. The same entries are also present
+     on one of the hash lists which hang off the respective hash
+     table. The hash_list should be shorter to search linearly as it
+     only contains entries with the same hash. Free entries are kept
+     on the free_list through their cache_list.
+  */
+  struct list_head cache_list;
+  struct list_head hash_list;
+
+  char key_buffer[CACHE_INLINE_KEY_SIZE];
+};
+
 /** The Cache is an object which manages a cache of Object instances
     indexed by a key.
 
@@ -127,29 +233,14 @@ PRIVATE enum Cache_policy {
     and you must not use it (because it might be freed at any time).
 */
 PRIVATE CLASS(Cache, Object)
-/* The key which is used to access the data */
-     char *key;
-     int key_len;
-
-     /* An opaque data object and its length. The object will be
-        talloc_stealed into the cache object as we will be manging its
-        memory.
-     */
-     Object data;
-
-     /* Cache objects are put into two lists - the cache_list contains
-        all the cache objects currently managed by us in order of
-        least used to most used at the tail of the list. The same
-        objects are also present on one of the hash lists which hang
-        off the respective hash table. The hash_list should be shorter
-        to search linearly as it only contains objects with the same
-        hash.
+     /* All the entries in the cache (struct cache_entry_t) in order of
+        use.
      */
      struct list_head cache_list;
-     struct list_head hash_list;
 
-     /* This is a pointer to the head of the cache */
-     struct Cache_t *cache_head;
+     /* Unused entries ready to be handed out */
+     struct list_head free_list;
+
      enum Cache_policy policy;
 
      /* The current number of objects managed by this cache */
@@ -158,18 +249,22 @@ PRIVATE CLASS(Cache, Object)
      /* The maximum number of objects which should be managed */
      int max_cache_size;
 
-     /* A hash table of the keys */
-     int hash_table_width;
-     Cache *hash_table;
+     /* A hash table of the keys. Each slot is the head of a
+        hash_list. The width is always a power of 2 and the table is
+        grown as the cache fills up.
+     */
+     unsigned int hash_table_width;
+     struct list_head *hash_table;
 
-     /* These functions can be tuned to manage the hash table. The
-        default implementation assumes key is a null terminated
-        string.
+     /* These functions can be tuned to manage the hash table. hash
+        must return the full hash of the key - it is reduced to the
+        width of the table by the Cache.
      */
-     int METHOD(Cache, hash, char *key, int len);
-     int METHOD(Cache, cmp, char *other, int len);
+     unsigned int METHOD(Cache, hash, char *key, int len);
+     int METHOD(Cache, cmp, char *key, char *other, int len);
 
-     /** hash_table_width is the width of the hash table.
+     /** hash_table_width is the initial width of the hash table (it
+         is rounded up to a power of 2).
          if max_cache_size is 0, we do not expire items.
 
          DEFAULT(hash_table_width) = 100;
@@ -190,10 +285,10 @@ PRIVATE CLASS(Cache, Object)
      */
      BORROWED Object METHOD(Cache, borrow, char *key, int len);
 
-     /* Store the key, data in a new Cache object. The key and data will be
-        stolen.
+     /* Store the key, data in a new cache entry. The key is copied
+        and the data will be stolen.
      */
-     BORROWED Cache METHOD(Cache, put, char *key, int len, Object data);
+     int METHOD(Cache, put, char *key, int len, Object data);
 
      /* Returns true if the object is in cache */
      int METHOD(Cache, present, char *key, int len);
@@ -201,6 +296,10 @@ PRIVATE CLASS(Cache, Object)
      /* This returns an opaque reference to a cache iterator. Note:
         The cache must be locked the entire time between receiving the
         iterator and getting all the objects.
+
+        Iterating a cache which does not expire objects does not
+        modify it, so several threads may iterate it at once as long
+        as nothing is added or removed.
      */
      BORROWED Object METHOD(Cache, iter, char *key, int len);
      BORROWED Object METHOD(Cache, next, Object *iter);
@@ -237,50 +336,118 @@ extern Logger AFF4_LOGGER;
 #include "queue.h"
 
 /* A generic thread pool implementation. */
+struct ThreadPool_t;
+
 CLASS(ThreadPoolJob, Object)
   /* The thread which is running this job. */
   pthread_t thread_id;
 
+  /* The pool we were scheduled on, and our state there. done is set
+     by the worker once run() returns.
+  */
+  struct ThreadPool_t *pool;
+  volatile int done;
+
+  /* Threads inside wait() - complete() leaves freeing the job to the
+     last of them.
+  */
+  int waiters;
+  int completed;
+
+  /* Finished jobs are chained here until the pool completes them. */
+  struct ThreadPoolJob_t *next_completed;
+
+  /* Only the pool's complete() for this owner runs our complete() -
+     pools may be shared by unrelated users. Jobs without an owner
+     are completed by anyone.
+  */
+  void *owner;
+
   /* This actual function will be run in another thread. */
   void METHOD(ThreadPoolJob, run);
 
   /* This function will be run in the main thread when the pool calls
-     complete().
+     complete(). The job is freed afterwards unless this returns 0 -
+     the job then belongs to whoever complete() handed it to.
   */
   int METHOD(ThreadPoolJob, complete);
+
+  /* Wait up to timeout seconds for the job to finish running. This
+     is the job's future - returns 1 if the job is done, 0 on
+     timeout. The job remains valid until the pool completes it - if
+     that happens while we wait, the job is freed as we return.
+  */
+  int METHOD(ThreadPoolJob, wait, int timeout);
 END_CLASS
 
 
-struct Queue_t;
+struct RingQueue_t;
 
-CLASS(ThreadPool, Object)
-    struct Queue_t *jobs;
-    struct Queue_t *completed_jobs;
+/* Each worker owns a small ring of jobs. Workers which run out of
+   their own work steal from the other rings.
+*/
+#define THREAD_POOL_WORKER_QUEUE 2
 
+struct thread_pool_worker_t {
+  struct ThreadPool_t *pool;
+  struct RingQueue_t *jobs;
+  pthread_t thread;
+  int id;
+};
+
+CLASS(ThreadPool, Object)
+    struct thread_pool_worker_t *workers;
     int number_of_threads;
-    pthread_t *threads;
+
+    /* Round robin counter for jobs scheduled from outside the pool. */
+    volatile unsigned int next_worker;
+
+    /* Lets a worker find its own ring when it schedules new jobs. */
+    pthread_key_t current_worker;
+
+    /* Finished jobs waiting for complete() - a lock free stack. */
+    ThreadPoolJob volatile completed_jobs;
+
+    /* Idle workers and job waiters park here. */
+    pthread_mutex_t park_lock;
+    pthread_cond_t work_available;
+    pthread_cond_t job_done;
+    volatile int idle_workers;
+    volatile int job_waiters;
 
     // This can be set to False to cause all workers to quit.
-    int active;
+    volatile int active;
 
     ThreadPool METHOD(ThreadPool, Con, int number);
 
     /* Schedule the job on the thread pool. Timeout is the number of
        seconds we are prepared to wait to be scheduled.  Returns value
        is 1 for success and 0 for failure to schedule the task.
+
+       The pool takes ownership of the job. Jobs scheduled from a
+       worker thread are queued on that worker's own ring. If the
+       job can not be queued within the timeout we run it ourselves,
+       so it is never lost.
     */
     int METHOD(ThreadPool, schedule, ThreadPoolJob job, int timeout);
 
     /* Can be called regularly by the main thread to complete
-       any outstanding threads.
+       any outstanding threads. Calls the complete() method of every
+       finished job of the owner and of jobs without an owner (in the
+       order they finished) and frees them. Other finished jobs are
+       left for their owners. Returns the number of jobs completed.
     */
-    int METHOD(ThreadPool, complete);
+    int METHOD(ThreadPool, complete, void *owner);
 
     /* Terminate and Join all the workers. */
     void METHOD(ThreadPool, join);
 
 END_CLASS
 
+/* Returns the process wide thread pool, creating it on first use with
+   one worker per CPU. Never join this pool.
+*/
+ThreadPool AFF4_get_thread_pool(void);
 
 
 
@@ -123,8 +123,25 @@ CLASS(ZipFile, AFF4Volume)
 
     /* The file we are stored on. */
     FileLikeObject backing_store;
+
+    /* When writing, the backing store is wrapped in a BufferedWriter
+       of this size so the many small header writes are merged into
+       large sequential writes. Set before calling finish(), 0
+       disables the buffer.
+    */
+    unsigned int write_buffer_size;
+
+    /* The volume's graph is written to information.turtle on
+       close(). Unless this is cleared before close() it is also
+       written in the compact binary form (see RDFBinarySerializer),
+       which readers load in preference to the Turtle.
+    */
+    int binary_information;
 END_CLASS
 
+/* The default size of the write buffer in front of the backing store. */
+#define ZIP_WRITE_BUFFER_SIZE (1024 * 1024)
+
 #define ZIP_STORED 0
 #define ZIP_DEFLATE 8
 #endif   /* __ZIP_H */
@@ -46,4 +46,61 @@ CLASS(Queue, Object)
      void METHOD(Queue, join);
 END_CLASS
 
+/* A slot in the RingQueue. The sequence number tells producers and
+   consumers whose turn it is to use the slot.
+*/
+struct ring_cell_t {
+  volatile unsigned int sequence;
+  void *data;
+};
+
+/** A bounded lock free multi producer/multi consumer queue.
+
+    Unlike the Queue above, the RingQueue never allocates memory and
+    never touches the global lock on the fast path - all slots are
+    allocated by the constructor. Handing an item over is just a
+    compare and swap on the head or tail counter.
+
+    When the queue is full (or empty) the caller is parked on a
+    private condition variable, releasing the global lock first if
+    it is held. The RingQueue does not take ownership of its items -
+    the caller must arrange the memory ownership of the data (with
+    the global lock held) before putting it.
+*/
+CLASS(RingQueue, Object)
+     struct ring_cell_t *cells;
+     unsigned int mask;
+
+     /* Kept apart so producers and consumers do not share a cache
+        line.
+     */
+     volatile unsigned int tail;
+     char pad[64];
+     volatile unsigned int head;
+
+     /* Waiters park here - this lock is only taken on the slow
+        path.
+     */
+     pthread_mutex_t park_lock;
+     pthread_cond_t not_empty;
+     pthread_cond_t not_full;
+     volatile int getters_waiting;
+     volatile int putters_waiting;
+
+     /* The size is rounded up to the next power of 2. */
+     RingQueue METHOD(RingQueue, Con, unsigned int size);
+
+     /* Non blocking versions - return 0 (or NULL) immediately if the
+        queue is full (or empty).
+     */
+     int METHOD(RingQueue, try_put, void *data);
+     void *METHOD(RingQueue, try_get);
+
+     /* Blocking versions with the same semantics as the Queue
+        methods. Timeout is given in microseconds.
+     */
+     int METHOD(RingQueue, put, void *data, int64_t timeout);
+     void *METHOD(RingQueue, get, int64_t timeout);
+END_CLASS
+
 #endif       /* AFF4_QUEUE_H */
@@ -37,6 +37,12 @@ PRIVATE CLASS(ImageWorker, ThreadPoolJob)
      // we compress it all and dump it to the output file.
      StringIO bevy;
 
+     // We sit on the image's outstanding list until completed.
+     struct list_head list;
+
+     // Set by run() if the bevy could not be written.
+     int failed;
+
      ImageWorker METHOD(ImageWorker, Con, AFF4Image parent, int segment_count);
 
      // A write method for the worker
@@ -47,8 +53,10 @@ END_CLASS
 static ImageWorker ImageWorker_Con(ImageWorker self, AFF4Image parent, int segment_count) {
   self->image = parent;
   self->segment_count = segment_count;
+  ((ThreadPoolJob)self)->owner = parent;
 
   self->bevy = CONSTRUCT(StringIO, StringIO, Con, self);
+  INIT_LIST_HEAD(&self->list);
 
   return self;
 };
@@ -56,17 +64,63 @@ static ImageWorker ImageWorker_Con(ImageWorker self, AFF4Image parent, int segme
 
 static void ImageWorker_run(ThreadPoolJob this) {
   ImageWorker self = (ImageWorker) this;
-  RDFURN bevy_urn = CALL(URNOF(self->image), copy, self);
+  RDFURN bevy_urn;
   ZipFile zip;
   FileLikeObject segment, index_segment;
   Resolver resolver = ((AFFObject)(self->image))->resolver;
-  uint32_t chunk_offset = 0;
+  int chunk_size = self->image->chunk_size;
+  int chunk_count = (self->bevy->size + chunk_size - 1) / chunk_size;
+  uLong bound = compressBound(chunk_size);
   uint32_t compressed_offset = 0;
+  uint32_t *index;
+  char *cbevy;
+  void *arena = aff4_arena();
+  int res = Z_OK;
+  int i;
+
+  /* Compress the whole bevy without the global lock. Nobody else
+     touches our bevy, and the buffers come from our own arena.
+  */
+  AFF4_BEGIN_ALLOW_THREADS;
+
+  index = talloc_array(arena, uint32_t, chunk_count);
+  cbevy = talloc_size(arena, bound * chunk_count);
+
+  for(i=0; i<chunk_count && res == Z_OK; i++) {
+    uint32_t chunk_offset = i * chunk_size;
+    uLong length = min(chunk_size, self->bevy->size - chunk_offset);
+    uLongf clength = bound;
+
+    // The index points at the chunk's offset in the segment.
+    index[i] = compressed_offset;
+
+    // Should we offer to store chunks uncompressed?
+    if(self->image->compression == ZIP_STORED) {
+      memcpy(cbevy + compressed_offset, self->bevy->data + chunk_offset, length);
+      clength = length;
+    } else {
+      res = compress2((Bytef *)cbevy + compressed_offset, &clength,
+                      (Bytef *)self->bevy->data + chunk_offset, length, 1);
+    };
+
+    compressed_offset += clength;
+  };
+
+  AFF4_END_ALLOW_THREADS;
+
+  // The image reports the failure when it completes us.
+  self->failed = 1;
+
+  if(res != Z_OK)
+    goto exit;
 
+  bevy_urn = CALL(URNOF(self->image), copy, self);
   CALL(bevy_urn, add, talloc_asprintf(bevy_urn, "%08X", self->segment_count));
 
-  /* First open the segment so we can write on it. */
+  /* Now open the segments and write them out in one go. */
   zip = (ZipFile)CALL(resolver, own, self->image->stored, 'w');
+  if(!zip) goto exit;
+
   segment = (FileLikeObject)CALL((AFF4Volume)zip, open_member, bevy_urn, 'w', ZIP_STORED);
 
   CALL(bevy_urn, add, "idx");
@@ -74,102 +128,163 @@ static void ImageWorker_run(ThreadPoolJob this) {
 
   CALL(resolver, cache_return, (AFFObject)zip);
 
-  /* Now we compress chunks from our bevy into the segment. */
-  while(chunk_offset < self->bevy->size) {
-    uLong length = min(self->image->chunk_size, self->bevy->size - chunk_offset);
+  if(segment && index_segment) {
+    int length = chunk_count * sizeof(uint32_t);
 
-    // We just use compress() to get the compressed buffer.
-    uLongf clength = compressBound(self->image->chunk_size);
-    char cbuffer[clength];
-    char buffer[length];
+    self->failed = CALL(index_segment, write, (char *)index, length) != length ||
+      CALL(segment, write, cbevy, compressed_offset) != compressed_offset;
+  };
 
-    memcpy(buffer, self->bevy->data + chunk_offset, length);
+  if(segment && !CALL((AFFObject)segment, close))
+    self->failed = 1;
 
-    // Should we offer to store chunks uncompressed?
-    if(self->image->compression == ZIP_STORED) {
-      memcpy(cbuffer, buffer, length);
-      clength = length;
-    } else {
-      int res;
+  if(index_segment && !CALL((AFFObject)index_segment, close))
+    self->failed = 1;
 
-      /* This can run concurrently. */
-      AFF4_BEGIN_ALLOW_THREADS;
+ exit:
+  talloc_free(index);
+  talloc_free(cbevy);
 
-      res = compress2((Bytef *)cbuffer, &clength,
-                      (Bytef *)buffer, (uLong)length, 1);
+  // The error belongs to this bevy, not the worker thread.
+  if(self->failed)
+    ClearError();
+};
 
-      AFF4_END_ALLOW_THREADS;
 
-      if(res != Z_OK) {
-	RaiseError(ERuntimeError, "Compression error");
-        goto error;
-      };
-    };
 
-    // Update the index to point at the current segment stream buffer
-    // offset
-    CALL(index_segment, write, (char *)&compressed_offset, sizeof(uint32_t));
-    CALL(segment, write, cbuffer, clength);
-
-    compressed_offset += clength;
-    chunk_offset += length;
-  };
+/* Runs in the main thread once the bevy is written. */
+static int ImageWorker_complete(ThreadPoolJob this) {
+  ImageWorker self = (ImageWorker) this;
 
-  CALL((AFFObject)segment, close);
-  CALL((AFFObject)index_segment, close);
+  if(self->failed)
+    self->image->failed_bevies ++;
 
- error:
-  return;
+  list_del(&self->list);
+  return 1;
 };
 
+/* Schedule the current worker and reap any which are done. */
+static int schedule_worker(AFF4Image self) {
+  ImageWorker worker = self->current;
 
+  list_add_tail(&worker->list, &self->outstanding);
+  if(!CALL(self->thread_pool, schedule, (ThreadPoolJob)worker, 60)) {
+    list_del(&worker->list);
+    return 0;
+  };
+
+  CALL(self->thread_pool, complete, self);
+  return 1;
+};
 
 VIRTUAL(ImageWorker, ThreadPoolJob) {
   VMETHOD(Con) = ImageWorker_Con;
   VMETHOD_BASE(ThreadPoolJob, run) = ImageWorker_run;
+  VMETHOD_BASE(ThreadPoolJob, complete) = ImageWorker_complete;
 } END_VIRTUAL
 
 
+/* Read the parameters which are not set yet straight from the
+   resolver - this does not allocate anything.
+*/
+static void load_parameters(AFF4Image self) {
+  uint64_t value;
+
+  if(!self->chunk_size &&
+     CALL(RESOLVER, resolve_uint64, URNOF(self), AFF4_CHUNK_SIZE, &value))
+    self->chunk_size = value;
+
+  if(!self->compression &&
+     CALL(RESOLVER, resolve_uint64, URNOF(self), AFF4_COMPRESSION, &value))
+    self->compression = value;
+
+  if(!self->chunks_in_segment &&
+     CALL(RESOLVER, resolve_uint64, URNOF(self), AFF4_CHUNKS_IN_SEGMENT, &value))
+    self->chunks_in_segment = value;
+
+  // A new image starts out empty.
+  if(((AFFObject)self)->mode == 'r')
+    CALL(RESOLVER, resolve_uint64, URNOF(self), AFF4_SIZE, &self->size);
+};
+
+/* Record our parameters so the image can be read back. */
+static void save_parameters(AFF4Image self) {
+  XSDInteger value = new_XSDInteger(NULL);
+
+  CALL((AFFObject)self, set, AFF4_STORED, (RDFValue)self->stored);
+
+  value->value = self->chunk_size;
+  CALL((AFFObject)self, set, AFF4_CHUNK_SIZE, (RDFValue)value);
+
+  value->value = self->compression;
+  CALL((AFFObject)self, set, AFF4_COMPRESSION, (RDFValue)value);
+
+  value->value = self->chunks_in_segment;
+  CALL((AFFObject)self, set, AFF4_CHUNKS_IN_SEGMENT, (RDFValue)value);
+
+  value->value = self->size;
+  CALL((AFFObject)self, set, AFF4_SIZE, (RDFValue)value);
+
+  talloc_free(value);
+};
+
+
 static int AFF4Image_finish(AFFObject this) {
   AFF4Image self = (AFF4Image)this;
   int result;
 
   AFF4_GL_LOCK;
 
-  /* Update the size of the bevy */
-  self->bevy_size = self->chunk_size * self->chunks_in_segment;
-
-  switch(this->mode) {
+  if(!self->stored) {
+    self->stored = new_RDFURN(self);
 
-  case 'w': {
-    if(!self->stored) {
+    if(!CALL(RESOLVER, resolve_value, URNOF(self), AFF4_STORED,
+             (RDFValue)self->stored)) {
       RaiseError(EProgrammingError, "Image has no storage.");
       goto error;
     };
+  };
 
-    /* Set sensible defaults */
-    if(!self->chunk_size) {
-      self->chunk_size = 32 * 1024;
-    };
+  /* Anything the caller did not set comes from the resolver. */
+  load_parameters(self);
 
-    if(!self->compression) {
-      self->compression = ZIP_STORED;
-    };
+  /* Set sensible defaults */
+  if(!self->chunk_size) {
+    self->chunk_size = 32 * 1024;
+  };
 
-    if(!self->chunks_in_segment) {
-      self->chunks_in_segment = 1024;
-    };
+  if(!self->compression) {
+    self->compression = ZIP_STORED;
+  };
+
+  if(!self->chunks_in_segment) {
+    self->chunks_in_segment = 1024;
+  };
+
+  /* Update the size of the bevy */
+  self->bevy_size = self->chunk_size * self->chunks_in_segment;
 
+  switch(this->mode) {
+
+  case 'r': {
+    self->chunk_cache = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE,
+                                  AFF4_IMAGE_CHUNK_CACHE_SIZE);
+    self->last_chunk = -1;
+  }; break;
+
+  case 'w': {
     self->segment_count = 0;
     self->current = CONSTRUCT(ImageWorker, ImageWorker, Con, self, self, self->segment_count);
+    INIT_LIST_HEAD(&self->outstanding);
 
-    if(self->thread_count <= 0) {
-      self->thread_count = 1;
+    /* Share the cores with everyone else unless asked not to. */
+    if(self->thread_count > 0) {
+      self->thread_pool = CONSTRUCT(ThreadPool, ThreadPool,
+                                    Con, self, self->thread_count);
+    } else {
+      self->thread_pool = AFF4_get_thread_pool();
     };
 
-    self->thread_pool = CONSTRUCT(ThreadPool, ThreadPool,
-                                  Con, self, self->thread_count);
-
   }; break;
 
   default:
@@ -206,103 +321,201 @@ static int AFF4Image_write(FileLikeObject this, char *buffer, unsigned int lengt
 
     if(self->current->bevy->size >= self->bevy_size) {
       /* Flush the worker to the thread pool and get a new one. */
-      CALL(self->thread_pool, schedule, (ThreadPoolJob)self->current, 60);
+      schedule_worker(self);
 
       self->segment_count ++;
       self->current = CONSTRUCT(ImageWorker, ImageWorker, Con, self, self, self->segment_count);
     };
   } while(1);
 
+  self->size += length;
+
   AFF4_GL_UNLOCK;
   return length;
 };
 
 
-static int _partial_read(FileLikeObject this, char *buffer, int length) {
-  AFF4Image self = (AFF4Image)this;
-  int segment_number = this->readptr / self->bevy_size;
-  int segment_offset = this->readptr % self->bevy_size;
+/* Find the volume we are stored in. A volume somebody already has
+   open (even one still being written) is shared - otherwise we open
+   it, and set *opened so the caller returns it to the resolver.
+*/
+static ZipFile get_volume(AFF4Image self, int *opened) {
+  AFFObject result = CALL(RESOLVER, own, self->stored, 'r');
 
-  /* Find the correct segment */
-  RDFURN bevy = CALL(URNOF(self), copy, NULL);
-  ZipFile zip = (ZipFile)CALL(RESOLVER, own, self->stored, 'r');
-  FileLikeObject segment, index_segment;
-  int availbale_to_read;
+  *opened = 0;
+  if(!result)
+    result = CALL(RESOLVER, own, self->stored, 'w');
 
+  if(!result) {
+    result = CALL(RESOLVER, open, self->stored, 'r');
+    *opened = result != NULL;
+  };
 
-  CALL(bevy, add, talloc_asprintf(bevy, "%08X", segment_number));
+  return (ZipFile)result;
+};
 
-  segment = CALL((AFF4Volume)zip, open_member, bevy, 'r', 0);
+/* Load up to count chunks starting at chunk_id into the chunk
+   cache. The chunks are read from their bevy in one go and
+   decompressed with the global lock released. Returns the number of
+   chunks now in the cache, 0 past the end of the image.
+*/
+static int load_chunks(AFF4Image self, uint64_t chunk_id, int count) {
+  uint64_t segment_number = chunk_id / self->chunks_in_segment;
+  int first = chunk_id % self->chunks_in_segment;
+  RDFURN bevy = CALL(URNOF(self), copy, NULL);
+  uint32_t *offsets = talloc_array(bevy, uint32_t, self->chunks_in_segment + 1);
+  ZipFile zip;
+  ZipSegment segment, index_segment;
+  char *compressed;
+  uint32_t base;
+  int chunks, i, length;
+  int opened, result = 0;
 
-  CALL(bevy, add, "idx");
-  index_segment = CALL((AFF4Volume)zip, open_member, bevy, 'r', 0);
+  zip = get_volume(self, &opened);
+  if(!zip) goto exit;
 
-  CALL(RESOLVER, cache_return, (AFFObject)zip);
+  CALL(bevy, add, talloc_asprintf(bevy, "%08X", (unsigned int)segment_number));
+  segment = (ZipSegment)CALL((AFF4Volume)zip, open_member, bevy, 'r', 0);
 
-  if(segment && index_segment) {
-    int chunk_number = segment_offset / self->chunk_size;
-    int chunk_offset = segment_offset % self->chunk_size;
-    uint32_t chunk_data_offsets[self->chunks_in_segment];
-    char uncompressed_buffer[self->chunk_size];
-    int read_length;
-
-    /* Read all the indexes into the chunk_data_offsets array */
-    CALL(index_segment, read, (char *)&chunk_data_offsets,
-         self->chunks_in_segment * sizeof(uint32_t));
-    CALL(segment, seek, chunk_data_offsets[chunk_number], SEEK_SET);
-    switch(self->compression) {
-
-    case ZIP_DEFLATE: {
-      /* Temporary storage for the compressed chunk. Zlib doesnt mind
-         if we read a bit extra and this avoids us having to calculate
-         the size of the chunks.
-      */
-      const Bytef compressed_chunk[self->chunk_size];
-      int res;
-
-      CALL(segment, read, (char *)compressed_chunk, self->chunk_size);
-
-      AFF4_BEGIN_ALLOW_THREADS;
-
-      // Try to decompress it:
-      res = uncompress(uncompressed_buffer, &read_length, compressed_chunk,
-                       (uLong)self->chunk_size);
-
-      AFF4_END_ALLOW_THREADS;
-
-      if(res != Z_OK ) {
-        RaiseError(ERuntimeError, "Unable to decompress chunk %d", chunk_number);
-        goto error;
-      };
-    }; break;
-
-    case ZIP_STORED:
-    default: {
-      read_length = CALL(segment, read, uncompressed_buffer, self->chunk_size);
-    }; break;
-    };
+  CALL(bevy, add, "idx");
+  index_segment = (ZipSegment)CALL((AFF4Volume)zip, open_member, bevy, 'r', 0);
 
-    /* Now copy the partial buffer. */
-    availbale_to_read = max(read_length - chunk_offset, length);
-    memcpy(buffer, uncompressed_buffer + chunk_offset, availbale_to_read);
+  // Past the end of the image.
+  if(!segment || !index_segment) {
+    ClearError();
+    goto return_zip;
   };
 
-  if(segment) {
-    CALL((AFFObject)segment, close);
-    talloc_free(segment);
+  /* The members belong to the volume and are shared with every other
+     reader so we must not close them, and must hold their locks
+     while we use their readptr.
+  */
+  chunks = min(index_segment->cd.file_size / sizeof(uint32_t),
+               self->chunks_in_segment);
+
+  AFF4_OBJECT_LOCK(index_segment);
+  CALL((FileLikeObject)index_segment, seek, 0, SEEK_SET);
+  length = CALL((FileLikeObject)index_segment, read, (char *)offsets,
+                chunks * sizeof(uint32_t));
+  AFF4_OBJECT_UNLOCK(index_segment);
+
+  if(length != chunks * sizeof(uint32_t)) {
+    RaiseError(EIOError, "Index of bevy %d is truncated", (int)segment_number);
+    goto return_zip;
   };
 
-  if(index_segment) {
-    CALL((AFFObject)index_segment, close);
-    talloc_free(index_segment);
+  offsets[chunks] = segment->cd.file_size;
+  count = min(count, chunks - first);
+  if(count <= 0) goto return_zip;
+
+  // A corrupted index must not send us outside the bevy.
+  for(i=first; i<first + count; i++) {
+    if(offsets[i] > offsets[i+1] || offsets[i+1] > segment->cd.file_size) {
+      RaiseError(EIOError, "Index of bevy %d is corrupted", (int)segment_number);
+      goto return_zip;
+    };
   };
 
-  talloc_free(bevy);
-  return availbale_to_read;
+  /* Read the compressed data for all the chunks at once. */
+  base = offsets[first];
+  length = offsets[first + count] - base;
+  compressed = talloc_size(bevy, length);
 
- error:
+  AFF4_OBJECT_LOCK(segment);
+  CALL((FileLikeObject)segment, seek, base, SEEK_SET);
+  length = CALL((FileLikeObject)segment, read, compressed, length);
+  AFF4_OBJECT_UNLOCK(segment);
+
+  if(length < 0) goto return_zip;
+
+  for(i=first; i<first + count; i++) {
+    uint64_t key = segment_number * self->chunks_in_segment + i;
+    uLong clength = offsets[i+1] - offsets[i];
+    uLongf chunk_length = self->chunk_size;
+    StringIO chunk;
+    int res = Z_OK;
+
+    if(CALL(self->chunk_cache, present, (char *)&key, sizeof(key))) {
+      result ++;
+      continue;
+    };
+
+    if(offsets[i+1] - base > length) {
+      RaiseError(EIOError, "Bevy %d is truncated", (int)segment_number);
+      break;
+    };
+
+    chunk = CONSTRUCT(StringIO, StringIO, Con, NULL);
+    CALL(chunk, seek, self->chunk_size, SEEK_SET);
+
+    // The chunk is private to us until it is in the cache.
+    AFF4_BEGIN_ALLOW_THREADS;
+    if(self->compression == ZIP_STORED) {
+      chunk_length = min(clength, chunk_length);
+      memcpy(chunk->data, compressed + offsets[i] - base, chunk_length);
+    } else {
+      res = uncompress((Bytef *)chunk->data, &chunk_length,
+                       (Bytef *)compressed + offsets[i] - base, clength);
+    };
+    AFF4_END_ALLOW_THREADS;
+
+    if(res != Z_OK) {
+      RaiseError(ERuntimeError, "Unable to decompress chunk %llu",
+                 (unsigned long long)key);
+      talloc_free(chunk);
+      break;
+    };
+
+    chunk->size = chunk_length;
+    CALL(self->chunk_cache, put, (char *)&key, sizeof(key), (Object)chunk);
+    result ++;
+  };
+
+ return_zip:
+  if(opened)
+    CALL(RESOLVER, cache_return, (AFFObject)zip);
+
+ exit:
   talloc_free(bevy);
-  return -1;
+  return result;
+};
+
+/* Read from the chunk under the readptr. Sequential access reads
+   ahead so the following chunks are decompressed in one go.
+*/
+static int _partial_read(FileLikeObject this, char *buffer, int length) {
+  AFF4Image self = (AFF4Image)this;
+  uint64_t chunk_id = this->readptr / self->chunk_size;
+  int chunk_offset = this->readptr % self->chunk_size;
+  StringIO chunk;
+  int result;
+
+  chunk = (StringIO)CALL(self->chunk_cache, borrow, (char *)&chunk_id,
+                         sizeof(chunk_id));
+  if(!chunk) {
+    int count = 1;
+
+    if(chunk_id == self->last_chunk + 1)
+      count = AFF4_IMAGE_READAHEAD;
+
+    if(!load_chunks(self, chunk_id, count))
+      return 0;
+
+    chunk = (StringIO)CALL(self->chunk_cache, borrow, (char *)&chunk_id,
+                           sizeof(chunk_id));
+    if(!chunk) return -1;
+  };
+
+  self->last_chunk = chunk_id;
+
+  if(chunk_offset >= chunk->size)
+    return 0;
+
+  result = min(length, chunk->size - chunk_offset);
+  memcpy(buffer, chunk->data + chunk_offset, result);
+  this->readptr += result;
+
+  return result;
 };
 
 
@@ -311,15 +524,17 @@ static int AFF4Image_read(FileLikeObject this, char *buffer, unsigned int length
   int offset = 0;
 
   AFF4_GL_LOCK;
+  AFF4_OBJECT_LOCK(self);
 
   while(length > 0) {
     int res = _partial_read(this, buffer + offset, length);
-    if(res == 0) break;
+    if(res <= 0) break;
 
     offset += res;
     length -= res;
   };
 
+  AFF4_OBJECT_UNLOCK(self);
   AFF4_GL_UNLOCK;
   return offset;
 };
@@ -327,21 +542,51 @@ static int AFF4Image_read(FileLikeObject this, char *buffer, unsigned int length
 
 static int AFF4Image_close(AFFObject this) {
   AFF4Image self = (AFF4Image) this;
+  int result = 1;
 
   AFF4_GL_LOCK;
 
-  printf("About to flush last bevy.");
+  /* Readers only need to drop their decompressed chunks. */
+  if(this->mode == 'r') {
+    talloc_free(self->chunk_cache);
+    self->chunk_cache = NULL;
+    goto exit;
+  };
 
   /* Flush the last worker */
-  CALL(self->thread_pool, schedule, (ThreadPoolJob)self->current, 60);
+  schedule_worker(self);
+
+  /* Wait for all our workers to finish */
+  while(!list_empty(&self->outstanding)) {
+    ImageWorker worker;
+
+    list_next(worker, &self->outstanding, list);
+    if(!CALL((ThreadPoolJob)worker, wait, 60)) {
+      RaiseError(ERuntimeError, "Timed out waiting for bevy %d",
+                 worker->segment_count);
+      result = 0;
+      break;
+    };
+
+    CALL(self->thread_pool, complete, self);
+  };
+
+  if(result && self->failed_bevies > 0) {
+    RaiseError(EIOError, "Unable to write %d bevies of %s", self->failed_bevies,
+               URNOF(self)->value);
+    result = 0;
+  };
+
+  if(result)
+    save_parameters(self);
 
-  /* Wait for all threads to finish */
-  CALL(self->thread_pool, join);
-  printf("Closing image.");
-  fflush(stdout);
+  /* A private pool is only ours. */
+  if(self->thread_count > 0)
+    CALL(self->thread_pool, join);
 
+ exit:
   AFF4_GL_UNLOCK;
-  return 1;
+  return result;
 };
 
 
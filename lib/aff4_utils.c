@@ -2,68 +2,150 @@
 
 #include "aff4_internal.h"
 
-/** FIXME - Need to implement hash table rebalancing */
-
-/** A destructor on the cache object to automatically unlink us from
-    the lists.
-*/
-static int Cache_destructor(void *this) {
-  Cache self = (Cache) this;
-  list_del(&self->cache_list);
-  list_del(&self->hash_list);
-
-  // We can automatically maintain a tally of elements in the cache
-  // because we have a reference to the main cache object here.
-  /* It is not a good idea to keep count of objects in the cache by
-     reference counting because they might be alive due to external
-     references (e.g. in python).
-  */
-     if(self->cache_head)
-       self->cache_head->cache_size--;
-
-  return 0;
-};
-
 /** A max_cache_size of 0 means we never expire anything */
 static Cache Cache_Con(Cache self, int hash_table_width, int max_cache_size) {
   AFF4_GL_LOCK;
 
-  self->hash_table_width = hash_table_width;
+  // The width must be a power of 2 so we can mask the hash.
+  self->hash_table_width = 16;
+  while((int)self->hash_table_width < hash_table_width)
+    self->hash_table_width <<= 1;
+
   self->max_cache_size = max_cache_size;
 
   INIT_LIST_HEAD(&self->cache_list);
-  INIT_LIST_HEAD(&self->hash_list);
-
-  // Install our destructor
-  talloc_set_destructor((void *)self, Cache_destructor);
+  INIT_LIST_HEAD(&self->free_list);
 
   AFF4_GL_UNLOCK;
   return self;
 };
 
-/** Quick and simple */
-static int Cache_hash(Cache self, char *key, int len) {
-  // Use int size to obtain the hashes this should be faster... NOTE
-  // that we dont process up to the last 3 bytes.
-  unsigned char *name = (unsigned char *)key;
-  // Alternate function - maybe faster?
-  //  unsigned uint32_t *name = (unsigned uint32_t *)key;
-  unsigned int result = 0;
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+/** MurmurHash3 (x86_32) by Austin Appleby, placed in the public
+    domain. It is fast and mixes well - URNs tend to share long
+    prefixes so a weak hash puts them all in the same few slots.
+*/
+static unsigned int Cache_hash(Cache self, char *key, int len) {
+  const unsigned char *data = (const unsigned char *)key;
+  int nblocks = len / 4;
+  uint32_t h1 = 0x9747b28c;
+  uint32_t c1 = 0xcc9e2d51;
+  uint32_t c2 = 0x1b873593;
+  uint32_t k1;
   int i;
-  int count = len / sizeof(*name);
 
-  for(i=0; i<count; i++)
-    result ^= name[i];
+  for(i=0; i<nblocks; i++) {
+    memcpy(&k1, data + i*4, sizeof(k1));
 
-  return result % self->hash_table_width;
+    k1 *= c1;
+    k1 = ROTL32(k1, 15);
+    k1 *= c2;
+
+    h1 ^= k1;
+    h1 = ROTL32(h1, 13);
+    h1 = h1 * 5 + 0xe6546b64;
+  };
+
+  // The tail
+  data += nblocks * 4;
+  k1 = 0;
+  switch(len & 3) {
+  case 3: k1 ^= data[2] << 16;
+  case 2: k1 ^= data[1] << 8;
+  case 1: k1 ^= data[0];
+    k1 *= c1;
+    k1 = ROTL32(k1, 15);
+    k1 *= c2;
+    h1 ^= k1;
+  };
+
+  // Finalization mix
+  h1 ^= len;
+  h1 ^= h1 >> 16;
+  h1 *= 0x85ebca6b;
+  h1 ^= h1 >> 13;
+  h1 *= 0xc2b2ae35;
+  h1 ^= h1 >> 16;
+
+  return h1;
 };
 
-static int Cache_cmp(Cache self, char *other, int len) {
-  return memcmp((char *)self->key, (char *)other, len);
+/** Returns the hash list head for the hash */
+#define HASH_SLOT(self, hash) (&(self)->hash_table[(hash) & ((self)->hash_table_width - 1)])
+
+static int Cache_cmp(Cache self, char *key, char *other, int len) {
+  return memcmp(key, other, len);
+};
+
+/** Grow the hash table to the new width and move all the entries
+    into their new slots. The cache_list keeps its order so expiry is
+    not affected.
+*/
+static void Cache_rehash(Cache self, unsigned int width) {
+  struct list_head *hash_table = talloc_array(self, struct list_head, width);
+  struct cache_entry_t *i, *tmp;
+  unsigned int j;
+
+  for(j=0; j<width; j++) {
+    INIT_LIST_HEAD(&hash_table[j]);
+  };
+
+  // Entries with the same key are always on the same hash list, so
+  // moving the old lists in order keeps them in insertion order
+  // (this is required for the iterators). The cache_list can not be
+  // used for this because iterating reorders it.
+  if(self->hash_table) {
+    for(j=0; j<self->hash_table_width; j++) {
+      list_for_each_entry_safe(i, tmp, &self->hash_table[j], hash_list) {
+        list_add_tail(&i->hash_list, &hash_table[i->key_hash & (width - 1)]);
+      };
+    };
+  };
+
+  talloc_free(self->hash_table);
+  self->hash_table = hash_table;
+  self->hash_table_width = width;
+};
+
+/** Take an entry off the free list, allocating a new slab if it is
+    empty. Slabs are only released when the cache is freed.
+*/
+static struct cache_entry_t *Cache_new_entry(Cache self) {
+  struct cache_entry_t *result;
+
+  if(list_empty(&self->free_list)) {
+    struct cache_entry_t *slab = talloc_array(self, struct cache_entry_t,
+                                              CACHE_SLAB_SIZE);
+    int j;
+
+    for(j=0; j<CACHE_SLAB_SIZE; j++) {
+      list_add_tail(&slab[j].cache_list, &self->free_list);
+    };
+  };
+
+  result = list_entry(self->free_list.next, struct cache_entry_t, cache_list);
+  list_del(&result->cache_list);
+
+  return result;
+};
+
+/** Unlink the entry from the cache and return it to the free
+    list. The caller is responsible for the entry's data.
+*/
+static void Cache_remove(Cache self, struct cache_entry_t *entry) {
+  list_del(&entry->hash_list);
+  list_move(&entry->cache_list, &self->free_list);
+
+  if(entry->key != entry->key_buffer)
+    talloc_free(entry->key);
+
+  entry->data = NULL;
+  self->cache_size--;
 };
 
 static int print_cache(Cache self) {
-  Cache i;
+  struct cache_entry_t *i;
 
   list_for_each_entry(i, &self->cache_list, cache_list) {
     printf("%s %p %p\n",(char *) i->key,i , i->data);
@@ -73,7 +155,7 @@ static int print_cache(Cache self) {
 };
 
 static int print_cache_urns(Cache self) {
-  Cache i;
+  struct cache_entry_t *i;
 
   list_for_each_entry(i, &self->cache_list, cache_list) {
     printf("%s %p %s\n",(char *) i->key,i , ((RDFURN)(i->data))->value);
@@ -82,11 +164,9 @@ static int print_cache_urns(Cache self) {
   return 0;
 };
 
-static Cache Cache_put(Cache self, char *key, int len, Object data) {
+static int Cache_put(Cache self, char *key, int len, Object data) {
   unsigned int hash;
-  Cache hash_list_head;
-  Cache new_cache;
-  Cache i;
+  struct cache_entry_t *entry;
 
   AFF4_GL_LOCK;
 
@@ -94,88 +174,94 @@ static Cache Cache_put(Cache self, char *key, int len, Object data) {
   // first to avoid the possibility that we might expire the same key
   // we are about to add.
   while(self->max_cache_size > 0 && self->cache_size >= self->max_cache_size) {
-    list_for_each_entry(i, &self->cache_list, cache_list) {
-      talloc_free(i);
-      break;
-    };
+    entry = list_entry(self->cache_list.next, struct cache_entry_t, cache_list);
+
+    // The data is only ours to free if nobody has taken it.
+    if(entry->data && talloc_parent(entry->data) == self)
+      talloc_free(entry->data);
+
+    Cache_remove(self, entry);
   };
 
-  if(!self->hash_table)
-    self->hash_table = talloc_array(self, Cache, self->hash_table_width);
+  if(!self->hash_table) {
+    Cache_rehash(self, self->hash_table_width);
+  } else if(self->cache_size >= self->hash_table_width * CACHE_MAX_LOAD_FACTOR) {
+    Cache_rehash(self, self->hash_table_width * 2);
+  };
 
   hash = CALL(self, hash, key, len);
-  assert(hash <= self->hash_table_width);
-
-  /** Note - this form allows us to extend Cache without worrying
-  about updating this method. We replicate the size of the object we
-  are automatically.
-  */
-  new_cache = CONSTRUCT_FROM_REFERENCE((Cache)CLASSOF(self), Con, self, HASH_TABLE_SIZE, 0);
-  // Make sure the new cache member knows where the list head is. We
-  // only keep stats about the cache here.
-  new_cache->cache_head = self;
+  entry = Cache_new_entry(self);
+
+  // Take a copy of the key - short keys live in the entry itself.
+  if(len <= CACHE_INLINE_KEY_SIZE) {
+    entry->key = entry->key_buffer;
+    memcpy(entry->key, key, len);
+  } else {
+    entry->key = talloc_memdup(self, key, len);
+  };
 
-  talloc_set_name(new_cache, "Cache key %s", key);
+  entry->key_len = len;
+  entry->key_hash = hash;
 
   // Take over the data
-  new_cache->key = talloc_memdup(new_cache, key, len);
-  new_cache->key_len = len;
-
-  new_cache->data = data;
+  entry->data = data;
   if(data)
-    talloc_steal(new_cache, data);
-
-  hash_list_head = self->hash_table[hash];
-  if(!hash_list_head) {
-    hash_list_head = self->hash_table[hash] = CONSTRUCT(Cache, Cache, Con, self,
-							HASH_TABLE_SIZE, -10);
-    talloc_set_name_const(hash_list_head, "Hash Head");
-  };
+    talloc_steal(self, data);
 
-  list_add_tail(&new_cache->hash_list, &self->hash_table[hash]->hash_list);
-  list_add_tail(&new_cache->cache_list, &self->cache_list);
+  list_add_tail(&entry->hash_list, HASH_SLOT(self, hash));
+  list_add_tail(&entry->cache_list, &self->cache_list);
   self->cache_size ++;
 
   AFF4_GL_UNLOCK;
-  return new_cache;
+  return 1;
+};
+
+/** Find the first entry with the key on the hash list, starting
+    after start. Returns NULL if there are no more.
+*/
+static struct cache_entry_t *Cache_find(Cache self, struct list_head *start,
+                                        char *key, int len, unsigned int hash) {
+  struct list_head *slot = HASH_SLOT(self, hash);
+  struct cache_entry_t *i;
+
+  for(i = list_entry(start->next, struct cache_entry_t, hash_list);
+      &i->hash_list != slot;
+      i = list_entry(i->hash_list.next, struct cache_entry_t, hash_list)) {
+    if(i->key_hash == hash && i->key_len == len && !CALL(self, cmp, i->key, key, len))
+      return i;
+  };
+
+  return NULL;
 };
 
 static Object Cache_get(Cache self, void *ctx, char *key, int len) {
-  int hash;
-  Cache hash_list_head;
-  Cache i;
+  unsigned int hash;
+  struct cache_entry_t *i;
 
   AFF4_GL_LOCK;
 
   if(!self->hash_table)
     goto error;
 
+  // There are 2 lists each entry is on - the hash list is a shorter
+  // list at the end of each hash table slot, while the cache list is
+  // a big list of all entries in the cache. We find the entry using
+  // the hash list, but expire the entry based on the cache list
+  // which is also kept in sorted order.
   hash = CALL(self, hash, key, len);
-  hash_list_head = self->hash_table[hash];
-  if(!hash_list_head)
-    goto error;
+  i = Cache_find(self, HASH_SLOT(self, hash), key, len, hash);
+  if(i) {
+    Object result = i->data;
 
-  // There are 2 lists each Cache object is on - the hash list is a
-  // shorter list at the end of each hash table slot, while the cache
-  // list is a big list of all objects in the cache. We find the
-  // object using the hash list, but expire the object based on the
-  // cache list which is also kept in sorted order.
-  list_for_each_entry(i, &hash_list_head->hash_list, hash_list) {
-    if(i->key_len == len && !CALL(i, cmp, key, len)) {
-      Object result = i->data;
-
-      // When we return the object we steal it to null.
-      if(result) {
-        talloc_steal(ctx, result);
-      };
+    // When we return the object we steal it to null.
+    if(result) {
+      talloc_steal(ctx, result);
+    };
 
-      // Now free the container - this will unlink it from the lists through its
-      // destructor.
-      talloc_free(i);
+    Cache_remove(self, i);
 
-      AFF4_GL_UNLOCK;
-      return result;
-    };
+    AFF4_GL_UNLOCK;
+    return result;
   };
 
   RaiseError(EKeyError, "Key '%s' not found in Cache", key);
@@ -186,9 +272,8 @@ static Object Cache_get(Cache self, void *ctx, char *key, int len) {
 
 
 static Object Cache_borrow(Cache self, char *key, int len) {
-  int hash;
-  Cache hash_list_head;
-  Cache i;
+  unsigned int hash;
+  struct cache_entry_t *i;
 
   AFF4_GL_LOCK;
 
@@ -196,21 +281,10 @@ static Object Cache_borrow(Cache self, char *key, int len) {
     goto error;
 
   hash = CALL(self, hash, key, len);
-  hash_list_head = self->hash_table[hash];
-  if(!hash_list_head)
-    goto error;
-
-  // There are 2 lists each Cache object is on - the hash list is a
-  // shorter list at the end of each hash table slot, while the cache
-  // list is a big list of all objects in the cache. We find the
-  // object using the hash list, but expire the object based on the
-  // cache list which is also kept in sorted order.
-  list_for_each_entry(i, &hash_list_head->hash_list, hash_list) {
-    if(i->key_len == len && !CALL(i, cmp, key, len)) {
-      AFF4_GL_UNLOCK;
-
-      return i->data;
-    };
+  i = Cache_find(self, HASH_SLOT(self, hash), key, len, hash);
+  if(i) {
+    AFF4_GL_UNLOCK;
+    return i->data;
   };
 
  error:
@@ -220,95 +294,49 @@ static Object Cache_borrow(Cache self, char *key, int len) {
 
 
 int Cache_present(Cache self, char *key, int len) {
-  int hash;
-  Cache hash_list_head;
-  Cache i;
+  unsigned int hash;
+  int result = 0;
 
   AFF4_GL_LOCK;
 
   if(self->hash_table) {
     hash = CALL(self, hash, key, len);
-    hash_list_head = self->hash_table[hash];
-    if(!hash_list_head)
-      goto exit;
-
-    list_for_each_entry(i, &hash_list_head->hash_list, hash_list) {
-      if(i->key_len == len && !CALL(i, cmp, key, len)) {
-        AFF4_GL_UNLOCK;
-        return 1;
-      };
-    };
+    result = Cache_find(self, HASH_SLOT(self, hash), key, len, hash) != NULL;
   };
 
- exit:
   AFF4_GL_UNLOCK;
-  return 0;
+  return result;
 };
 
 static Object Cache_iter(Cache self, char *key, int len) {
-  Cache i, hash_list_head;
-  int hash;
-
-  if(self->hash_table) {
-    hash = CALL(self, hash, key, len);
-    hash_list_head = self->hash_table[hash];
-    if(!hash_list_head)
-      goto error;
-
-    list_for_each_entry(i, &hash_list_head->hash_list, hash_list) {
-      // If we find ourselves pointing at the list head again we did
-      // not find it:
-      if(!i->cache_head)
-        goto error;
-
-      if(i->key_len == len && !CALL(i, cmp, key, len)) {
-        goto exit;
-      };
-    };
-  };
+  unsigned int hash;
 
- error:
-  return NULL;
+  if(!self->hash_table)
+    return NULL;
 
- exit:
-  return (Object)i;
+  hash = CALL(self, hash, key, len);
+  return (Object)Cache_find(self, HASH_SLOT(self, hash), key, len, hash);
 };
 
 static Object Cache_next(Cache self, Object *opaque_iter) {
-  Cache iter = (Cache)*opaque_iter;
-  Cache i;
-  char *key;
-  int len;
+  struct cache_entry_t *iter = (struct cache_entry_t *)*opaque_iter;
   Object result;
 
   if(!iter) return NULL;
 
-  key = iter->key;
-  len = iter->key_len;
-
   // Search for the next occurance. We must already be on the right
   // hash list
-  list_for_each_entry(i, &iter->hash_list, hash_list) {
-    // If we find ourselves pointing at the list head again we did
-    // not find it:
-    if(!i->cache_head) {
-      // Indicate no more elements
-      *opaque_iter = NULL;
-      break;
-    };
-
-    if(i->key_len == len && !CALL(i, cmp, key, len)) {
-      // Set the next element
-      *opaque_iter = (Object)i;
-      break;
-    };
-  };
+  *opaque_iter = (Object)Cache_find(self, &iter->hash_list, iter->key,
+                                    iter->key_len, iter->key_hash);
 
   // Now we return a reference to the original object
   result = iter->data;
 
-  // We refresh the current object in the cache:
-  list_move_tail(&iter->cache_list, &self->cache_list);
+  // We refresh the current object in the cache. There is no point if
+  // we never expire anything - this also means iterating does not
+  // modify the cache.
+  if(self->max_cache_size > 0)
+    list_move_tail(&iter->cache_list, &self->cache_list);
 
   return result;
 };
@@ -331,52 +359,200 @@ VIRTUAL(Cache, Object) {
 } END_VIRTUAL
 
 
+static int ThreadPoolJob_complete(ThreadPoolJob self) {
+  return 1;
+};
+
+static int ThreadPoolJob_wait(ThreadPoolJob self, int timeout) {
+  ThreadPool pool = self->pool;
+  struct timespec deadline;
+  int result;
+
+  if(self->done) return 1;
+
+  if(!pool) {
+    RaiseError(EProgrammingError, "Job was never scheduled.");
+    return 0;
+  };
+
+  deadline.tv_sec = time(NULL) + timeout;
+  deadline.tv_nsec = 0;
+
+  AFF4_GL_LOCK;
+
+  /* Keep the job alive while we do not hold the global lock. */
+  self->waiters ++;
+
+  AFF4_BEGIN_ALLOW_THREADS;
+
+  pthread_mutex_lock(&pool->park_lock);
+  __sync_fetch_and_add(&pool->job_waiters, 1);
+
+  while(!self->done) {
+    if(pthread_cond_timedwait(&pool->job_done, &pool->park_lock, &deadline))
+      break;
+  };
+
+  __sync_fetch_and_sub(&pool->job_waiters, 1);
+  pthread_mutex_unlock(&pool->park_lock);
+
+  AFF4_END_ALLOW_THREADS;
+
+  self->waiters --;
+  result = self->done;
+
+  if(self->completed && self->waiters == 0)
+    talloc_free(self);
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
 VIRTUAL(ThreadPoolJob, Object) {
+  VMETHOD(complete) = ThreadPoolJob_complete;
+  VMETHOD(wait) = ThreadPoolJob_wait;
+
   UNIMPLEMENTED(ThreadPoolJob, run);
 } END_VIRTUAL
 
 
+/* Look for work - first in our own ring, then steal from the other
+   workers.
+*/
+static ThreadPoolJob find_job(struct thread_pool_worker_t *worker) {
+  ThreadPool pool = worker->pool;
+  ThreadPoolJob job;
+  int i;
+
+  for(i=0; i<pool->number_of_threads; i++) {
+    int victim = (worker->id + i) % pool->number_of_threads;
+
+    job = CALL(pool->workers[victim].jobs, try_get);
+    if(job) return job;
+  };
+
+  return NULL;
+};
+
+static void push_completed(ThreadPool pool, ThreadPoolJob job) {
+  ThreadPoolJob head;
+
+  do {
+    head = pool->completed_jobs;
+    job->next_completed = head;
+  } while(!__sync_bool_compare_and_swap(&pool->completed_jobs, head, job));
+};
+
+/* Publish a finished job to complete() and wake anyone waiting on
+   it.
+*/
+static void finish_job(ThreadPool pool, ThreadPoolJob job) {
+  job->done = 1;
+
+  /* The job may be freed by complete() as soon as it is on the stack
+     so we must not touch it after this.
+  */
+  push_completed(pool, job);
+
+  if(pool->job_waiters > 0) {
+    pthread_mutex_lock(&pool->park_lock);
+    pthread_cond_broadcast(&pool->job_done);
+    pthread_mutex_unlock(&pool->park_lock);
+  };
+};
+
 static void *ThreadPool_worker(void *ctx) {
-  ThreadPool pool = (ThreadPool) ctx;
+  struct thread_pool_worker_t *worker = (struct thread_pool_worker_t *)ctx;
+  ThreadPool pool = worker->pool;
 
-  AFF4_GL_LOCK;
+  pthread_setspecific(pool->current_worker, worker);
 
   while(1) {
-    /* One hundredth of a second time resolution for cancelation. */
-    ThreadPoolJob job;
+    ThreadPoolJob job = find_job(worker);
 
-    job = CALL(pool->jobs, get, 100000);
     if(job) {
-      // Run the job
+      // Run the job - waiting for jobs does not need the global lock.
+      AFF4_GL_LOCK;
+      job->thread_id = pthread_self();
       CALL(job, run);
+      AFF4_GL_UNLOCK;
 
-      /* Only quit if the pool is not active and there are no more
-         waiting tasks.
-      */
-    } else if(!pool->active) {
-      break;
+      finish_job(pool, job);
+      continue;
+    };
+
+    /* Only quit if the pool is not active and there are no more
+       waiting tasks.
+    */
+    if(!pool->active) break;
+
+    /* Park until new work is scheduled or the pool is joined. We
+       count ourselves idle before looking again, so a scheduler can
+       not miss us, and join() wakes us under park_lock.
+    */
+    pthread_mutex_lock(&pool->park_lock);
+    __sync_fetch_and_add(&pool->idle_workers, 1);
+
+    job = find_job(worker);
+    if(!job && pool->active)
+      pthread_cond_wait(&pool->work_available, &pool->park_lock);
+
+    __sync_fetch_and_sub(&pool->idle_workers, 1);
+    pthread_mutex_unlock(&pool->park_lock);
+
+    if(job) {
+      AFF4_GL_LOCK;
+      job->thread_id = pthread_self();
+      CALL(job, run);
+      AFF4_GL_UNLOCK;
+
+      finish_job(pool, job);
     };
   };
 
-  AFF4_GL_UNLOCK;
   return NULL;
 };
 
 
+static int ThreadPool_destructor(void *this) {
+  ThreadPool self = (ThreadPool)this;
+
+  pthread_key_delete(self->current_worker);
+  pthread_mutex_destroy(&self->park_lock);
+  pthread_cond_destroy(&self->work_available);
+  pthread_cond_destroy(&self->job_done);
+
+  return 0;
+};
+
 static ThreadPool ThreadPool_Con(ThreadPool self, int number) {
   int i = 0;
 
   AFF4_GL_LOCK;
 
-  self->jobs = CONSTRUCT(Queue, Queue, Con, self, number);
-  self->completed_jobs = CONSTRUCT(Queue, Queue, Con, self, number);
+  if(number <= 0) number = 1;
+
   self->number_of_threads = number;
-  self->threads = talloc_array(self, pthread_t, number + 1);
+  self->workers = talloc_array(self, struct thread_pool_worker_t, number);
   self->active = True;
 
+  pthread_key_create(&self->current_worker, NULL);
+  pthread_mutex_init(&self->park_lock, NULL);
+  pthread_cond_init(&self->work_available, NULL);
+  pthread_cond_init(&self->job_done, NULL);
+  talloc_set_destructor((void *)self, ThreadPool_destructor);
+
+  for(i = 0; i<number; i++) {
+    self->workers[i].pool = self;
+    self->workers[i].id = i;
+    self->workers[i].jobs = CONSTRUCT(RingQueue, RingQueue, Con, self,
+                                      THREAD_POOL_WORKER_QUEUE);
+  };
+
   /* Start up all the threads. */
   for(i = 0; i<number; i++) {
-    pthread_create(&self->threads[i], NULL, ThreadPool_worker, self);
+    pthread_create(&self->workers[i].thread, NULL, ThreadPool_worker,
+                   &self->workers[i]);
   };
 
   AFF4_GL_UNLOCK;
@@ -386,29 +562,128 @@ static ThreadPool ThreadPool_Con(ThreadPool self, int number) {
 
 static int ThreadPool_schedule(ThreadPool self, ThreadPoolJob job, 
                                int timeout) {
-  int result;
+  struct thread_pool_worker_t *worker;
+  int is_worker = 1;
+  int result = 0;
+  int i;
 
   AFF4_GL_LOCK;
 
-  result = CALL(self->jobs, put, job, timeout * 1000000);
+  /* The rings do not own their items so we hold the job for them. */
+  talloc_steal(self, job);
+  job->pool = self;
+  job->done = 0;
+  job->completed = 0;
+
+  /* Workers keep the jobs they create - everyone else spreads them
+     around.
+  */
+  worker = pthread_getspecific(self->current_worker);
+  if(!worker || worker->pool != self) {
+    unsigned int next = __sync_fetch_and_add(&self->next_worker, 1);
+
+    worker = &self->workers[next % self->number_of_threads];
+    is_worker = 0;
+  };
+
+  /* If that ring is full try the others before we block. */
+  for(i=0; i<self->number_of_threads && !result; i++) {
+    int id = (worker->id + i) % self->number_of_threads;
+
+    result = CALL(self->workers[id].jobs, try_put, job);
+  };
+
+  /* A worker must never block on the rings - if all the workers did
+     we would deadlock.
+  */
+  if(!result && !is_worker)
+    result = CALL(worker->jobs, put, job, (int64_t)timeout * 1000000);
+
+  /* The pool already owns the job so it must not be dropped - just
+     run it ourselves.
+  */
+  if(!result) {
+    job->thread_id = pthread_self();
+    CALL(job, run);
+    finish_job(self, job);
+
+    AFF4_GL_UNLOCK;
+    return 1;
+  };
+
+  /* Wake up an idle worker. */
+  __sync_synchronize();
+  if(result && self->idle_workers > 0) {
+    pthread_mutex_lock(&self->park_lock);
+    pthread_cond_signal(&self->work_available);
+    pthread_mutex_unlock(&self->park_lock);
+  };
 
   AFF4_GL_UNLOCK;
 
   return result;
 };
 
+static int ThreadPool_complete(ThreadPool self, void *owner) {
+  ThreadPoolJob job, finished = NULL;
+  int result = 0;
+
+  AFF4_GL_LOCK;
+
+  /* Take the whole stack at once and reverse it so jobs complete in
+     the order they finished.
+  */
+  job = __sync_lock_test_and_set(&self->completed_jobs, NULL);
+  while(job) {
+    ThreadPoolJob next = job->next_completed;
+
+    job->next_completed = finished;
+    finished = job;
+    job = next;
+  };
+
+  while(finished) {
+    job = finished;
+    finished = job->next_completed;
+
+    if(job->owner && job->owner != owner) {
+      // Leave it for its owner.
+      push_completed(self, job);
+      continue;
+    };
+
+    result ++;
+
+    /* The job was handed to a new owner. */
+    if(!CALL(job, complete))
+      continue;
+
+    if(job->waiters > 0) {
+      job->completed = 1;
+    } else {
+      talloc_free(job);
+    };
+  };
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
 static void ThreadPool_join(ThreadPool self) {
   int i;
-  int depth;
 
   AFF4_GL_LOCK;
   self->active = False;
 
+  pthread_mutex_lock(&self->park_lock);
+  pthread_cond_broadcast(&self->work_available);
+  pthread_mutex_unlock(&self->park_lock);
+
   /* Wait for the workers to quit. */
   for(i=0; i < self->number_of_threads; i++) {
     /* Allow other threads to run while we wait here. */
     AFF4_BEGIN_ALLOW_THREADS;
-    pthread_join(self->threads[i], NULL);
+    pthread_join(self->workers[i].thread, NULL);
     AFF4_END_ALLOW_THREADS;
   };
 
@@ -419,13 +694,219 @@ static void ThreadPool_join(ThreadPool self) {
 VIRTUAL(ThreadPool, Object) {
   VMETHOD(Con) = ThreadPool_Con;
   VMETHOD(schedule) = ThreadPool_schedule;
+  VMETHOD(complete) = ThreadPool_complete;
   VMETHOD(join) = ThreadPool_join;
 } END_VIRTUAL
 
 
+static ThreadPool AFF4_THREAD_POOL = NULL;
+
+ThreadPool AFF4_get_thread_pool(void) {
+  AFF4_GL_LOCK;
+
+  if(!AFF4_THREAD_POOL) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    AFF4_THREAD_POOL = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL,
+                                 cpus > 0 ? cpus : 1);
+  };
+
+  AFF4_GL_UNLOCK;
+  return AFF4_THREAD_POOL;
+};
+
+
+#ifdef AFF4_LOCK_STATS
+/* Global lock instrumentation. All the statistics are only updated
+   by the thread which holds the global lock, so they need no locking
+   of their own. Storage is static so we never allocate while
+   acquiring the lock.
+*/
+#define LOCK_STATS_SITES 1024
+#define LOCK_STATS_BUCKETS 24
+
+struct lock_site_stats_t {
+  const char *location;
+  uint64_t count;
+
+  // Times are in microseconds.
+  uint64_t wait_total;
+  uint64_t wait_max;
+  uint64_t hold_total;
+  uint64_t hold_max;
+  uint64_t condition_total;
+  int max_depth;
+
+  // Log2 histograms - bucket n counts times in [2^(n-1), 2^n).
+  uint32_t wait_histogram[LOCK_STATS_BUCKETS];
+  uint32_t hold_histogram[LOCK_STATS_BUCKETS];
+};
+
+static struct lock_site_stats_t lock_sites[LOCK_STATS_SITES];
+static pthread_key_t lock_site_key;
+
+/* The outermost acquisition currently holding the lock. */
+static struct lock_site_stats_t *hold_site = NULL;
+static uint64_t hold_start;
+
+static uint64_t lock_stats_now(void) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+};
+
+static void lock_stats_histogram(uint32_t *histogram, uint64_t value) {
+  int bucket = 0;
+
+  while(value && bucket < LOCK_STATS_BUCKETS - 1) {
+    value >>= 1;
+    bucket ++;
+  };
+
+  histogram[bucket] ++;
+};
+
+/* Find the record for a call site. The table is open addressed on
+   the location string - if it fills up the remaining sites share
+   the last slot.
+*/
+static struct lock_site_stats_t *lock_stats_site(const char *location) {
+  unsigned int hash = 5381;
+  const char *i;
+  int j;
+
+  if(!location) location = "unknown";
+
+  for(i=location; *i; i++)
+    hash = hash * 33 + *i;
+
+  for(j=0; j<LOCK_STATS_SITES - 1; j++) {
+    struct lock_site_stats_t *site = &lock_sites[(hash + j) % (LOCK_STATS_SITES - 1)];
+
+    if(!site->location) {
+      site->location = location;
+      return site;
+    };
+
+    if(site->location == location || !strcmp(site->location, location))
+      return site;
+  };
+
+  lock_sites[LOCK_STATS_SITES - 1].location = "other";
+  return &lock_sites[LOCK_STATS_SITES - 1];
+};
+
+int aff4_lock_site(const char *location, int times) {
+  if(aff4_gl_lock)
+    pthread_setspecific(lock_site_key, location);
+
+  return times;
+};
+
+/* Called with the lock held after every acquisition. */
+static void lock_stats_acquired(AFF4GlobalLock self, uint64_t start, int owned) {
+  const char *location = pthread_getspecific(lock_site_key);
+  struct lock_site_stats_t *site;
+  uint64_t now = lock_stats_now();
+
+  // Internal re-locking (e.g. in timedwait) is not a new call site.
+  if(owned && !location) return;
+
+  site = lock_stats_site(location);
+
+  site->count ++;
+  if(self->depth > site->max_depth)
+    site->max_depth = self->depth;
+
+  // Recursive acquisitions never wait and are part of the outer hold.
+  if(!owned) {
+    uint64_t wait = now - start;
+
+    site->wait_total += wait;
+    if(wait > site->wait_max) site->wait_max = wait;
+    lock_stats_histogram(site->wait_histogram, wait);
+
+    hold_site = site;
+    hold_start = now;
+  };
+
+  pthread_setspecific(lock_site_key, NULL);
+};
+
+/* Called with the lock held just before it is completely released. */
+static void lock_stats_released(void) {
+  uint64_t hold;
+
+  if(!hold_site) return;
+
+  hold = lock_stats_now() - hold_start;
+  hold_site->hold_total += hold;
+  if(hold > hold_site->hold_max) hold_site->hold_max = hold;
+  lock_stats_histogram(hold_site->hold_histogram, hold);
+
+  hold_site = NULL;
+};
+
+static int lock_stats_compare(const void *a, const void *b) {
+  const struct lock_site_stats_t *x = a, *y = b;
+
+  if(x->wait_total + x->hold_total < y->wait_total + y->hold_total) return 1;
+  if(x->wait_total + x->hold_total > y->wait_total + y->hold_total) return -1;
+  return 0;
+};
+
+static void lock_stats_print_histogram(FILE *fd, char *name, uint32_t *histogram) {
+  int i;
+
+  fprintf(fd, "    %s:", name);
+  for(i=0; i<LOCK_STATS_BUCKETS; i++) {
+    if(histogram[i])
+      fprintf(fd, " <%llu:%u", 1ULL << i, histogram[i]);
+  };
+  fprintf(fd, "\n");
+};
+
+void aff4_lock_stats_report(FILE *fd) {
+  struct lock_site_stats_t sites[LOCK_STATS_SITES];
+  int i;
+
+  AFF4_GL_LOCK;
+  memcpy(sites, lock_sites, sizeof(sites));
+  AFF4_GL_UNLOCK;
+
+  qsort(sites, LOCK_STATS_SITES, sizeof(*sites), lock_stats_compare);
+
+  fprintf(fd, "Global lock statistics (times in microseconds):\n");
+  fprintf(fd, "%-40s %10s %12s %10s %12s %10s %12s %5s\n", "Site", "Count",
+          "Wait", "Max wait", "Hold", "Max hold", "Condition", "Depth");
+
+  for(i=0; i<LOCK_STATS_SITES; i++) {
+    struct lock_site_stats_t *site = &sites[i];
+
+    if(!site->location) continue;
+
+    fprintf(fd, "%-40s %10llu %12llu %10llu %12llu %10llu %12llu %5d\n",
+            site->location, (unsigned long long)site->count,
+            (unsigned long long)site->wait_total,
+            (unsigned long long)site->wait_max,
+            (unsigned long long)site->hold_total,
+            (unsigned long long)site->hold_max,
+            (unsigned long long)site->condition_total, site->max_depth);
+
+    lock_stats_print_histogram(fd, "wait", site->wait_histogram);
+    lock_stats_print_histogram(fd, "hold", site->hold_histogram);
+  };
+};
+#endif
+
 AFF4GlobalLock AFF4GlobalLock_Con(AFF4GlobalLock self) {
   pthread_mutexattr_t mutex_attr;
 
+#ifdef AFF4_LOCK_STATS
+  pthread_key_create(&lock_site_key, NULL);
+#endif
+
   pthread_mutexattr_init(&mutex_attr);
   pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
 
@@ -437,14 +918,24 @@ AFF4GlobalLock AFF4GlobalLock_Con(AFF4GlobalLock self) {
 
 void AFF4GlobalLock_lock(AFF4GlobalLock self, int number){
   int i;
+#ifdef AFF4_LOCK_STATS
+  int owned = pthread_equal(self->current_thread, pthread_self());
+  uint64_t start = lock_stats_now();
+#endif
 
   for(i=0; i<number; i++) {
     if(pthread_mutex_lock(&self->mutex) == 0) {
       self->depth ++;
+      self->current_thread = pthread_self();
     } else {
       printf("Error locking %08X\n", pthread_self());
     };
   };
+
+#ifdef AFF4_LOCK_STATS
+  if(number > 0)
+    lock_stats_acquired(self, start, owned);
+#endif
 };
 
 void AFF4GlobalLock_unlock(AFF4GlobalLock self, int number) {
@@ -453,8 +944,16 @@ void AFF4GlobalLock_unlock(AFF4GlobalLock self, int number) {
 
   number = min(number, self->depth);
 
+#ifdef AFF4_LOCK_STATS
+  if(number > 0 && number == self->depth)
+    lock_stats_released();
+#endif
+
   for(i=0; i<number; i++) {
     self->depth --;
+    if(self->depth == 0)
+      self->current_thread = 0;
+
     pthread_mutex_unlock(&self->mutex);
   };
 };
@@ -481,9 +980,31 @@ int AFF4GlobalLock_timedwait(AFF4GlobalLock self, pthread_cond_t *condition, int
      so we need to track it.
   */
   self->depth --;
+
+#ifdef AFF4_LOCK_STATS
+  /* Time spent waiting on the condition is not held or contended
+     time.
+  */
+  {
+    struct lock_site_stats_t *site = hold_site;
+    uint64_t wait_start;
+
+    lock_stats_released();
+    wait_start = lock_stats_now();
+#endif
+
   res = pthread_cond_timedwait(condition,
                                &self->mutex, &deadline);
   self->depth ++;
+  self->current_thread = pthread_self();
+
+#ifdef AFF4_LOCK_STATS
+    hold_start = lock_stats_now();
+    hold_site = site;
+    if(site)
+      site->condition_total += hold_start - wait_start;
+  };
+#endif
 
   /* Restore the lock level. */
   CALL(self, lock, depth - 1);
@@ -492,13 +1013,73 @@ int AFF4GlobalLock_timedwait(AFF4GlobalLock self, pthread_cond_t *condition, int
 
 
 static int AFF4GlobalLock_allow_threads(AFF4GlobalLock self) {
-  int depth = self->depth;
+  int depth;
+
+  /* Threads which do not hold the lock have nothing to release. */
+  if(!pthread_equal(self->current_thread, pthread_self()))
+    return 0;
+
+  depth = self->depth;
 
   CALL(self, unlock, depth);
   return depth;
 };
 
 
+/* Thread local arenas. The key is created once under the global
+   lock.
+*/
+static pthread_key_t arena_key;
+static int arena_key_created = 0;
+
+static void arena_destructor(void *arena) {
+  AFF4_GL_LOCK;
+  talloc_free(arena);
+  AFF4_GL_UNLOCK;
+};
+
+void *aff4_arena(void) {
+  void *arena;
+
+  if(arena_key_created) {
+    arena = pthread_getspecific(arena_key);
+    if(arena) return arena;
+  };
+
+  /* Creating the arena links it into talloc's null context (if
+     tracking is enabled) so needs the lock.
+  */
+  AFF4_GL_LOCK;
+
+  if(!arena_key_created) {
+    pthread_key_create(&arena_key, arena_destructor);
+    __sync_synchronize();
+    arena_key_created = 1;
+  };
+
+  arena = talloc_named_const(NULL, 0, "thread arena");
+  pthread_setspecific(arena_key, arena);
+
+  AFF4_GL_UNLOCK;
+  return arena;
+};
+
+void *aff4_arena_handoff(void *ctx, void *ptr) {
+  AFF4_GL_LOCK;
+  talloc_steal(ctx, ptr);
+  AFF4_GL_UNLOCK;
+
+  return ptr;
+};
+
+void aff4_arena_reset(void) {
+  if(arena_key_created) {
+    void *arena = pthread_getspecific(arena_key);
+
+    if(arena) talloc_free_children(arena);
+  };
+};
+
 VIRTUAL(AFF4GlobalLock, Object) {
   VMETHOD(Con) = AFF4GlobalLock_Con;
   VMETHOD(lock) = AFF4GlobalLock_lock;
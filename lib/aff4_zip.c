@@ -193,6 +193,11 @@ static int decompress_segment(ZipSegment self) {
     return 0;
   };
 
+  /* The backing store is shared with every other member of the
+     volume so we must hold it for our seek/read pairs.
+  */
+  AFF4_OBJECT_LOCK(zip->backing_store);
+
   CALL(zip->backing_store, seek, self->offset_of_file_header, SEEK_SET);
   CALL(zip->backing_store, read, (char *)&file_header, sizeof(file_header));
 
@@ -230,6 +235,7 @@ static int decompress_segment(ZipSegment self) {
 
     case ZIP_DEFLATE: {
       z_stream strm;
+      int res;
       unsigned char *cbuff = talloc_size(NULL, self->cd.compress_size);
       int length = CALL(zip->backing_store, read, (char *)cbuff, self->cd.compress_size);
 
@@ -247,7 +253,16 @@ static int decompress_segment(ZipSegment self) {
         goto error;
       };
 
-      if(inflate(&strm, Z_FINISH) != Z_STREAM_END ||     \
+      /* We only need our private buffers now. */
+      AFF4_OBJECT_UNLOCK(zip->backing_store);
+
+      AFF4_BEGIN_ALLOW_THREADS;
+      res = inflate(&strm, Z_FINISH);
+      AFF4_END_ALLOW_THREADS;
+
+      AFF4_OBJECT_LOCK(zip->backing_store);
+
+      if(res != Z_STREAM_END ||                         \
          strm.total_out != self->cd.file_size) {
         RaiseError(ERuntimeError, "Failed to fully decompress chunk (%s)", strm.msg);
         talloc_free(cbuff);
@@ -264,10 +279,12 @@ static int decompress_segment(ZipSegment self) {
       goto error;
   };
 
+  AFF4_OBJECT_UNLOCK(zip->backing_store);
   CALL(oself->resolver, cache_return, (AFFObject)zip);
   return 1;
 
 error:
+  AFF4_OBJECT_UNLOCK(zip->backing_store);
   CALL(oself->resolver, cache_return, (AFFObject)zip);
   return 0;
 };
@@ -275,22 +292,32 @@ error:
 
 static int ZipSegment_read(FileLikeObject this, char *buffer, unsigned int length) {
   ZipSegment self = (ZipSegment)this;
-  int result;
+  int result = 0;
 
   AFF4_GL_LOCK;
+  AFF4_OBJECT_LOCK(self);
 
   /* Decompress entire segment on demand. */
   if(!self->buffer && !decompress_segment(self)) {
     goto error;
   };
 
-  CALL(self->buffer, seek, this->readptr, SEEK_SET);
-  result = CALL(self->buffer, read, buffer, length);
+  if(this->readptr < self->buffer->size)
+    result = min(length, self->buffer->size - this->readptr);
+
+  /* The buffer belongs to us and is protected by our lock. */
+  AFF4_BEGIN_ALLOW_THREADS;
+  memcpy(buffer, self->buffer->data + this->readptr, result);
+  AFF4_END_ALLOW_THREADS;
 
+  this->readptr += result;
+
+  AFF4_OBJECT_UNLOCK(self);
   AFF4_GL_UNLOCK;
   return result;
 
 error:
+  AFF4_OBJECT_UNLOCK(self);
   AFF4_GL_UNLOCK;
   return -1;
 };
@@ -298,7 +325,7 @@ error:
 
 /** This writes a zip64 end of central directory and a central
     directory locator */
-static void write_zip64_CD(ZipFile self, StringIO fd, uint64_t offset_of_end_cd,
+static void write_zip64_CD(ZipFile self, FileLikeObject fd, uint64_t offset_of_end_cd,
                            uint64_t directory_offset, int total_entries) {
   struct Zip64CDLocator locator;
   struct Zip64EndCD end_cd;
@@ -627,6 +654,54 @@ error:
 };
 
 
+/* The URN of the member holding the volume's graph in the format. */
+static RDFURN information_urn(ZipFile self, void *ctx, char *format) {
+  RDFURN urn = CALL(URNOF(self), copy, ctx);
+
+  CALL(urn, add, talloc_asprintf(urn, AFF4_INFORMATION "%s", format));
+
+  return urn;
+};
+
+/* Load the volume's graph. The binary form is much quicker to load
+   so we only fall back to the Turtle if it is missing or damaged.
+*/
+static void load_information(ZipFile self) {
+  ZipSegment segment, turtle = NULL, binary = NULL;
+  RDFParser parser;
+  char *turtle_name, *binary_name;
+
+  parser = CONSTRUCT(RDFParser, RDFParser, Con, NULL, ((AFFObject)self)->resolver);
+
+  turtle_name = segment_name_from_URN(parser, information_urn(self, parser, "turtle"),
+                                      URNOF(self));
+  binary_name = segment_name_from_URN(parser,
+                                      information_urn(self, parser, RDF_BINARY_FORMAT),
+                                      URNOF(self));
+
+  list_for_each_entry(segment, &self->members, members) {
+    if(!strcmp(segment->filename->value, turtle_name))
+      turtle = segment;
+    else if(!strcmp(segment->filename->value, binary_name))
+      binary = segment;
+  };
+
+  if(binary) {
+    if(CALL(parser, parse, (FileLikeObject)binary, RDF_BINARY_FORMAT,
+            URNOF(self)->value))
+      goto exit;
+
+    ClearError();
+  };
+
+  if(turtle) {
+    CALL(parser, parse, (FileLikeObject)turtle, "turtle", URNOF(self)->value);
+  };
+
+ exit:
+  talloc_free(parser);
+};
+
 static AFFObject ZipFile_Con(AFFObject this, RDFURN urn, char mode, Resolver resolver) {
   ZipFile self = (ZipFile)this;
   AFFObject result;
@@ -634,6 +709,8 @@ static AFFObject ZipFile_Con(AFFObject this, RDFURN urn, char mode, Resolver res
   AFF4_GL_LOCK;
 
   self->storage_urn = new_RDFURN(self);
+  self->write_buffer_size = ZIP_WRITE_BUFFER_SIZE;
+  self->binary_information = 1;
   INIT_LIST_HEAD(&self->members);
 
   result = SUPER(AFFObject, AFF4Volume, Con, urn, mode, resolver);
@@ -650,6 +727,14 @@ static int ZipFile_finish(AFFObject this) {
   AFF4_GL_LOCK;
   ClearError();
 
+  /* If we were not told where the volume lives the resolver may know. */
+  if(!self->storage_urn->parser->scheme &&
+     !CALL(this->resolver, resolve_value, this->urn, AFF4_STORED,
+           (RDFValue)self->storage_urn)) {
+    RaiseError(EIOError, "Volume %s is not stored anywhere.", this->urn->value);
+    goto error;
+  };
+
   self->backing_store = (FileLikeObject)CALL(
       this->resolver, create, self->storage_urn, AFF4_FILE, this->mode);
 
@@ -658,12 +743,28 @@ static int ZipFile_finish(AFFObject this) {
     goto error;
   };
 
+  /* Coalesce all our small writes into large ones. */
+  if(this->mode == 'w' && self->write_buffer_size > 0) {
+    BufferedWriter buffered = CONSTRUCT(BufferedWriter, BufferedWriter, Con, self,
+                                        self->backing_store, self->write_buffer_size);
+
+    if(!buffered)
+      goto error;
+
+    self->backing_store = (FileLikeObject)buffered;
+  };
+
   /* Parse the file as a zip file. */
   ZipFile_load_from_backing_store(self);
 
   /* Get the cache to manage our locking */
   result = SUPER(AFFObject, AFF4Volume, finish);
   CALL(this->resolver, manage, (AFFObject)self);
+  CALL(this, set, AFF4_STORED, (RDFValue)self->storage_urn);
+
+  /* Our members can only be read once we are managed. */
+  if(this->mode == 'r')
+    load_information(self);
 
   AFF4_GL_UNLOCK;
   return result;
@@ -721,17 +822,105 @@ static FileLikeObject ZipFile_open_member(AFF4Volume this, RDFURN member, char m
 };
 
 
+/* Open a new member for the volume's graph in the format. */
+static FileLikeObject open_information(ZipFile self, void *ctx, char *format) {
+  return CALL((AFF4Volume)self, open_member, information_urn(self, ctx, format),
+              'w', ZIP_DEFLATE);
+};
+
+/* Forget a member we could not write. */
+static void discard_member(FileLikeObject fd) {
+  list_del(&((ZipSegment)fd)->members);
+  talloc_free(fd);
+};
+
+/* Write the graph of the volume and everything stored in it. Returns
+   0 if the graph could not be written completely.
+*/
+static int write_information(ZipFile self) {
+  AFFObject this = (AFFObject)self;
+  void *ctx = talloc_size(NULL, 0);
+  RDFValue volume, subjects, i;
+  RDFSerializer serializer;
+  FileLikeObject fd;
+  int result = 0;
+
+  volume = (RDFValue)CALL(URNOF(self), copy, ctx);
+  INIT_LIST_HEAD(&volume->list);
+
+  /* Without the streams the volume can not be read back, so a store
+     which can not find them fails the close.
+  */
+  ClearError();
+  subjects = (RDFValue)CALL(this->resolver, resolve_subjects, ctx, AFF4_STORED,
+                            (RDFValue)URNOF(self));
+  if(!subjects && !CheckError(EZero)) {
+    RaiseError(ERuntimeError, "Unable to find the streams stored in %s",
+               URNOF(self)->value);
+    goto error;
+  };
+
+  if(subjects)
+    list_add_tail(&volume->list, &subjects->list);
+
+  fd = open_information(self, ctx, "turtle");
+  if(!fd) goto error;
+
+  serializer = CONSTRUCT(RDFSerializer, RDFSerializer, Con, ctx,
+                         URNOF(self)->value, fd, this->resolver);
+  if(serializer) {
+    CALL(serializer, serialize_urn, (RDFURN)volume);
+    list_for_each_entry(i, &volume->list, list) {
+      CALL(serializer, serialize_urn, (RDFURN)i);
+    };
+
+    CALL(serializer, close);
+    CALL((AFFObject)fd, close);
+  } else {
+    AFF4_LOG(AFF4_LOG_WARNING, AFF4_SERVICE_ZIP_VOLUME, URNOF(self),
+             "Unable to write the Turtle graph");
+    ClearError();
+    discard_member(fd);
+  };
+
+  if(self->binary_information) {
+    RDFBinarySerializer binary;
+
+    fd = open_information(self, ctx, RDF_BINARY_FORMAT);
+    if(!fd) goto error;
+
+    binary = CONSTRUCT(RDFBinarySerializer, RDFBinarySerializer, Con, ctx,
+                       fd, this->resolver);
+    if(!binary) {
+      discard_member(fd);
+      goto error;
+    };
+
+    CALL(binary, serialize_urn, (RDFURN)volume);
+    list_for_each_entry(i, &volume->list, list) {
+      CALL(binary, serialize_urn, (RDFURN)i);
+    };
+
+    CALL(binary, close);
+    CALL((AFFObject)fd, close);
+  };
+
+  result = 1;
+
+ error:
+  talloc_free(ctx);
+  return result;
+};
+
 /* Write the central directory on the end and finalize the zip file. */
 static int ZipFile_close(AFFObject this) {
   ZipFile self = (ZipFile)this;
   ZipSegment segment;
   StringIO zip64_header;
-  // We dont want to write small buffers
-  StringIO buffer;
   struct EndCentralDirectory end;
   uint64_t start_of_cd, offset_of_end_cd;
   int total_entries = 0;
-  int result;
+  int result, information;
 
   AFF4_GL_LOCK;
 
@@ -739,17 +928,16 @@ static int ZipFile_close(AFFObject this) {
   if(this->mode == 'r')
     goto exit;
 
-  buffer = CONSTRUCT(StringIO, StringIO, Con, NULL);
-  zip64_header = CONSTRUCT(StringIO, StringIO, Con, buffer);
-
-  // Preallocate memory
-  CALL(buffer,seek, 10*BUFF_SIZE, 0);
-  CALL(buffer,truncate, 0);
+  zip64_header = CONSTRUCT(StringIO, StringIO, Con, NULL);
   CALL(zip64_header, write, "\x01\x00\x00\x00", 4);
 
   AFF4_LOG(AFF4_LOG_MESSAGE, AFF4_SERVICE_ZIP_VOLUME, URNOF(this),
            "Closing ZipFile volume");
 
+  information = write_information(self);
+
+  // The backing store is buffered so we can write the CD records
+  // directly.
   start_of_cd = CALL(self->backing_store, seek, 0, SEEK_END);
 
   /* Iterate over all our members */
@@ -758,12 +946,6 @@ static int ZipFile_close(AFFObject this) {
     if(!segment->buffer) {
       total_entries ++;
 
-      // Flush the cache if needed
-      if(buffer->readptr > BUFF_SIZE * 10) {
-        CALL(self->backing_store, write, buffer->data, buffer->readptr);
-        CALL(buffer, truncate, 0);
-      };
-
       // We prepare the zip64 optional header.
       CALL(zip64_header, truncate, 4);
       if(segment->offset_of_file_header > ZIP64_LIMIT) {
@@ -786,12 +968,13 @@ static int ZipFile_close(AFFObject this) {
       // OK - write the cd header
       segment->cd.file_name_length = segment->filename->length;
 
-      CALL(buffer, write, (char *)&segment->cd, sizeof(segment->cd));
-      CALL(buffer, write, segment->filename->value, segment->filename->length);
+      CALL(self->backing_store, write, (char *)&segment->cd, sizeof(segment->cd));
+      CALL(self->backing_store, write, segment->filename->value,
+           segment->filename->length);
 
       // And any optional headers
       if(zip64_header->size > 4) {
-        CALL(buffer, write, zip64_header->data, zip64_header->size);
+        CALL(self->backing_store, write, zip64_header->data, zip64_header->size);
       };
     };
   };
@@ -799,12 +982,13 @@ static int ZipFile_close(AFFObject this) {
   // Now write an end of central directory record
   memset(&end, 0, sizeof(end));
   end.magic = 0x6054b50;
-  offset_of_end_cd = CALL(self->backing_store, tell) + buffer->size;
+  offset_of_end_cd = CALL(self->backing_store, tell);
   end.size_of_cd = offset_of_end_cd - start_of_cd;
 
   if(start_of_cd > ZIP64_LIMIT) {
     end.offset_of_cd = -1;
-    write_zip64_CD(self, buffer, offset_of_end_cd, start_of_cd, total_entries);
+    write_zip64_CD(self, self->backing_store, offset_of_end_cd, start_of_cd,
+                   total_entries);
   } else {
     end.offset_of_cd = start_of_cd;
   };
@@ -814,14 +998,16 @@ static int ZipFile_close(AFFObject this) {
   end.comment_len = strlen(URNOF(self)->value)+1;
 
   // Make sure to add our URN to the comment field in the end
-  CALL(buffer, write, (char *)&end, sizeof(end));
-  CALL(buffer, write, (char *)URNOF(self)->value, end.comment_len);
+  CALL(self->backing_store, write, (char *)&end, sizeof(end));
+  CALL(self->backing_store, write, (char *)URNOF(self)->value, end.comment_len);
 
-  /* Flush the buffers */
-  CALL(self->backing_store, write, buffer->data, buffer->readptr);
-  talloc_free(buffer);
+  talloc_free(zip64_header);
 
-  result = SUPER(AFFObject, AFF4Volume, close);
+  /* This flushes the buffers too. If anything could not be written
+     we must not claim success. */
+  result = CALL((AFFObject)self->backing_store, close);
+  if(!SUPER(AFFObject, AFF4Volume, close) || !information)
+    result = 0;
 
   AFF4_GL_UNLOCK;
   return result;
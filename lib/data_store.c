@@ -3,6 +3,10 @@
 ****************************************************/
 #include "aff4_internal.h"
 
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+
 
 static DataStoreObject DataStoreObject_Con(DataStoreObject self, char *data,
                                            unsigned int length, char *rdf_type) {
@@ -18,25 +22,189 @@ VIRTUAL(DataStoreObject, Object)
 END_VIRTUAL
 
 
+/* What we know about each of the MemoryDataStore's ids */
+struct memory_atom_t {
+  char *name;
+  int indexed;
+
+  /* For subjects - the ids of their attributes, 0 terminated. */
+  uint32_t *attributes;
+  int attribute_count;
+};
+
+/* The subjects with a particular value for an indexed attribute. */
+struct index_head_t {
+  struct list_head subjects;
+};
+
+struct index_node_t {
+  struct list_head list;
+  struct index_head_t *head;
+  uint64_t subject;
+};
+
+static int MemoryDataStore_destructor(void *this) {
+  MemoryDataStore self = (MemoryDataStore)this;
+
+  pthread_rwlock_destroy(&self->rwlock);
+
+  return 0;
+};
+
+/* The read locks each thread holds, for all the stores. A thread
+   only ever holds a few so a list is fine. These are not talloced
+   because readers do not take the global lock.
+*/
+struct read_depth_t {
+  struct read_depth_t *next;
+  MemoryDataStore store;
+  int depth;
+};
+
+static pthread_key_t read_depth_key;
+static int read_depth_key_created = 0;
+
+static void read_depth_destructor(void *data) {
+  struct read_depth_t *i = (struct read_depth_t *)data;
+
+  while(i) {
+    struct read_depth_t *next = i->next;
+
+    free(i);
+    i = next;
+  };
+};
+
 static DataStore DataStore_Con(DataStore this) {
   MemoryDataStore self = (MemoryDataStore)this;
   AFF4_GL_LOCK;
 
-  self->urn_db = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
-  self->attribute_db = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
+  // Created once under the global lock - stores are always
+  // constructed before anyone can lock them.
+  if(!read_depth_key_created) {
+    pthread_key_create(&read_depth_key, read_depth_destructor);
+    __sync_synchronize();
+    read_depth_key_created = 1;
+  };
+
+  self->atom_db = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
+  self->atom_info = talloc_zero_array(self, struct memory_atom_t, 16);
+  self->index_db = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
+  self->index_members = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
   self->data_db = CONSTRUCT(Cache, Cache, Con, self, 100, 0);
   self->id_counter = 0;
+  this->shared_reads = 1;
+
+#ifdef __GLIBC__
+  {
+    pthread_rwlockattr_t attr;
+
+    // The default lets a steady stream of readers starve writers.
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&self->rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+  };
+#else
+  pthread_rwlock_init(&self->rwlock, NULL);
+#endif
+  talloc_set_destructor((void *)self, MemoryDataStore_destructor);
 
   AFF4_GL_UNLOCK;
   return this;
 };
 
+static int get_read_depth(MemoryDataStore self) {
+  struct read_depth_t *i = pthread_getspecific(read_depth_key);
+
+  for(; i; i=i->next) {
+    if(i->store == self)
+      return i->depth;
+  };
+
+  return 0;
+};
+
+/* Entries are removed when the depth drops to 0 so a freed store is
+   never found again.
+*/
+static void set_read_depth(MemoryDataStore self, int depth) {
+  struct read_depth_t *head = pthread_getspecific(read_depth_key);
+  struct read_depth_t **i;
+
+  for(i=&head; *i; i=&(*i)->next) {
+    if((*i)->store == self) {
+      if(depth > 0) {
+        (*i)->depth = depth;
+      } else {
+        struct read_depth_t *old = *i;
+
+        *i = old->next;
+        free(old);
+        pthread_setspecific(read_depth_key, head);
+      };
+
+      return;
+    };
+  };
+
+  if(depth > 0) {
+    struct read_depth_t *new = malloc(sizeof(*new));
+
+    if(!new) return;
+
+    new->store = self;
+    new->depth = depth;
+    new->next = head;
+    pthread_setspecific(read_depth_key, new);
+  };
+};
+
+/* Readers take a shared lock and do not need the global lock. Each
+   thread only holds the read lock once however many times it locks
+   the store - taking it again could deadlock behind a waiting writer.
+*/
 static void DataStore_lock(DataStore this) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  int depth = get_read_depth(self);
+
+  if(depth == 0)
+    pthread_rwlock_rdlock(&self->rwlock);
+
+  set_read_depth(self, depth + 1);
 };
 
 static void DataStore_unlock(DataStore this) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  int depth = get_read_depth(self);
+
+  if(depth > 0) {
+    set_read_depth(self, depth - 1);
+
+    if(depth == 1)
+      pthread_rwlock_unlock(&self->rwlock);
+  };
 };
 
+/* Take the write lock. A read lock can not be upgraded - dropping
+   it would free the objects the reader borrowed - so a thread which
+   holds the store locked may not write to it.
+*/
+static int begin_write(MemoryDataStore self) {
+  if(get_read_depth(self) > 0) {
+    RaiseError(EProgrammingError, "Can not write to a store locked by this thread");
+    return 0;
+  };
+
+  pthread_rwlock_wrlock(&self->rwlock);
+  return 1;
+};
+
+static void end_write(MemoryDataStore self) {
+  pthread_rwlock_unlock(&self->rwlock);
+};
+
+/* Must be called with the write lock held. */
 static XSDInteger get_or_create(MemoryDataStore self, Cache cache, char *key) {
   XSDInteger result;
 
@@ -44,39 +212,196 @@ static XSDInteger get_or_create(MemoryDataStore self, Cache cache, char *key) {
   result = (XSDInteger)CALL(cache, borrow, ZSTRING_NO_NULL(key));
 
   if(!result) {
+    int size = talloc_get_size(self->atom_info) / sizeof(struct memory_atom_t);
+
     self->id_counter++;
     result = CONSTRUCT(XSDInteger, RDFValue, Con, self);
     CALL(result, set, self->id_counter);
     CALL(cache, put, ZSTRING_NO_NULL(key), (Object)result);
+
+    if(self->id_counter >= size) {
+      self->atom_info = talloc_realloc(self, self->atom_info, struct memory_atom_t,
+                                       size * 2);
+      memset(self->atom_info + size, 0, size * sizeof(struct memory_atom_t));
+    };
+
+    self->atom_info[self->id_counter].name = talloc_strdup(self->atom_info, key);
   };
 
   AFF4_GL_UNLOCK;
   return result;
 };
 
+/* Find the key for the uri and attribute without allocating
+   anything. Cache iterators do not take the global lock so this is
+   safe for readers. Returns 0 if either is not known.
+*/
+static int find_key(MemoryDataStore self, char *uri, char *attribute,
+                    uint64_t data_ptr[2]) {
+  struct cache_entry_t *uri_entry, *attr_entry;
+
+  uri_entry = (struct cache_entry_t *)CALL(self->atom_db, iter, ZSTRING_NO_NULL(uri));
+  attr_entry = (struct cache_entry_t *)CALL(self->atom_db, iter,
+                                            ZSTRING_NO_NULL(attribute));
+  if(!uri_entry || !attr_entry)
+    return 0;
+
+  data_ptr[0] = ((XSDInteger)uri_entry->data)->value;
+  data_ptr[1] = ((XSDInteger)attr_entry->data)->value;
+
+  return 1;
+};
+
+/* Build an index key from the ids and the value's data. Small keys
+   go in buffer.
+*/
+static char *make_index_key(char *buffer, int buffer_size, uint64_t *ids,
+                            int id_count, char *data, int length, int *key_len) {
+  char *result = buffer;
+
+  *key_len = id_count * sizeof(uint64_t) + length;
+  if(*key_len > buffer_size)
+    result = talloc_size(NULL, *key_len);
+
+  memcpy(result, ids, id_count * sizeof(uint64_t));
+  memcpy(result + id_count * sizeof(uint64_t), data, length);
+
+  return result;
+};
+
+/* Add the subject to the index for the attribute and value. Members
+   are keyed by (attribute, subject, value) so each subject appears
+   only once however many times it has the value.
+*/
+static void index_value(MemoryDataStore self, uint64_t data_ptr[2],
+                        DataStoreObject value) {
+  char member_buffer[BUFF_SIZE], head_buffer[BUFF_SIZE];
+  char *member_key, *head_key;
+  int member_len, head_len;
+  uint64_t ids[2];
+  struct index_head_t *head;
+  struct index_node_t *node;
+
+  if(!self->atom_info[data_ptr[1]].indexed)
+    return;
+
+  ids[0] = data_ptr[1];
+  ids[1] = data_ptr[0];
+  member_key = make_index_key(member_buffer, BUFF_SIZE, ids, 2, value->data,
+                              value->length, &member_len);
+  head_key = make_index_key(head_buffer, BUFF_SIZE, ids, 1, value->data,
+                            value->length, &head_len);
+
+  if(CALL(self->index_members, present, member_key, member_len))
+    goto exit;
+
+  head = (struct index_head_t *)CALL(self->index_db, borrow, head_key, head_len);
+  if(!head) {
+    head = talloc(NULL, struct index_head_t);
+    INIT_LIST_HEAD(&head->subjects);
+    CALL(self->index_db, put, head_key, head_len, (Object)head);
+  };
+
+  node = talloc(NULL, struct index_node_t);
+  node->head = head;
+  node->subject = data_ptr[0];
+  list_add_tail(&node->list, &head->subjects);
+  CALL(self->index_members, put, member_key, member_len, (Object)node);
+
+ exit:
+  if(member_key != member_buffer) talloc_free(member_key);
+  if(head_key != head_buffer) talloc_free(head_key);
+};
+
+static void unindex_value(MemoryDataStore self, uint64_t data_ptr[2],
+                          DataStoreObject value) {
+  char member_buffer[BUFF_SIZE], head_buffer[BUFF_SIZE];
+  char *member_key, *head_key;
+  int member_len, head_len;
+  uint64_t ids[2];
+  struct index_head_t *head;
+  struct index_node_t *node;
+
+  if(!self->atom_info[data_ptr[1]].indexed)
+    return;
+
+  ids[0] = data_ptr[1];
+  ids[1] = data_ptr[0];
+  member_key = make_index_key(member_buffer, BUFF_SIZE, ids, 2, value->data,
+                              value->length, &member_len);
+  head_key = make_index_key(head_buffer, BUFF_SIZE, ids, 1, value->data,
+                            value->length, &head_len);
+
+  if(!CALL(self->index_members, present, member_key, member_len))
+    goto exit;
+
+  node = (struct index_node_t *)CALL(self->index_members, get, NULL, member_key,
+                                     member_len);
+  head = node->head;
+  list_del(&node->list);
+  talloc_free(node);
+
+  if(list_empty(&head->subjects))
+    talloc_free(CALL(self->index_db, get, NULL, head_key, head_len));
+
+ exit:
+  if(member_key != member_buffer) talloc_free(member_key);
+  if(head_key != head_buffer) talloc_free(head_key);
+};
+
+/* Remember that the subject has the attribute. Attributes are not
+   removed when their values are, so they may already be listed.
+*/
+static void add_attribute(MemoryDataStore self, uint64_t data_ptr[2]) {
+  struct memory_atom_t *subject = &self->atom_info[data_ptr[0]];
+  int i;
+
+  for(i=0; i < subject->attribute_count; i++)
+    if(subject->attributes[i] == data_ptr[1]) return;
+
+  subject->attributes = talloc_realloc(self->atom_info, subject->attributes,
+                                       uint32_t, subject->attribute_count + 2);
+  subject->attributes[subject->attribute_count++] = data_ptr[1];
+  subject->attributes[subject->attribute_count] = 0;
+};
+
+/* Store a new value under the key. */
+static void put_value(MemoryDataStore self, uint64_t data_ptr[2],
+                      DataStoreObject value) {
+  if(!CALL(self->data_db, present, (char *)data_ptr, 2 * sizeof(uint64_t)))
+    add_attribute(self, data_ptr);
+
+  CALL(self->data_db, put, (char *)data_ptr, 2 * sizeof(uint64_t), (Object)value);
+  index_value(self, data_ptr, value);
+};
+
+/* Remove all the values stored under the key. */
+static void remove_values(MemoryDataStore self, uint64_t data_ptr[2]) {
+  while(CALL(self->data_db, present, (char *)data_ptr, 2 * sizeof(uint64_t))) {
+    DataStoreObject obj = (DataStoreObject)CALL(self->data_db, get, NULL,
+                                                (char *)data_ptr,
+                                                2 * sizeof(uint64_t));
+
+    unindex_value(self, data_ptr, obj);
+    talloc_free(obj);
+  };
+};
 
 static void DataStore_del(DataStore this, char *uri, char *attribute) {
   MemoryDataStore self = (MemoryDataStore)this;
   uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
 
   AFF4_GL_LOCK;
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db,attribute);
-
-  // Combine the values as an index to the data_db.
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+  if(!begin_write(self))
+    goto exit;
 
   // Remove all the objects from the cache.
-  while (1) {
-    Object obj = CALL(self->data_db, get, NULL, (char *)data_ptr, sizeof(data_ptr));
-    if (!obj) break;
+  if(find_key(self, uri, attribute, data_ptr))
+    remove_values(self, data_ptr);
 
-    talloc_free(obj);
-  };
+  end_write(self);
 
+ exit:
   AFF4_GL_UNLOCK;
 };
 
@@ -84,29 +409,26 @@ static void DataStore_set(DataStore this, char *uri, char *attribute,
                           DataStoreObject value) {
   MemoryDataStore self = (MemoryDataStore)this;
   uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
 
   AFF4_GL_LOCK;
+  if(!begin_write(self)) {
+    talloc_free(value);
+    goto exit;
+  };
 
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db, attribute);
-
-  // Combine the values as an index to the data_db
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+  // Combine the ids as an index to the data_db
+  data_ptr[0] = get_or_create(self, self->atom_db, uri)->value;
+  data_ptr[1] = get_or_create(self, self->atom_db, attribute)->value;
 
   // Remove all the old objects from the cache.
-  while (1) {
-    Object obj = CALL(self->data_db, get, NULL, (char *)data_ptr, sizeof(data_ptr));
-    if (!obj) break;
-
-    talloc_free(obj);
-  };
+  remove_values(self, data_ptr);
 
   // Set the new object.
-  CALL(self->data_db, put, (char *)data_ptr, sizeof(data_ptr), (Object)value);
+  put_value(self, data_ptr, value);
+
+  end_write(self);
 
+ exit:
   AFF4_GL_UNLOCK;
 };
 
@@ -115,105 +437,1558 @@ static void DataStore_add(DataStore this, char *uri, char *attribute,
                           DataStoreObject value) {
   MemoryDataStore self = (MemoryDataStore)this;
   uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
 
   AFF4_GL_LOCK;
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db, attribute);
+  if(!begin_write(self)) {
+    talloc_free(value);
+    goto exit;
+  };
 
-  // Combine the values as an index to the data_db
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+  // Combine the ids as an index to the data_db
+  data_ptr[0] = get_or_create(self, self->atom_db, uri)->value;
+  data_ptr[1] = get_or_create(self, self->atom_db, attribute)->value;
 
   // Set the new object.
-  CALL(self->data_db, put, (char *)data_ptr, sizeof(data_ptr), (Object)value);
+  put_value(self, data_ptr, value);
+
+  end_write(self);
 
+ exit:
   AFF4_GL_UNLOCK;
 };
 
-static DataStoreObject DataStore_get(DataStore this, char *uri, char *attribute) {
+/* Our atoms are just the ids we use for the keys of the data_db. */
+static uint32_t DataStore_intern(DataStore this, char *string) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  uint32_t result = 0;
+
+  AFF4_GL_LOCK;
+  if(!begin_write(self))
+    goto exit;
+
+  result = get_or_create(self, self->atom_db, string)->value;
+
+  end_write(self);
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+/* Check the atoms came from this store. */
+static int check_atoms(MemoryDataStore self, uint32_t uri, uint32_t attribute,
+                       uint64_t data_ptr[2]) {
+  if(uri == 0 || uri > self->id_counter ||
+     attribute == 0 || attribute > self->id_counter) {
+    RaiseError(EProgrammingError, "Invalid atom");
+    return 0;
+  };
+
+  data_ptr[0] = uri;
+  data_ptr[1] = attribute;
+
+  return 1;
+};
+
+static void DataStore_set_atoms(DataStore this, uint32_t uri, uint32_t attribute,
+                                DataStoreObject value) {
   MemoryDataStore self = (MemoryDataStore)this;
   uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
-  DataStoreObject value;
 
   AFF4_GL_LOCK;
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db, attribute);
+  if(!check_atoms(self, uri, attribute, data_ptr)) {
+    talloc_free(value);
+    goto exit;
+  };
 
-  // Combine the values as an index to the data_db
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+  if(!begin_write(self)) {
+    talloc_free(value);
+    goto exit;
+  };
 
-  // Set the new object.
-  value = (DataStoreObject)CALL(self->data_db, borrow, (char *)data_ptr, sizeof(data_ptr));
+  remove_values(self, data_ptr);
+  put_value(self, data_ptr, value);
+  end_write(self);
 
+ exit:
   AFF4_GL_UNLOCK;
-  return value;
 };
 
-static Object DataStore_iter(DataStore this, char *uri, char *attribute) {
+static void DataStore_add_atoms(DataStore this, uint32_t uri, uint32_t attribute,
+                                DataStoreObject value) {
   MemoryDataStore self = (MemoryDataStore)this;
   uint64_t data_ptr[2];
-  XSDInteger uri_index;
-  XSDInteger attr_index;
-  Object iter;
 
   AFF4_GL_LOCK;
-  uri_index = get_or_create(self, self->urn_db, uri);
-  attr_index = get_or_create(self, self->attribute_db, attribute);
+  if(!check_atoms(self, uri, attribute, data_ptr)) {
+    talloc_free(value);
+    goto exit;
+  };
 
-  // Combine the values as an index to the data_db
-  data_ptr[0] = uri_index->value;
-  data_ptr[1] = attr_index->value;
+  if(!begin_write(self)) {
+    talloc_free(value);
+    goto exit;
+  };
 
-  // Set the new object.
-  iter = CALL(self->data_db, iter, (char *)data_ptr, sizeof(data_ptr));
+  put_value(self, data_ptr, value);
+  end_write(self);
+
+ exit:
+  AFF4_GL_UNLOCK;
+};
+
+/* Take the locks once for the whole batch. Loaders add many values
+   for the same subject and attribute in a row, so we only look up
+   the ids when they change.
+*/
+static void DataStore_add_batch(DataStore this, struct datastore_triple_t *triples,
+                                int count) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  uint64_t data_ptr[2];
+  int i;
+
+  AFF4_GL_LOCK;
+  if(!begin_write(self))
+    goto exit;
+
+  for(i=0; i < count; i++) {
+    struct datastore_triple_t *triple = &triples[i];
+
+    if(i == 0 || strcmp(triple->uri, triple[-1].uri))
+      data_ptr[0] = get_or_create(self, self->atom_db, triple->uri)->value;
+
+    if(i == 0 || strcmp(triple->attribute, triple[-1].attribute))
+      data_ptr[1] = get_or_create(self, self->atom_db, triple->attribute)->value;
+
+    put_value(self, data_ptr, triple->value);
+  };
+
+  end_write(self);
 
+ exit:
   AFF4_GL_UNLOCK;
-  return iter;
+};
+
+/* The readers below do not take the global lock - the store must be
+   locked by the caller.
+*/
+static DataStoreObject DataStore_get(DataStore this, char *uri, char *attribute) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  uint64_t data_ptr[2];
+  struct cache_entry_t *entry;
+
+  if(!find_key(self, uri, attribute, data_ptr))
+    return NULL;
+
+  entry = (struct cache_entry_t *)CALL(self->data_db, iter, (char *)data_ptr,
+                                       sizeof(data_ptr));
+  if(!entry)
+    return NULL;
+
+  return (DataStoreObject)entry->data;
+};
+
+static Object DataStore_iter(DataStore this, char *uri, char *attribute) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  uint64_t data_ptr[2];
+
+  if(!find_key(self, uri, attribute, data_ptr))
+    return NULL;
+
+  return CALL(self->data_db, iter, (char *)data_ptr, sizeof(data_ptr));
+};
+
+/* Like iter() this does not take the global lock - bad atoms just
+   do not find anything.
+*/
+static Object DataStore_iter_atoms(DataStore this, uint32_t uri, uint32_t attribute) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  uint64_t data_ptr[2];
+
+  data_ptr[0] = uri;
+  data_ptr[1] = attribute;
+
+  return CALL(self->data_db, iter, (char *)data_ptr, sizeof(data_ptr));
 };
 
 static DataStoreObject DataStore_next(DataStore this, Object *iter) {
   MemoryDataStore self = (MemoryDataStore)this;
-  DataStoreObject result;
+
+  return (DataStoreObject)CALL(self->data_db, next, iter);
+};
+
+/* Index all the values of the attribute - including the ones we
+   already have.
+*/
+static int DataStore_add_index(DataStore this, char *attribute) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  uint64_t attribute_id;
+  struct cache_entry_t *i;
 
   AFF4_GL_LOCK;
-  result = (DataStoreObject)CALL(self->data_db, next, iter);
+  if(!begin_write(self)) {
+    AFF4_GL_UNLOCK;
+    return 0;
+  };
+
+  attribute_id = get_or_create(self, self->atom_db, attribute)->value;
+  if(self->atom_info[attribute_id].indexed)
+    goto exit;
+
+  self->atom_info[attribute_id].indexed = 1;
+
+  list_for_each_entry(i, &self->data_db->cache_list, cache_list) {
+    uint64_t *data_ptr = (uint64_t *)i->key;
+
+    if(data_ptr[1] == attribute_id)
+      index_value(self, data_ptr, (DataStoreObject)i->data);
+  };
+
+ exit:
+  end_write(self);
   AFF4_GL_UNLOCK;
+  return 1;
+};
+
+/* The iterator is the current node in the subject list. Like iter()
+   this does not take the global lock or allocate for small values.
+*/
+static Object DataStore_iter_subjects(DataStore this, char *attribute,
+                                      DataStoreObject value) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  struct cache_entry_t *attribute_entry, *head_entry;
+  char buffer[BUFF_SIZE];
+  char *key;
+  int key_len;
+  uint64_t attribute_id;
+  Object result = NULL;
+
+  attribute_entry = (struct cache_entry_t *)CALL(self->atom_db, iter,
+                                                 ZSTRING_NO_NULL(attribute));
+  if(!attribute_entry)
+    return NULL;
+
+  attribute_id = ((XSDInteger)attribute_entry->data)->value;
+  if(!self->atom_info[attribute_id].indexed) {
+    RaiseError(ERuntimeError, "Attribute %s is not indexed", attribute);
+    return NULL;
+  };
+
+  key = make_index_key(buffer, BUFF_SIZE, &attribute_id, 1, value->data,
+                       value->length, &key_len);
+
+  head_entry = (struct cache_entry_t *)CALL(self->index_db, iter, key, key_len);
+  if(head_entry) {
+    struct index_head_t *head = (struct index_head_t *)head_entry->data;
+
+    result = (Object)list_entry(head->subjects.next, struct index_node_t, list);
+  };
+
+  if(key != buffer) talloc_free(key);
 
   return result;
 };
 
+static char *DataStore_next_subject(DataStore this, Object *iter) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  struct index_node_t *node = (struct index_node_t *)*iter;
 
-/* This is an abstract class so it does not implement anything. */
-VIRTUAL(DataStore, Object)
-  UNIMPLEMENTED(DataStore, Con);
-  UNIMPLEMENTED(DataStore, lock);
-  UNIMPLEMENTED(DataStore, unlock);
-  UNIMPLEMENTED(DataStore, del);
-  UNIMPLEMENTED(DataStore, set);
-  UNIMPLEMENTED(DataStore, add);
-  UNIMPLEMENTED(DataStore, get);
-  UNIMPLEMENTED(DataStore, iter);
-  UNIMPLEMENTED(DataStore, next);
-END_VIRTUAL
+  if(!node) return NULL;
 
-VIRTUAL(MemoryDataStore, DataStore)
-  VMETHOD_BASE(DataStore, Con) = DataStore_Con;
-  VMETHOD_BASE(DataStore, lock) = DataStore_lock;
-  VMETHOD_BASE(DataStore, unlock) = DataStore_unlock;
-  VMETHOD_BASE(DataStore, del) = DataStore_del;
-  VMETHOD_BASE(DataStore, set) = DataStore_set;
-  VMETHOD_BASE(DataStore, add) = DataStore_add;
-  VMETHOD_BASE(DataStore, get) = DataStore_get;
-  VMETHOD_BASE(DataStore, iter) = DataStore_iter;
-  VMETHOD_BASE(DataStore, next) = DataStore_next;
-END_VIRTUAL
+  if(node->list.next == &node->head->subjects) {
+    *iter = NULL;
+  } else {
+    *iter = (Object)list_entry(node->list.next, struct index_node_t, list);
+  };
 
+  return self->atom_info[node->subject].name;
+};
 
-DataStore new_MemoryDataStore(void *ctx) {
-  return CONSTRUCT(MemoryDataStore, DataStore, Con, ctx);
+
+/* The iterator points into the subject's attribute array. */
+static Object DataStore_iter_attributes(DataStore this, char *uri) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  struct cache_entry_t *uri_entry;
+  uint32_t *attributes;
+
+  uri_entry = (struct cache_entry_t *)CALL(self->atom_db, iter, ZSTRING_NO_NULL(uri));
+  if(!uri_entry)
+    return NULL;
+
+  attributes = self->atom_info[((XSDInteger)uri_entry->data)->value].attributes;
+  if(!attributes || !attributes[0])
+    return NULL;
+
+  return (Object)attributes;
+};
+
+static char *DataStore_next_attribute(DataStore this, Object *iter) {
+  MemoryDataStore self = (MemoryDataStore)this;
+  uint32_t *attribute = (uint32_t *)*iter;
+
+  if(!attribute) return NULL;
+
+  *iter = attribute[1] ? (Object)(attribute + 1) : NULL;
+
+  return self->atom_info[*attribute].name;
+};
+
+
+/****************************************************
+  Snapshots.
+
+  A snapshot is a single file laid out as:
+
+  struct snapshot_header_t
+  The string pool - NUL terminated strings.
+  The value data.
+  uint32_t string_index[string_count] - the offsets of the strings
+         in sorted order. A string's id is its position here.
+  struct snapshot_triple_t triples[triple_count] - sorted by
+         subject, then attribute, then the order values were added.
+  struct snapshot_volume_t volumes[volume_count]
+
+  All offsets are from the start of the file and everything is in
+  host byte order.
+****************************************************/
+#define SNAPSHOT_MAGIC "AFF4SNP1"
+
+struct snapshot_header_t {
+  char magic[8];
+  uint32_t string_count;
+  uint32_t triple_count;
+  uint32_t volume_count;
+  uint32_t string_index_offset;
+  uint32_t triple_offset;
+  uint32_t volume_offset;
+};
+
+struct snapshot_triple_t {
+  uint32_t subject;
+  uint32_t attribute;
+  uint32_t rdf_type;
+  uint32_t length;
+  uint32_t data_offset;
+};
+
+struct snapshot_volume_t {
+  uint32_t filename;
+  uint32_t reserved;
+  uint64_t size;
+  uint64_t mtime;
+};
+
+/* Values without a type are stored with an empty one */
+#define SNAPSHOT_TYPE(value) ((value)->rdf_type ? (value)->rdf_type : "")
+
+/* Used while writing the snapshot */
+struct snapshot_item_t {
+  DataStoreObject value;
+  uint32_t sequence;
+  struct snapshot_triple_t triple;
+};
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+};
+
+static int compare_items(const void *a, const void *b) {
+  const struct snapshot_item_t *x = a;
+  const struct snapshot_item_t *y = b;
+
+  if(x->triple.subject != y->triple.subject)
+    return x->triple.subject < y->triple.subject ? -1 : 1;
+
+  if(x->triple.attribute != y->triple.attribute)
+    return x->triple.attribute < y->triple.attribute ? -1 : 1;
+
+  return x->sequence < y->sequence ? -1 : x->sequence > y->sequence;
+};
+
+/* Find the id of the string in the sorted unique table */
+static uint32_t string_id(char **strings, int count, char *string) {
+  char **found = bsearch(&string, strings, count, sizeof(char *), compare_strings);
+
+  return found - strings;
+};
+
+static void pad_to(StringIO out, int alignment) {
+  char zeros[8] = {0, };
+
+  CALL(out, write, zeros, (alignment - out->size % alignment) % alignment);
+};
+
+static int MemoryDataStore_snapshot(MemoryDataStore self, char *filename,
+                                    char **volumes) {
+  void *ctx = talloc_size(NULL, 0);
+  struct snapshot_header_t header;
+  struct snapshot_item_t *items;
+  char **names, **strings;
+  uint32_t *string_index;
+  int item_count = 0, string_count = 0, volume_count = 0;
+  int i, j;
+  StringIO out;
+  char *tmp_filename;
+  int fd;
+
+  AFF4_GL_LOCK;
+  DataStore_lock((DataStore)self);
+
+  while(volumes && volumes[volume_count])
+    volume_count++;
+
+  names = talloc_zero_array(ctx, char *, self->id_counter + 1);
+  for(i=1; i <= self->id_counter; i++) {
+    names[i] = self->atom_info[i].name;
+  };
+
+  // Collect all the values. We walk the hash lists because they keep
+  // values for the same key in the order they were added.
+  items = talloc_array(ctx, struct snapshot_item_t, self->data_db->cache_size + 1);
+  if(self->data_db->hash_table) {
+    for(i=0; i < self->data_db->hash_table_width; i++) {
+      struct cache_entry_t *entry;
+
+      list_for_each_entry(entry, &self->data_db->hash_table[i], hash_list) {
+        uint64_t *key = (uint64_t *)entry->key;
+
+        items[item_count].value = (DataStoreObject)entry->data;
+        items[item_count].sequence = item_count;
+        items[item_count].triple.subject = key[0];
+        items[item_count].triple.attribute = key[1];
+        item_count++;
+      };
+    };
+  };
+
+  // Intern all the strings.
+  strings = talloc_array(ctx, char *, self->id_counter + item_count + volume_count + 1);
+  for(i=0; i <= self->id_counter; i++) {
+    if(names[i])
+      strings[string_count++] = names[i];
+  };
+
+  for(i=0; i < item_count; i++) {
+    strings[string_count++] = SNAPSHOT_TYPE(items[i].value);
+  };
+
+  for(i=0; i < volume_count; i++) {
+    strings[string_count++] = volumes[i];
+  };
+
+  qsort(strings, string_count, sizeof(char *), compare_strings);
+  for(i=0, j=0; i < string_count; i++) {
+    if(j == 0 || strcmp(strings[j-1], strings[i]))
+      strings[j++] = strings[i];
+  };
+  string_count = j;
+
+  // Now translate the store's ids into string ids.
+  for(i=0; i < item_count; i++) {
+    struct snapshot_triple_t *triple = &items[i].triple;
+
+    triple->subject = string_id(strings, string_count, names[triple->subject]);
+    triple->attribute = string_id(strings, string_count, names[triple->attribute]);
+    triple->rdf_type = string_id(strings, string_count, SNAPSHOT_TYPE(items[i].value));
+    triple->length = items[i].value->length;
+  };
+
+  qsort(items, item_count, sizeof(*items), compare_items);
+
+  // Write the file.
+  out = CONSTRUCT(StringIO, StringIO, Con, ctx);
+  memset(&header, 0, sizeof(header));
+  CALL(out, write, (char *)&header, sizeof(header));
+
+  string_index = talloc_array(ctx, uint32_t, string_count + 1);
+  for(i=0; i < string_count; i++) {
+    string_index[i] = out->size;
+    CALL(out, write, strings[i], strlen(strings[i]) + 1);
+  };
+
+  for(i=0; i < item_count; i++) {
+    items[i].triple.data_offset = out->size;
+    CALL(out, write, items[i].value->data, items[i].value->length);
+  };
+
+  pad_to(out, 8);
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.string_count = string_count;
+  header.string_index_offset = out->size;
+  CALL(out, write, (char *)string_index, string_count * sizeof(uint32_t));
+
+  pad_to(out, 8);
+  header.triple_count = item_count;
+  header.triple_offset = out->size;
+  for(i=0; i < item_count; i++) {
+    CALL(out, write, (char *)&items[i].triple, sizeof(struct snapshot_triple_t));
+  };
+
+  pad_to(out, 8);
+  header.volume_count = volume_count;
+  header.volume_offset = out->size;
+  for(i=0; i < volume_count; i++) {
+    struct snapshot_volume_t volume;
+    struct stat buf;
+
+    if(stat(volumes[i], &buf) < 0) {
+      RaiseError(EIOError, "Can't stat %s (%s)", volumes[i], strerror(errno));
+      goto error;
+    };
+
+    memset(&volume, 0, sizeof(volume));
+    volume.filename = string_id(strings, string_count, volumes[i]);
+    volume.size = buf.st_size;
+    volume.mtime = buf.st_mtime;
+
+    CALL(out, write, (char *)&volume, sizeof(volume));
+  };
+
+  CALL(out, seek, 0, SEEK_SET);
+  CALL(out, write, (char *)&header, sizeof(header));
+
+  // Readers may be opening the snapshot while we write it, so we
+  // write a temporary file and rename it into place.
+  tmp_filename = talloc_asprintf(ctx, "%s.%u.tmp", filename, (unsigned int)getpid());
+  fd = open(tmp_filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
+  if(fd < 0) {
+    RaiseError(EIOError, "Can't open %s (%s)", tmp_filename, strerror(errno));
+    goto error;
+  };
+
+  if(write(fd, out->data, out->size) != out->size) {
+    RaiseError(EIOError, "Can't write %s (%s)", tmp_filename, strerror(errno));
+    close(fd);
+    unlink(tmp_filename);
+    goto error;
+  };
+
+  close(fd);
+  if(rename(tmp_filename, filename) < 0) {
+    RaiseError(EIOError, "Can't rename %s (%s)", tmp_filename, strerror(errno));
+    unlink(tmp_filename);
+    goto error;
+  };
+
+  talloc_free(ctx);
+  DataStore_unlock((DataStore)self);
+  AFF4_GL_UNLOCK;
+  return 1;
+
+ error:
+  talloc_free(ctx);
+  DataStore_unlock((DataStore)self);
+  AFF4_GL_UNLOCK;
+  return 0;
+};
+
+
+/* Stores do not have to support atoms - callers then just use the
+   strings.
+*/
+static uint32_t DataStore_no_atoms(DataStore self, char *string) {
+  return 0;
+};
+
+/* Stores do not have to support indexes either. */
+static int DataStore_no_index(DataStore self, char *attribute) {
+  return 0;
+};
+
+static Object DataStore_not_indexed(DataStore self, char *attribute,
+                                    DataStoreObject value) {
+  RaiseError(ERuntimeError, "Attribute %s is not indexed", attribute);
+  return NULL;
+};
+
+/* Stores which can not index find the subjects by scanning instead.
+   Their iterator is the list of subjects they found.
+*/
+struct subject_list_t {
+  char **subjects;
+  uint32_t count;
+  uint32_t current;
+};
+
+static void list_subject(struct subject_list_t *list, char *subject) {
+  if(list->count % 64 == 0) {
+    list->subjects = talloc_realloc(list, list->subjects, char *,
+                                    list->count + 64);
+  };
+
+  list->subjects[list->count++] = subject;
+};
+
+/* Returns the iterator for the list, or NULL if it is empty. */
+static Object subject_list_iter(struct subject_list_t *list) {
+  if(list->count == 0) {
+    talloc_free(list);
+    return NULL;
+  };
+
+  return (Object)list;
+};
+
+static char *DataStore_next_listed_subject(DataStore self, Object *iter) {
+  struct subject_list_t *list = (struct subject_list_t *)*iter;
+  char *result;
+
+  if(!list) return NULL;
+
+  result = list->subjects[list->current++];
+  if(list->current >= list->count)
+    *iter = NULL;
+
+  return result;
+};
+
+static Object DataStore_no_attributes(DataStore self, char *uri) {
+  RaiseError(ERuntimeError, "%s can not list attributes", NAMEOF(self));
+  return NULL;
+};
+
+/* Used by stores which have nothing better to do for a batch. */
+static void DataStore_add_each(DataStore self, struct datastore_triple_t *triples,
+                               int count) {
+  int i;
+
+  AFF4_GL_LOCK;
+  for(i=0; i < count; i++) {
+    CALL(self, add, triples[i].uri, triples[i].attribute, triples[i].value);
+  };
+  AFF4_GL_UNLOCK;
+};
+
+/* This is an abstract class so it only implements add_batch() in
+   terms of add(), and has no atoms or indexes.
+*/
+VIRTUAL(DataStore, Object)
+  UNIMPLEMENTED(DataStore, Con);
+  UNIMPLEMENTED(DataStore, lock);
+  UNIMPLEMENTED(DataStore, unlock);
+  UNIMPLEMENTED(DataStore, del);
+  UNIMPLEMENTED(DataStore, set);
+  UNIMPLEMENTED(DataStore, add);
+  VMETHOD(add_batch) = DataStore_add_each;
+  VMETHOD(intern) = DataStore_no_atoms;
+  UNIMPLEMENTED(DataStore, set_atoms);
+  UNIMPLEMENTED(DataStore, add_atoms);
+  UNIMPLEMENTED(DataStore, get);
+  UNIMPLEMENTED(DataStore, iter);
+  UNIMPLEMENTED(DataStore, iter_atoms);
+  UNIMPLEMENTED(DataStore, next);
+  VMETHOD(add_index) = DataStore_no_index;
+  VMETHOD(iter_subjects) = DataStore_not_indexed;
+  UNIMPLEMENTED(DataStore, next_subject);
+  VMETHOD(iter_attributes) = DataStore_no_attributes;
+  UNIMPLEMENTED(DataStore, next_attribute);
+END_VIRTUAL
+
+VIRTUAL(MemoryDataStore, DataStore)
+  VMETHOD_BASE(DataStore, Con) = DataStore_Con;
+  VMETHOD_BASE(DataStore, lock) = DataStore_lock;
+  VMETHOD_BASE(DataStore, unlock) = DataStore_unlock;
+  VMETHOD_BASE(DataStore, del) = DataStore_del;
+  VMETHOD_BASE(DataStore, set) = DataStore_set;
+  VMETHOD_BASE(DataStore, add) = DataStore_add;
+  VMETHOD_BASE(DataStore, add_batch) = DataStore_add_batch;
+  VMETHOD_BASE(DataStore, intern) = DataStore_intern;
+  VMETHOD_BASE(DataStore, set_atoms) = DataStore_set_atoms;
+  VMETHOD_BASE(DataStore, add_atoms) = DataStore_add_atoms;
+  VMETHOD_BASE(DataStore, get) = DataStore_get;
+  VMETHOD_BASE(DataStore, iter) = DataStore_iter;
+  VMETHOD_BASE(DataStore, iter_atoms) = DataStore_iter_atoms;
+  VMETHOD_BASE(DataStore, next) = DataStore_next;
+  VMETHOD_BASE(DataStore, add_index) = DataStore_add_index;
+  VMETHOD_BASE(DataStore, iter_subjects) = DataStore_iter_subjects;
+  VMETHOD_BASE(DataStore, next_subject) = DataStore_next_subject;
+  VMETHOD_BASE(DataStore, iter_attributes) = DataStore_iter_attributes;
+  VMETHOD_BASE(DataStore, next_attribute) = DataStore_next_attribute;
+
+  VMETHOD(snapshot) = MemoryDataStore_snapshot;
+END_VIRTUAL
+
+
+DataStore new_MemoryDataStore(void *ctx) {
+  return CONSTRUCT(MemoryDataStore, DataStore, Con, ctx);
+};
+
+
+/****************************************************
+  A persistent data store kept in a tdb file.
+
+  Each (uri, attribute) pair is a single tdb record keyed by
+  "uri\0attribute". The record holds all the values one after the
+  other, each prefixed with a struct tdb_value_header_t. Values are
+  stored in host byte order.
+
+  The record keyed by "uri\0" lists the subject's attributes as
+  consecutive null terminated strings.
+****************************************************/
+/* tdb can not grow its hash table so we need a big one up front */
+#define TDB_DATA_STORE_HASH_SIZE 65521
+
+struct tdb_value_header_t {
+  uint32_t length;
+  uint32_t type_length;
+};
+
+/* The opaque iterator we hand out */
+struct tdb_iter_t {
+  TDB_DATA record;
+  uint32_t offset;
+};
+
+static int TDBDataStore_destructor(void *this) {
+  TDBDataStore self = (TDBDataStore)this;
+
+  if(self->db)
+    tdb_close(self->db);
+
+  return 0;
+};
+
+static TDBDataStore TDBDataStore_Con(TDBDataStore self, char *filename) {
+  AFF4_GL_LOCK;
+
+  self->filename = talloc_strdup(self, filename);
+  self->borrowed = talloc_size(self, 0);
+  self->lock_depth = 0;
+
+  self->db = tdb_open(filename, TDB_DATA_STORE_HASH_SIZE, TDB_DEFAULT, O_RDWR | O_CREAT | O_BINARY, 0644);
+  if(!self->db) {
+    RaiseError(EIOError, "Unable to open tdb file %s (%s)", filename, strerror(errno));
+    goto error;
+  };
+
+  talloc_set_destructor((void *)self, TDBDataStore_destructor);
+
+  AFF4_GL_UNLOCK;
+  return self;
+
+ error:
+  talloc_free(self);
+  AFF4_GL_UNLOCK;
+  return NULL;
+};
+
+static void TDBDataStore_lock(DataStore this) {
+  TDBDataStore self = (TDBDataStore)this;
+
+  AFF4_GL_LOCK;
+  self->lock_depth++;
+  AFF4_GL_UNLOCK;
+};
+
+/* Borrowed objects go away when the last lock is released. */
+static void TDBDataStore_unlock(DataStore this) {
+  TDBDataStore self = (TDBDataStore)this;
+
+  AFF4_GL_LOCK;
+  if(self->lock_depth > 0)
+    self->lock_depth--;
+
+  if(self->lock_depth == 0) {
+    talloc_free(self->borrowed);
+    self->borrowed = talloc_size(self, 0);
+  };
+  AFF4_GL_UNLOCK;
+};
+
+/* Build the tdb key for the uri and attribute. */
+static TDB_DATA make_key(void *ctx, char *uri, char *attribute) {
+  int uri_length = strlen(uri) + 1;
+  int attribute_length = strlen(attribute);
+  TDB_DATA key;
+
+  key.dsize = uri_length + attribute_length;
+  key.dptr = talloc_size(ctx, key.dsize);
+
+  memcpy(key.dptr, uri, uri_length);
+  memcpy(key.dptr + uri_length, attribute, attribute_length);
+
+  return key;
+};
+
+/* Serialise the value into a new record. */
+static TDB_DATA make_value(void *ctx, DataStoreObject value) {
+  struct tdb_value_header_t header;
+  TDB_DATA result;
+
+  header.length = value->length;
+  header.type_length = value->rdf_type ? strlen(value->rdf_type) : 0;
+
+  result.dsize = sizeof(header) + header.type_length + header.length;
+  result.dptr = talloc_size(ctx, result.dsize);
+
+  memcpy(result.dptr, &header, sizeof(header));
+  memcpy(result.dptr + sizeof(header), value->rdf_type, header.type_length);
+  memcpy(result.dptr + sizeof(header) + header.type_length, value->data,
+         header.length);
+
+  return result;
+};
+
+/* Decode the value at offset within the record, returning the new
+   offset or 0 if there are no more values.
+*/
+static uint32_t decode_value(TDBDataStore self, TDB_DATA record, uint32_t offset,
+                             DataStoreObject *result) {
+  struct tdb_value_header_t header;
+  char *rdf_type;
+
+  *result = NULL;
+  if(offset + sizeof(header) > record.dsize)
+    return 0;
+
+  memcpy(&header, record.dptr + offset, sizeof(header));
+  offset += sizeof(header);
+
+  if(offset + header.type_length + header.length > record.dsize) {
+    RaiseError(ERuntimeError, "Corrupted record in %s", self->filename);
+    return 0;
+  };
+
+  rdf_type = talloc_strndup(NULL, (char *)record.dptr + offset, header.type_length);
+  offset += header.type_length;
+
+  *result = CONSTRUCT(DataStoreObject, DataStoreObject, Con, self->borrowed,
+                      (char *)record.dptr + offset, header.length, rdf_type);
+  talloc_free(rdf_type);
+
+  return offset + header.length;
+};
+
+/* Add the attribute to the subject's attribute list if the key is
+   new. This must be called before the key is stored.
+*/
+static void note_attribute(TDBDataStore self, char *uri, char *attribute,
+                           TDB_DATA key) {
+  TDB_DATA list_key, name;
+
+  if(tdb_exists(self->db, key))
+    return;
+
+  list_key = make_key(NULL, uri, "");
+  name.dptr = (unsigned char *)attribute;
+  name.dsize = strlen(attribute) + 1;
+
+  if(tdb_append(self->db, list_key, name) != 0) {
+    RaiseError(EIOError, "Unable to store in %s: %s", self->filename,
+               tdb_errorstr(self->db));
+  };
+
+  talloc_free(list_key.dptr);
+};
+
+/* Remove the attribute from the subject's attribute list, so a later
+   set() does not list it again.
+*/
+static void forget_attribute(TDBDataStore self, char *uri, char *attribute) {
+  TDB_DATA list_key, list;
+  int length = strlen(attribute) + 1;
+  char *i, *out, *end;
+
+  list_key = make_key(NULL, uri, "");
+  list = tdb_fetch(self->db, list_key);
+  if(!list.dptr) goto exit;
+
+  out = i = (char *)list.dptr;
+  end = i + list.dsize;
+
+  while(i < end) {
+    char *next = memchr(i, 0, end - i);
+
+    next = next ? next + 1 : end;
+    if(next - i != length || memcmp(i, attribute, length)) {
+      memmove(out, i, next - i);
+      out += next - i;
+    };
+
+    i = next;
+  };
+
+  list.dsize = out - (char *)list.dptr;
+  if(list.dsize == 0) {
+    tdb_delete(self->db, list_key);
+  } else if(tdb_store(self->db, list_key, list, TDB_REPLACE) != 0) {
+    RaiseError(EIOError, "Unable to store in %s: %s", self->filename,
+               tdb_errorstr(self->db));
+  };
+
+  free(list.dptr);
+
+ exit:
+  talloc_free(list_key.dptr);
+};
+
+static void TDBDataStore_del(DataStore this, char *uri, char *attribute) {
+  TDBDataStore self = (TDBDataStore)this;
+  TDB_DATA key;
+
+  AFF4_GL_LOCK;
+  key = make_key(NULL, uri, attribute);
+  if(tdb_delete(self->db, key) == 0)
+    forget_attribute(self, uri, attribute);
+
+  talloc_free(key.dptr);
+  AFF4_GL_UNLOCK;
+};
+
+static void TDBDataStore_set(DataStore this, char *uri, char *attribute,
+                             DataStoreObject value) {
+  TDBDataStore self = (TDBDataStore)this;
+  TDB_DATA key, data;
+
+  AFF4_GL_LOCK;
+  key = make_key(NULL, uri, attribute);
+  data = make_value(key.dptr, value);
+  note_attribute(self, uri, attribute, key);
+
+  // Replaces all the old values.
+  if(tdb_store(self->db, key, data, TDB_REPLACE) != 0) {
+    RaiseError(EIOError, "Unable to store in %s: %s", self->filename,
+               tdb_errorstr(self->db));
+  };
+
+  // We own the value now, but the caller may still be looking at it.
+  talloc_steal(self->borrowed, value);
+  talloc_free(key.dptr);
+  AFF4_GL_UNLOCK;
+};
+
+static void TDBDataStore_add(DataStore this, char *uri, char *attribute,
+                             DataStoreObject value) {
+  TDBDataStore self = (TDBDataStore)this;
+  TDB_DATA key, data;
+
+  AFF4_GL_LOCK;
+  key = make_key(NULL, uri, attribute);
+  data = make_value(key.dptr, value);
+  note_attribute(self, uri, attribute, key);
+
+  if(tdb_append(self->db, key, data) != 0) {
+    RaiseError(EIOError, "Unable to store in %s: %s", self->filename,
+               tdb_errorstr(self->db));
+  };
+
+  talloc_steal(self->borrowed, value);
+  talloc_free(key.dptr);
+  AFF4_GL_UNLOCK;
+};
+
+/* A single transaction for the batch saves syncing the file for
+   every value. If we can not have one the values are just added
+   without it.
+*/
+static void TDBDataStore_add_batch(DataStore this, struct datastore_triple_t *triples,
+                                   int count) {
+  TDBDataStore self = (TDBDataStore)this;
+  int transaction;
+  int i;
+
+  AFF4_GL_LOCK;
+  transaction = (tdb_transaction_start(self->db) == 0);
+
+  for(i=0; i < count; i++) {
+    TDBDataStore_add(this, triples[i].uri, triples[i].attribute, triples[i].value);
+  };
+
+  if(transaction && tdb_transaction_commit(self->db) != 0) {
+    RaiseError(EIOError, "Unable to commit to %s: %s", self->filename,
+               tdb_errorstr(self->db));
+  };
+
+  AFF4_GL_UNLOCK;
+};
+
+static DataStoreObject TDBDataStore_get(DataStore this, char *uri, char *attribute) {
+  TDBDataStore self = (TDBDataStore)this;
+  DataStoreObject result = NULL;
+  TDB_DATA key, record;
+
+  AFF4_GL_LOCK;
+  key = make_key(NULL, uri, attribute);
+  record = tdb_fetch(self->db, key);
+
+  if(record.dptr) {
+    decode_value(self, record, 0, &result);
+    free(record.dptr);
+  };
+
+  talloc_free(key.dptr);
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static Object TDBDataStore_iter(DataStore this, char *uri, char *attribute) {
+  TDBDataStore self = (TDBDataStore)this;
+  struct tdb_iter_t *iter = NULL;
+  TDB_DATA key, record;
+
+  AFF4_GL_LOCK;
+  key = make_key(NULL, uri, attribute);
+  record = tdb_fetch(self->db, key);
+
+  if(record.dptr) {
+    if(record.dsize > 0) {
+      iter = talloc(self->borrowed, struct tdb_iter_t);
+      iter->record.dptr = talloc_memdup(iter, record.dptr, record.dsize);
+      iter->record.dsize = record.dsize;
+      iter->offset = 0;
+    };
+
+    free(record.dptr);
+  };
+
+  talloc_free(key.dptr);
+  AFF4_GL_UNLOCK;
+  return (Object)iter;
+};
+
+static DataStoreObject TDBDataStore_next(DataStore this, Object *opaque_iter) {
+  TDBDataStore self = (TDBDataStore)this;
+  struct tdb_iter_t *iter = (struct tdb_iter_t *)*opaque_iter;
+  DataStoreObject result = NULL;
+
+  if(!iter) return NULL;
+
+  AFF4_GL_LOCK;
+  iter->offset = decode_value(self, iter->record, iter->offset, &result);
+
+  // Indicate no more elements
+  if(iter->offset == 0 || iter->offset >= iter->record.dsize)
+    *opaque_iter = NULL;
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+struct tdb_scan_t {
+  TDBDataStore self;
+  char *attribute;
+  unsigned int attribute_length;
+  DataStoreObject value;
+  struct subject_list_t *list;
+};
+
+/* Called by tdb for every record - we want the subjects which have
+   the value for the attribute.
+*/
+static int scan_subject(struct tdb_context *db, TDB_DATA key, TDB_DATA record,
+                        void *data) {
+  struct tdb_scan_t *scan = (struct tdb_scan_t *)data;
+  char *uri = (char *)key.dptr;
+  char *end = memchr(uri, 0, key.dsize);
+  DataStoreObject value;
+  uint32_t offset = 0;
+
+  // The key is the uri followed by the attribute (without a NUL).
+  if(!end || key.dsize - (end + 1 - uri) != scan->attribute_length ||
+     memcmp(end + 1, scan->attribute, scan->attribute_length))
+    return 0;
+
+  while((offset = decode_value(scan->self, record, offset, &value))) {
+    int found = value->length == scan->value->length &&
+      !memcmp(value->data, scan->value->data, value->length);
+
+    talloc_free(value);
+    if(found) {
+      list_subject(scan->list, talloc_strdup(scan->list, uri));
+      break;
+    };
+  };
+
+  return 0;
+};
+
+/* We have no index so we look at every record. */
+static Object TDBDataStore_iter_subjects(DataStore this, char *attribute,
+                                         DataStoreObject value) {
+  TDBDataStore self = (TDBDataStore)this;
+  struct tdb_scan_t scan;
+  Object result;
+
+  AFF4_GL_LOCK;
+  scan.self = self;
+  scan.attribute = attribute;
+  scan.attribute_length = strlen(attribute);
+  scan.value = value;
+  scan.list = talloc_zero(self->borrowed, struct subject_list_t);
+
+  tdb_traverse_read(self->db, scan_subject, &scan);
+  result = subject_list_iter(scan.list);
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static Object TDBDataStore_iter_attributes(DataStore this, char *uri) {
+  return TDBDataStore_iter(this, uri, "");
+};
+
+static char *TDBDataStore_next_attribute(DataStore this, Object *opaque_iter) {
+  struct tdb_iter_t *iter = (struct tdb_iter_t *)*opaque_iter;
+  char *result, *end;
+
+  if(!iter) return NULL;
+
+  result = (char *)iter->record.dptr + iter->offset;
+  end = memchr(result, 0, iter->record.dsize - iter->offset);
+  iter->offset = end ? end - (char *)iter->record.dptr + 1 : iter->record.dsize;
+
+  if(iter->offset >= iter->record.dsize)
+    *opaque_iter = NULL;
+
+  return result;
+};
+
+VIRTUAL(TDBDataStore, DataStore)
+  VMETHOD(Con) = TDBDataStore_Con;
+
+  VMETHOD_BASE(DataStore, lock) = TDBDataStore_lock;
+  VMETHOD_BASE(DataStore, unlock) = TDBDataStore_unlock;
+  VMETHOD_BASE(DataStore, del) = TDBDataStore_del;
+  VMETHOD_BASE(DataStore, set) = TDBDataStore_set;
+  VMETHOD_BASE(DataStore, add) = TDBDataStore_add;
+  VMETHOD_BASE(DataStore, add_batch) = TDBDataStore_add_batch;
+  VMETHOD_BASE(DataStore, get) = TDBDataStore_get;
+  VMETHOD_BASE(DataStore, iter) = TDBDataStore_iter;
+  VMETHOD_BASE(DataStore, next) = TDBDataStore_next;
+  VMETHOD_BASE(DataStore, iter_subjects) = TDBDataStore_iter_subjects;
+  VMETHOD_BASE(DataStore, next_subject) = DataStore_next_listed_subject;
+  VMETHOD_BASE(DataStore, iter_attributes) = TDBDataStore_iter_attributes;
+  VMETHOD_BASE(DataStore, next_attribute) = TDBDataStore_next_attribute;
+END_VIRTUAL
+
+
+DataStore new_TDBDataStore(void *ctx, char *filename) {
+  return (DataStore)CONSTRUCT(TDBDataStore, TDBDataStore, Con, ctx, filename);
+};
+
+
+/****************************************************
+  A read only data store using a snapshot file.
+****************************************************/
+/* The opaque iterator we hand out */
+struct snapshot_iter_t {
+  uint32_t current;
+  uint32_t end;
+};
+
+static int SnapshotDataStore_destructor(void *this) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+
+#ifndef WINDOWS
+  if(self->base)
+    munmap(self->base, self->size);
+#endif
+
+  return 0;
+};
+
+static char *snapshot_string(SnapshotDataStore self, uint32_t id) {
+  return self->base + self->string_index[id];
+};
+
+/* Check that all the ids and offsets stay inside the file, so a
+   corrupted snapshot can not make us read past the mapping. Strings
+   are safe to use if they start before the last NUL in the file.
+*/
+static int snapshot_is_valid(SnapshotDataStore self) {
+  struct snapshot_header_t *header = self->header;
+  struct snapshot_volume_t *volumes = (struct snapshot_volume_t *)
+    (self->base + header->volume_offset);
+  uint64_t last_nul = self->size;
+  uint32_t i;
+
+  while(last_nul > 0 && self->base[last_nul - 1])
+    last_nul--;
+
+  for(i=0; i < header->string_count; i++) {
+    if(self->string_index[i] >= last_nul)
+      return 0;
+  };
+
+  for(i=0; i < header->triple_count; i++) {
+    struct snapshot_triple_t *triple = &self->triples[i];
+
+    if(triple->subject >= header->string_count ||
+       triple->attribute >= header->string_count ||
+       triple->rdf_type >= header->string_count ||
+       (uint64_t)triple->data_offset + triple->length > self->size)
+      return 0;
+  };
+
+  for(i=0; i < header->volume_count; i++) {
+    if(volumes[i].filename >= header->string_count)
+      return 0;
+  };
+
+  return 1;
+};
+
+/* Check that the volumes the snapshot was made from have not
+   changed.
+*/
+static int snapshot_is_current(SnapshotDataStore self) {
+  struct snapshot_volume_t *volumes = (struct snapshot_volume_t *)
+    (self->base + self->header->volume_offset);
+  uint32_t i;
+
+  for(i=0; i < self->header->volume_count; i++) {
+    char *filename = snapshot_string(self, volumes[i].filename);
+    struct stat buf;
+
+    if(stat(filename, &buf) < 0 || (uint64_t)buf.st_size != volumes[i].size ||
+       (uint64_t)buf.st_mtime != volumes[i].mtime) {
+      RaiseError(ERuntimeError, "Snapshot %s is out of date: %s has changed",
+                 self->filename, filename);
+      return 0;
+    };
+  };
+
+  return 1;
+};
+
+static SnapshotDataStore SnapshotDataStore_Con(SnapshotDataStore self, char *filename) {
+  struct snapshot_header_t *header;
+  struct stat buf;
+  int fd;
+
+  AFF4_GL_LOCK;
+
+  self->filename = talloc_strdup(self, filename);
+  self->borrowed = talloc_size(self, 0);
+  self->lock_depth = 0;
+
+  fd = open(filename, O_RDONLY | O_BINARY);
+  if(fd < 0) {
+    RaiseError(EIOError, "Can't open %s (%s)", filename, strerror(errno));
+    goto error;
+  };
+
+  if(fstat(fd, &buf) < 0 || buf.st_size < sizeof(struct snapshot_header_t)) {
+    RaiseError(ERuntimeError, "%s is not a snapshot", filename);
+    close(fd);
+    goto error;
+  };
+
+  self->size = buf.st_size;
+
+#ifndef WINDOWS
+  self->base = mmap(NULL, self->size, PROT_READ, MAP_SHARED, fd, 0);
+  if(self->base == MAP_FAILED) {
+    self->base = NULL;
+    RaiseError(EIOError, "Can't map %s (%s)", filename, strerror(errno));
+    close(fd);
+    goto error;
+  };
+#else
+  self->base = talloc_size(self, self->size);
+  if(read(fd, self->base, self->size) != self->size) {
+    RaiseError(EIOError, "Can't read %s (%s)", filename, strerror(errno));
+    close(fd);
+    goto error;
+  };
+#endif
+
+  close(fd);
+  talloc_set_destructor((void *)self, SnapshotDataStore_destructor);
+
+  header = self->header = (struct snapshot_header_t *)self->base;
+  if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+     header->string_index_offset + (uint64_t)header->string_count * sizeof(uint32_t) > self->size ||
+     header->triple_offset + (uint64_t)header->triple_count *
+     sizeof(struct snapshot_triple_t) > self->size ||
+     header->volume_offset + (uint64_t)header->volume_count *
+     sizeof(struct snapshot_volume_t) > self->size) {
+    RaiseError(ERuntimeError, "%s is not a valid snapshot", filename);
+    goto error;
+  };
+
+  self->string_index = (uint32_t *)(self->base + header->string_index_offset);
+  self->triples = (struct snapshot_triple_t *)(self->base + header->triple_offset);
+
+  if(!snapshot_is_valid(self)) {
+    RaiseError(ERuntimeError, "%s is not a valid snapshot", filename);
+    goto error;
+  };
+
+  if(!snapshot_is_current(self))
+    goto error;
+
+  AFF4_GL_UNLOCK;
+  return self;
+
+ error:
+  talloc_free(self);
+  AFF4_GL_UNLOCK;
+  return NULL;
+};
+
+static void SnapshotDataStore_lock(DataStore this) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+
+  AFF4_GL_LOCK;
+  self->lock_depth++;
+  AFF4_GL_UNLOCK;
+};
+
+/* Borrowed objects go away when the last lock is released. */
+static void SnapshotDataStore_unlock(DataStore this) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+
+  AFF4_GL_LOCK;
+  if(self->lock_depth > 0)
+    self->lock_depth--;
+
+  if(self->lock_depth == 0) {
+    talloc_free(self->borrowed);
+    self->borrowed = talloc_size(self, 0);
+  };
+  AFF4_GL_UNLOCK;
+};
+
+/* Binary search for the string's id. Returns -1 if it is not known. */
+static int64_t snapshot_find_string(SnapshotDataStore self, char *string) {
+  uint32_t low = 0, high = self->header->string_count;
+
+  while(low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    int result = strcmp(snapshot_string(self, middle), string);
+
+    if(result == 0)
+      return middle;
+    else if(result < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  };
+
+  return -1;
+};
+
+/* Find the range of triples for the uri and attribute. Returns the
+   number of triples found.
+*/
+static uint32_t snapshot_find_triples(SnapshotDataStore self, char *uri,
+                                      char *attribute, uint32_t *first) {
+  int64_t subject = snapshot_find_string(self, uri);
+  int64_t predicate = snapshot_find_string(self, attribute);
+  uint32_t low = 0, high = self->header->triple_count;
+  uint32_t end;
+
+  if(subject < 0 || predicate < 0)
+    return 0;
+
+  // Find the first triple which is not less than what we want
+  while(low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    struct snapshot_triple_t *triple = &self->triples[middle];
+
+    if(triple->subject < subject ||
+       (triple->subject == subject && triple->attribute < predicate))
+      low = middle + 1;
+    else
+      high = middle;
+  };
+
+  for(end = low; end < self->header->triple_count; end++) {
+    if(self->triples[end].subject != subject ||
+       self->triples[end].attribute != predicate)
+      break;
+  };
+
+  *first = low;
+  return end - low;
+};
+
+static DataStoreObject snapshot_value(SnapshotDataStore self, uint32_t index) {
+  struct snapshot_triple_t *triple = &self->triples[index];
+
+  return CONSTRUCT(DataStoreObject, DataStoreObject, Con, self->borrowed,
+                   self->base + triple->data_offset, triple->length,
+                   snapshot_string(self, triple->rdf_type));
+};
+
+static void SnapshotDataStore_read_only(DataStore this, char *uri, char *attribute,
+                                        DataStoreObject value) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+
+  RaiseError(ERuntimeError, "Snapshot %s is read only", self->filename);
+
+  if(value)
+    talloc_steal(self->borrowed, value);
+};
+
+static void SnapshotDataStore_del(DataStore this, char *uri, char *attribute) {
+  SnapshotDataStore_read_only(this, uri, attribute, NULL);
+};
+
+static DataStoreObject SnapshotDataStore_get(DataStore this, char *uri,
+                                             char *attribute) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+  DataStoreObject result = NULL;
+  uint32_t first;
+
+  AFF4_GL_LOCK;
+  if(snapshot_find_triples(self, uri, attribute, &first) > 0)
+    result = snapshot_value(self, first);
+  AFF4_GL_UNLOCK;
+
+  return result;
+};
+
+static Object SnapshotDataStore_iter(DataStore this, char *uri, char *attribute) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+  struct snapshot_iter_t *iter = NULL;
+  uint32_t first, count;
+
+  AFF4_GL_LOCK;
+  count = snapshot_find_triples(self, uri, attribute, &first);
+  if(count > 0) {
+    iter = talloc(self->borrowed, struct snapshot_iter_t);
+    iter->current = first;
+    iter->end = first + count;
+  };
+  AFF4_GL_UNLOCK;
+
+  return (Object)iter;
+};
+
+static DataStoreObject SnapshotDataStore_next(DataStore this, Object *opaque_iter) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+  struct snapshot_iter_t *iter = (struct snapshot_iter_t *)*opaque_iter;
+  DataStoreObject result;
+
+  if(!iter) return NULL;
+
+  AFF4_GL_LOCK;
+  result = snapshot_value(self, iter->current);
+
+  iter->current++;
+  if(iter->current >= iter->end)
+    *opaque_iter = NULL;
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+/* The triples are sorted by subject, then attribute, so the
+   subject's attributes are a contiguous run.
+*/
+/* We have no index so we look at every triple. They are sorted by
+   subject so each subject is only found once.
+*/
+static Object SnapshotDataStore_iter_subjects(DataStore this, char *attribute,
+                                              DataStoreObject value) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+  struct subject_list_t *list;
+  int64_t predicate, last = -1;
+  uint32_t i;
+  Object result = NULL;
+
+  AFF4_GL_LOCK;
+  predicate = snapshot_find_string(self, attribute);
+  if(predicate < 0)
+    goto exit;
+
+  list = talloc_zero(self->borrowed, struct subject_list_t);
+  for(i=0; i < self->header->triple_count; i++) {
+    struct snapshot_triple_t *triple = &self->triples[i];
+
+    if(triple->attribute != predicate || triple->subject == last ||
+       triple->length != value->length ||
+       memcmp(self->base + triple->data_offset, value->data, value->length))
+      continue;
+
+    last = triple->subject;
+    list_subject(list, snapshot_string(self, triple->subject));
+  };
+
+  result = subject_list_iter(list);
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static Object SnapshotDataStore_iter_attributes(DataStore this, char *uri) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+  struct snapshot_iter_t *iter = NULL;
+  int64_t subject;
+  uint32_t low = 0, high, end;
+
+  AFF4_GL_LOCK;
+  subject = snapshot_find_string(self, uri);
+  if(subject < 0)
+    goto exit;
+
+  high = self->header->triple_count;
+  while(low < high) {
+    uint32_t middle = low + (high - low) / 2;
+
+    if(self->triples[middle].subject < subject)
+      low = middle + 1;
+    else
+      high = middle;
+  };
+
+  for(end = low; end < self->header->triple_count; end++) {
+    if(self->triples[end].subject != subject)
+      break;
+  };
+
+  if(end > low) {
+    iter = talloc(self->borrowed, struct snapshot_iter_t);
+    iter->current = low;
+    iter->end = end;
+  };
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return (Object)iter;
+};
+
+static char *SnapshotDataStore_next_attribute(DataStore this, Object *opaque_iter) {
+  SnapshotDataStore self = (SnapshotDataStore)this;
+  struct snapshot_iter_t *iter = (struct snapshot_iter_t *)*opaque_iter;
+  uint32_t attribute;
+
+  if(!iter) return NULL;
+
+  attribute = self->triples[iter->current].attribute;
+
+  // Skip the rest of the values of this attribute
+  while(iter->current < iter->end &&
+        self->triples[iter->current].attribute == attribute)
+    iter->current++;
+
+  if(iter->current >= iter->end)
+    *opaque_iter = NULL;
+
+  return snapshot_string(self, attribute);
+};
+
+VIRTUAL(SnapshotDataStore, DataStore)
+  VMETHOD(Con) = SnapshotDataStore_Con;
+
+  VMETHOD_BASE(DataStore, lock) = SnapshotDataStore_lock;
+  VMETHOD_BASE(DataStore, unlock) = SnapshotDataStore_unlock;
+  VMETHOD_BASE(DataStore, del) = SnapshotDataStore_del;
+  VMETHOD_BASE(DataStore, set) = SnapshotDataStore_read_only;
+  VMETHOD_BASE(DataStore, add) = SnapshotDataStore_read_only;
+  VMETHOD_BASE(DataStore, get) = SnapshotDataStore_get;
+  VMETHOD_BASE(DataStore, iter) = SnapshotDataStore_iter;
+  VMETHOD_BASE(DataStore, next) = SnapshotDataStore_next;
+  VMETHOD_BASE(DataStore, iter_subjects) = SnapshotDataStore_iter_subjects;
+  VMETHOD_BASE(DataStore, next_subject) = DataStore_next_listed_subject;
+  VMETHOD_BASE(DataStore, iter_attributes) = SnapshotDataStore_iter_attributes;
+  VMETHOD_BASE(DataStore, next_attribute) = SnapshotDataStore_next_attribute;
+END_VIRTUAL
+
+
+DataStore new_SnapshotDataStore(void *ctx, char *filename) {
+  return (DataStore)CONSTRUCT(SnapshotDataStore, SnapshotDataStore, Con, ctx, filename);
 };
@@ -37,10 +37,11 @@ DLL_PUBLIC void *aff4_raise_errors(int t, char *reason, ...) {
     //update the error type
     error_type = t;
   } else {
-    strncat(error_buffer, "\n", ERROR_BUFF_SIZE -1 );
+    strncat(error_buffer, "\n", ERROR_BUFF_SIZE - strlen(error_buffer) - 1);
   };
 
-  strncat(error_buffer, tmp, ERROR_BUFF_SIZE-1);
+  // Errors accumulate until they are cleared so we must not overflow.
+  strncat(error_buffer, tmp, ERROR_BUFF_SIZE - strlen(error_buffer) - 1);
 
   return NULL;
 };
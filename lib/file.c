@@ -29,6 +29,7 @@ static int FileBackedObject_destructor(void *self) {
 */
 static int FileBackedObject_AFFObject_finish(AFFObject this) {
   FileBackedObject self = (FileBackedObject)this;
+  struct stat buf;
   int flags;
 
   // Make sure that the urn passed has a file scheme
@@ -57,6 +58,23 @@ static int FileBackedObject_AFFObject_finish(AFFObject this) {
     talloc_set_destructor((void *)self, FileBackedObject_destructor);
   };
 
+  // Remember the size of the file so we never need to ask the kernel
+  // again - from now on we track it ourselves.
+  if(fstat(self->fd, &buf) < 0) {
+    RaiseError(EIOError, "Can't stat %s (%s)", this->urn->parser->query, strerror(errno));
+    goto error;
+  };
+
+  self->size = buf.st_size;
+
+  // Devices do not report their size through stat.
+  if(S_ISBLK(buf.st_mode)) {
+    off_t end = lseek(self->fd, 0, SEEK_END);
+
+    if(end > 0)
+      self->size = end;
+  };
+
   return 1;
 
  error:
@@ -73,7 +91,7 @@ static RDFValue FileBackedObject_resolve(AFFObject this, void *ctx, char *attrib
 
   if(!strcmp(attribute, AFF4_SIZE)) {
     result = new_XSDInteger(ctx);
-    result->value = lseek(self->fd, 0, SEEK_END);
+    result->value = self->size;
   };
 
   return (RDFValue)result;
@@ -138,15 +156,48 @@ static int FileBackedObject_read(FileLikeObject self, char *buffer, unsigned int
   FileBackedObject this = (FileBackedObject)self;
   int result;
 
-  lseek(this->fd,self->readptr,0);
-  result = read(this->fd, buffer, length);
+  AFF4_GL_LOCK;
+  AFF4_OBJECT_LOCK(self);
+
+  // Use pread so we do not disturb the shared file position. Our
+  // object lock protects the readptr so other files may be read
+  // while we wait for the disk.
+  AFF4_BEGIN_ALLOW_THREADS;
+  result = pread(this->fd, buffer, length, self->readptr);
+  AFF4_END_ALLOW_THREADS;
+
   if(result < 0) {
-    RaiseError(EIOError, "Unable to read from %s (%s)", URNOF(self), strerror(errno));
-    return -1;
+    RaiseError(EIOError, "Unable to read from %s (%s)", URNOF(self)->value, strerror(errno));
+    goto exit;
   };
 
   self->readptr += result;
 
+ exit:
+  AFF4_OBJECT_UNLOCK(self);
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+/* The readptr is not involved at all so we do not need the object
+   lock.
+*/
+static int FileBackedObject_read_at(FileLikeObject self, char *buffer,
+                                    unsigned int length, uint64_t offset) {
+  FileBackedObject this = (FileBackedObject)self;
+  int result;
+
+  AFF4_GL_LOCK;
+
+  AFF4_BEGIN_ALLOW_THREADS;
+  result = pread(this->fd, buffer, length, offset);
+  AFF4_END_ALLOW_THREADS;
+
+  if(result < 0) {
+    RaiseError(EIOError, "Unable to read from %s (%s)", URNOF(self)->value, strerror(errno));
+  };
+
+  AFF4_GL_UNLOCK;
   return result;
 };
 
@@ -156,14 +207,27 @@ static int FileBackedObject_write(FileLikeObject self, char *buffer, unsigned in
 
   if(length == 0) return 0;
 
-  lseek(this->fd,self->readptr,SEEK_SET);
-  result = write(this->fd, buffer, length);
+  AFF4_GL_LOCK;
+  AFF4_OBJECT_LOCK(self);
+
+  AFF4_BEGIN_ALLOW_THREADS;
+  result = pwrite(this->fd, buffer, length, self->readptr);
+  AFF4_END_ALLOW_THREADS;
+
   if(result < 0) {
     RaiseError(EIOError, "Unable to write to %s (%s)", URNOF(self)->value, strerror(errno));
+    goto exit;
   };
 
   self->readptr += result;
 
+  // Writing past the end grows the file.
+  if(self->readptr > this->size)
+    this->size = self->readptr;
+
+ exit:
+  AFF4_OBJECT_UNLOCK(self);
+  AFF4_GL_UNLOCK;
   return result;
 };
 
@@ -179,13 +243,33 @@ static int FileLikeObject_close(AFFObject self) {
   return SUPER(AFFObject, AFFObject, close);
 };
 
+/* Seeking is pure arithmetic on the readptr - we know our size so
+   SEEK_END does not need to ask the kernel.
+*/
 static uint64_t FileBackedObject_seek(FileLikeObject self, int64_t offset, int whence) {
   FileBackedObject this = (FileBackedObject)self;
+  int64_t result = self->readptr;
+
+  switch(whence) {
+  case SEEK_SET:
+    result = offset;
+    break;
 
-  int64_t result = lseek(this->fd, offset, whence);
+  case SEEK_CUR:
+    result += offset;
+    break;
+
+  case SEEK_END:
+    result = this->size + offset;
+    break;
+
+  default:
+    DEBUG_OBJECT("Invalid whence %d\n", whence);
+    break;
+  };
 
   if(result < 0) {
-    DEBUG_OBJECT("Error seeking %s\n", strerror(errno));
+    DEBUG_OBJECT("Error seeking to %lld\n", (long long)result);
     result = 0;
   };
 
@@ -193,6 +277,24 @@ static uint64_t FileBackedObject_seek(FileLikeObject self, int64_t offset, int w
   return result;
 };
 
+static int FileLikeObject_read_at(FileLikeObject self, char *buffer,
+                                  unsigned int length, uint64_t offset) {
+  int64_t readptr;
+  int result;
+
+  AFF4_GL_LOCK;
+  AFF4_OBJECT_LOCK(self);
+
+  readptr = self->readptr;
+  CALL(self, seek, offset, SEEK_SET);
+  result = CALL(self, read, buffer, length);
+  self->readptr = readptr;
+
+  AFF4_OBJECT_UNLOCK(self);
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
 static XSDString FileLikeObject_get_data(FileLikeObject self, void *ctx) {
   XSDString data;
   XSDInteger size = (XSDInteger)CALL((AFFObject)self, resolve, ctx, AFF4_SIZE);
@@ -224,12 +326,16 @@ VIRTUAL(FileLikeObject, AFFObject) {
      VMETHOD(truncate) = FileLikeObject_truncate;
      VMETHOD(get_data) = FileLikeObject_get_data;
      VMETHOD(readline) = FileLikeObject_readline;
+     VMETHOD(read_at) = FileLikeObject_read_at;
 } END_VIRTUAL
 
 static int FileBackedObject_truncate(FileLikeObject self, uint64_t offset) {
   FileBackedObject this=(FileBackedObject)self;
 
-  ftruncate(this->fd, offset);
+  if(ftruncate(this->fd, offset) == 0) {
+    this->size = offset;
+  };
+
   return SUPER(FileLikeObject, FileLikeObject, truncate, offset);
 };
 
@@ -240,12 +346,446 @@ VIRTUAL(FileBackedObject, FileLikeObject) {
   VMETHOD_BASE(AFFObject, resolve) = FileBackedObject_resolve;
 
   VMETHOD_BASE(FileLikeObject, read) = FileBackedObject_read;
+  VMETHOD_BASE(FileLikeObject, read_at) = FileBackedObject_read_at;
   VMETHOD_BASE(FileLikeObject, write) = FileBackedObject_write;
   VMETHOD_BASE(FileLikeObject, seek) = FileBackedObject_seek;
   VMETHOD_BASE(FileLikeObject, truncate) = FileBackedObject_truncate;
 } END_VIRTUAL;
 
 
+/** Implementation of BufferedWriter.
+
+    All offsets are tracked in our own readptr. The backing store is
+    only seeked when data is actually written or read through to it.
+    Pending data is not written when the buffer is freed, callers must
+    flush() or close() it first.
+
+    We own the backing store but have our own URN - the backing store
+    is still the object the resolver knows about under its URN.
+*/
+static BufferedWriter BufferedWriter_Con(BufferedWriter self,
+                                         FileLikeObject backing_store,
+                                         unsigned int buffer_size) {
+  AFFObject backing = (AFFObject)backing_store;
+
+  AFF4_GL_LOCK;
+
+  if(!backing_store) {
+    RaiseError(EProgrammingError, "No backing store given.");
+    goto error;
+  };
+
+  if(buffer_size == 0)
+    buffer_size = BUFF_SIZE;
+
+  SUPER(AFFObject, FileLikeObject, Con, NULL, backing->mode,
+        backing->resolver);
+
+  self->backing_store = talloc_steal(self, backing_store);
+  self->buffer_size = buffer_size;
+  self->buffer = talloc_size(self, buffer_size);
+  self->buffer_used = 0;
+  self->buffer_offset = 0;
+
+  ((FileLikeObject)self)->readptr = CALL(backing_store, tell);
+  ((AFFObject)self)->complete = 1;
+
+  AFF4_GL_UNLOCK;
+  return self;
+
+ error:
+  talloc_free(self);
+  AFF4_GL_UNLOCK;
+  return NULL;
+};
+
+static int BufferedWriter_flush(BufferedWriter self) {
+  int result = 1;
+
+  AFF4_GL_LOCK;
+
+  while(self->buffer_used > 0) {
+    int written;
+
+    CALL(self->backing_store, seek, self->buffer_offset, SEEK_SET);
+    written = CALL(self->backing_store, write, self->buffer, self->buffer_used);
+    if(written <= 0) {
+      RaiseError(EIOError, "Unable to flush buffer to backing store.");
+      result = 0;
+      break;
+    };
+
+    /* Keep anything which was not written for the next flush. */
+    memmove(self->buffer, self->buffer + written, self->buffer_used - written);
+    self->buffer_used -= written;
+    self->buffer_offset += written;
+  };
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static int BufferedWriter_write(FileLikeObject this, char *buffer,
+                                unsigned int length) {
+  BufferedWriter self = (BufferedWriter)this;
+  int result = length;
+
+  AFF4_GL_LOCK;
+
+  if(length == 0) goto exit;
+
+  /* We can only append to the buffer if this write follows on
+     directly from the pending data and it all fits.
+  */
+  if(self->buffer_used > 0 &&
+     (this->readptr != self->buffer_offset + self->buffer_used ||
+      self->buffer_used + length > self->buffer_size)) {
+    if(!CALL(self, flush))
+      goto error;
+  };
+
+  if(self->buffer_used == 0) {
+    /* Large writes gain nothing from the buffer. */
+    if(length >= self->buffer_size) {
+      CALL(self->backing_store, seek, this->readptr, SEEK_SET);
+      result = CALL(self->backing_store, write, buffer, length);
+      if(result < 0)
+        goto error;
+
+      this->readptr += result;
+      goto exit;
+    };
+
+    self->buffer_offset = this->readptr;
+  };
+
+  memcpy(self->buffer + self->buffer_used, buffer, length);
+  self->buffer_used += length;
+  this->readptr += length;
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+
+ error:
+  AFF4_GL_UNLOCK;
+  return -1;
+};
+
+static int BufferedWriter_read(FileLikeObject this, char *buffer,
+                               unsigned int length) {
+  BufferedWriter self = (BufferedWriter)this;
+  int result;
+
+  AFF4_GL_LOCK;
+
+  if(!CALL(self, flush)) {
+    result = -1;
+    goto exit;
+  };
+
+  CALL(self->backing_store, seek, this->readptr, SEEK_SET);
+  result = CALL(self->backing_store, read, buffer, length);
+  if(result > 0)
+    this->readptr += result;
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static uint64_t BufferedWriter_seek(FileLikeObject this, int64_t offset,
+                                    int whence) {
+  BufferedWriter self = (BufferedWriter)this;
+  int64_t result = this->readptr;
+
+  AFF4_GL_LOCK;
+
+  switch(whence) {
+  case SEEK_SET:
+    result = offset;
+    break;
+
+  case SEEK_CUR:
+    result += offset;
+    break;
+
+  case SEEK_END: {
+    /* The end is either the end of the backing store or the end of
+       our pending data, whichever is further.
+    */
+    uint64_t backing_size = CALL(self->backing_store, seek, 0, SEEK_END);
+
+    result = max(backing_size, self->buffer_offset + self->buffer_used) + offset;
+  }; break;
+
+  default:
+    break;
+  };
+
+  if(result < 0)
+    result = 0;
+
+  this->readptr = result;
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static int BufferedWriter_truncate(FileLikeObject this, uint64_t offset) {
+  BufferedWriter self = (BufferedWriter)this;
+  int result;
+
+  AFF4_GL_LOCK;
+
+  CALL(self, flush);
+  result = CALL(self->backing_store, truncate, offset);
+  this->readptr = min(offset, this->readptr);
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static RDFValue BufferedWriter_resolve(AFFObject this, void *ctx, char *attribute) {
+  BufferedWriter self = (BufferedWriter)this;
+  RDFValue result;
+
+  AFF4_GL_LOCK;
+
+  if(!strcmp(attribute, AFF4_SIZE)) {
+    XSDInteger size = new_XSDInteger(ctx);
+    uint64_t backing_size = CALL(self->backing_store, seek, 0, SEEK_END);
+
+    size->value = max(backing_size, self->buffer_offset + self->buffer_used);
+    result = (RDFValue)size;
+  } else {
+    result = CALL((AFFObject)self->backing_store, resolve, ctx, attribute);
+  };
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+/* The backing store is only closed once everything reached it - if
+   the flush fails the pending data is kept so it can be retried.
+*/
+static int BufferedWriter_close(AFFObject this) {
+  BufferedWriter self = (BufferedWriter)this;
+  int result;
+
+  AFF4_GL_LOCK;
+  result = CALL(self, flush);
+  if(result)
+    result = CALL((AFFObject)self->backing_store, close);
+  AFF4_GL_UNLOCK;
+
+  return result;
+};
+
+VIRTUAL(BufferedWriter, FileLikeObject) {
+  VMETHOD(Con) = BufferedWriter_Con;
+  VMETHOD(flush) = BufferedWriter_flush;
+
+  VMETHOD_BASE(AFFObject, resolve) = BufferedWriter_resolve;
+  VMETHOD_BASE(AFFObject, close) = BufferedWriter_close;
+
+  VMETHOD_BASE(FileLikeObject, read) = BufferedWriter_read;
+  VMETHOD_BASE(FileLikeObject, write) = BufferedWriter_write;
+  VMETHOD_BASE(FileLikeObject, seek) = BufferedWriter_seek;
+  VMETHOD_BASE(FileLikeObject, truncate) = BufferedWriter_truncate;
+} END_VIRTUAL;
+
+
+/** Asynchronous reads.
+
+    Each request is a ThreadPoolJob which reads from its stream with
+    read_at() so the stream's readptr is never moved and synchronous
+    users of the stream do not notice.
+*/
+static AsyncRead AsyncRead_Con(AsyncRead self, FileLikeObject stream,
+                               uint64_t offset, char *buffer,
+                               unsigned int length) {
+  if(!stream || !buffer) {
+    RaiseError(EProgrammingError, "No stream or buffer given.");
+    talloc_free(self);
+    return NULL;
+  };
+
+  self->stream = stream;
+  self->offset = offset;
+  self->buffer = buffer;
+  self->length = length;
+  self->result = -1;
+  INIT_LIST_HEAD(&self->list);
+
+  return self;
+};
+
+static void AsyncRead_run(ThreadPoolJob this) {
+  AsyncRead self = (AsyncRead)this;
+
+  self->result = CALL(self->stream, read_at, self->buffer, self->length,
+                      self->offset);
+
+  // The error belongs to this request, not the worker thread.
+  if(self->result < 0)
+    ClearError();
+};
+
+/* Requests in a batch are moved to its completion queue - the batch
+   now owns them so the pool must not free them.
+*/
+static int AsyncRead_complete(ThreadPoolJob this) {
+  AsyncRead self = (AsyncRead)this;
+  ReadBatch batch = self->batch;
+
+  if(!batch) return 1;
+
+  list_move_tail(&self->list, &batch->completed);
+  talloc_steal(batch, self);
+
+  return 0;
+};
+
+VIRTUAL(AsyncRead, ThreadPoolJob) {
+  VMETHOD(Con) = AsyncRead_Con;
+  VMETHOD_BASE(ThreadPoolJob, run) = AsyncRead_run;
+  VMETHOD_BASE(ThreadPoolJob, complete) = AsyncRead_complete;
+} END_VIRTUAL
+
+
+/* The buffers of pending requests belong to the caller so we can not
+   leave the workers running after the batch is gone.
+*/
+static int ReadBatch_destructor(void *this) {
+  ReadBatch self = (ReadBatch)this;
+
+  AFF4_GL_LOCK;
+
+  while(!list_empty(&self->pending)) {
+    AsyncRead request;
+
+    list_next(request, &self->pending, list);
+
+    /* However long it takes - the worker may still be reading into
+       the caller's buffer.
+    */
+    while(!CALL((ThreadPoolJob)request, wait, 60));
+
+    CALL(self->pool, complete, self);
+  };
+
+  AFF4_GL_UNLOCK;
+  return 0;
+};
+
+static ReadBatch ReadBatch_Con(ReadBatch self, ThreadPool pool) {
+  if(!pool)
+    pool = AFF4_get_thread_pool();
+
+  self->pool = pool;
+  self->outstanding = 0;
+  INIT_LIST_HEAD(&self->pending);
+  INIT_LIST_HEAD(&self->completed);
+
+  talloc_set_destructor((void *)self, ReadBatch_destructor);
+
+  return self;
+};
+
+static int ReadBatch_submit(ReadBatch self, AsyncRead request) {
+  int result;
+
+  AFF4_GL_LOCK;
+
+  request->batch = self;
+  ((ThreadPoolJob)request)->owner = self;
+  list_add_tail(&request->list, &self->pending);
+
+  result = CALL(self->pool, schedule, (ThreadPoolJob)request, 60);
+  if(!result) {
+    RaiseError(ERuntimeError, "Unable to schedule read request.");
+    list_del(&request->list);
+    talloc_free(request);
+    goto exit;
+  };
+
+  self->outstanding ++;
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static AsyncRead ReadBatch_read(ReadBatch self, FileLikeObject stream,
+                                uint64_t offset, char *buffer,
+                                unsigned int length) {
+  AsyncRead request;
+
+  AFF4_GL_LOCK;
+
+  request = CONSTRUCT(AsyncRead, AsyncRead, Con, self, stream, offset,
+                      buffer, length);
+  if(!request || !CALL(self, submit, request))
+    request = NULL;
+
+  AFF4_GL_UNLOCK;
+  return request;
+};
+
+static AsyncRead ReadBatch_poll(ReadBatch self, void *ctx, int timeout) {
+  time_t deadline = time(NULL) + timeout;
+  AsyncRead result = NULL;
+
+  AFF4_GL_LOCK;
+
+  while(self->outstanding > 0) {
+    AsyncRead request;
+
+    CALL(self->pool, complete, self);
+
+    /* Someone else may still be waiting on a completed request. */
+    list_for_each_entry(request, &self->completed, list) {
+      if(((ThreadPoolJob)request)->waiters == 0) {
+        result = request;
+        break;
+      };
+    };
+
+    if(result) {
+      list_del_init(&result->list);
+      result->batch = NULL;
+      talloc_steal(ctx, result);
+      self->outstanding --;
+      break;
+    };
+
+    if(time(NULL) >= deadline)
+      break;
+
+    /* Requests mostly finish in order so wait for the oldest. */
+    if(!list_empty(&self->pending)) {
+      list_next(request, &self->pending, list);
+      CALL((ThreadPoolJob)request, wait, 1);
+    } else {
+      AFF4_BEGIN_ALLOW_THREADS;
+      sched_yield();
+      AFF4_END_ALLOW_THREADS;
+    };
+  };
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+VIRTUAL(ReadBatch, Object) {
+  VMETHOD(Con) = ReadBatch_Con;
+  VMETHOD(read) = ReadBatch_read;
+  VMETHOD(submit) = ReadBatch_submit;
+  VMETHOD(poll) = ReadBatch_poll;
+} END_VIRTUAL
+
+
 AFF4_MODULE_INIT(A000_file) {
   register_type_dispatcher(AFF4_FILE, (AFFObject *)GETCLASS(FileBackedObject));
 };
@@ -109,3 +109,225 @@ VIRTUAL(Queue, Object)
      VMETHOD_BASE(Queue, put) = Queue_put;
      VMETHOD_BASE(Queue, remove) = Queue_remove;
 END_VIRTUAL
+
+
+/************************************************************
+  RingQueue - A bounded lock free queue.
+
+  Each cell carries a sequence number. A cell at position pos is
+  free for a producer when its sequence is pos, and holds data for a
+  consumer when its sequence is pos + 1. Producers and consumers
+  claim positions by advancing the tail and head counters with a
+  compare and swap.
+************************************************************/
+static int RingQueue_destructor(void *this) {
+  RingQueue self = (RingQueue)this;
+
+  pthread_mutex_destroy(&self->park_lock);
+  pthread_cond_destroy(&self->not_empty);
+  pthread_cond_destroy(&self->not_full);
+
+  return 0;
+};
+
+static RingQueue RingQueue_Con(RingQueue self, unsigned int size) {
+  unsigned int i, length = 2;
+
+  while(length < size) length <<= 1;
+
+  self->cells = talloc_array(self, struct ring_cell_t, length);
+  self->mask = length - 1;
+  self->head = 0;
+  self->tail = 0;
+
+  for(i=0; i<length; i++) {
+    self->cells[i].sequence = i;
+    self->cells[i].data = NULL;
+  };
+
+  pthread_mutex_init(&self->park_lock, NULL);
+  pthread_cond_init(&self->not_empty, NULL);
+  pthread_cond_init(&self->not_full, NULL);
+
+  talloc_set_destructor((void *)self, RingQueue_destructor);
+
+  return self;
+};
+
+/* Wake up anyone parked on the condition. The full barrier orders our
+   update of the cell against reading the waiters count.
+*/
+static void wake_waiters(RingQueue self, volatile int *waiting,
+                         pthread_cond_t *condition) {
+  __sync_synchronize();
+
+  if(*waiting > 0) {
+    pthread_mutex_lock(&self->park_lock);
+    pthread_cond_signal(condition);
+    pthread_mutex_unlock(&self->park_lock);
+  };
+};
+
+static int ring_put(RingQueue self, void *data) {
+  unsigned int pos = self->tail;
+  struct ring_cell_t *cell;
+
+  while(1) {
+    int diff;
+
+    cell = &self->cells[pos & self->mask];
+    diff = (int)(cell->sequence - pos);
+    __sync_synchronize();
+
+    if(diff == 0) {
+      if(__sync_bool_compare_and_swap(&self->tail, pos, pos + 1))
+        break;
+
+      // Another producer took this cell - try again.
+    } else if(diff < 0) {
+      // The queue is full.
+      return 0;
+    };
+
+    pos = self->tail;
+  };
+
+  cell->data = data;
+
+  // Publish the data to consumers.
+  __sync_synchronize();
+  cell->sequence = pos + 1;
+
+  return 1;
+};
+
+static void *ring_get(RingQueue self) {
+  unsigned int pos = self->head;
+  struct ring_cell_t *cell;
+  void *result;
+
+  while(1) {
+    int diff;
+
+    cell = &self->cells[pos & self->mask];
+    diff = (int)(cell->sequence - (pos + 1));
+    __sync_synchronize();
+
+    if(diff == 0) {
+      if(__sync_bool_compare_and_swap(&self->head, pos, pos + 1))
+        break;
+
+      // Another consumer took this cell - try again.
+    } else if(diff < 0) {
+      // The queue is empty.
+      return NULL;
+    };
+
+    pos = self->head;
+  };
+
+  result = cell->data;
+
+  // Hand the cell back to producers for the next lap.
+  __sync_synchronize();
+  cell->sequence = pos + self->mask + 1;
+
+  return result;
+};
+
+static int RingQueue_try_put(RingQueue self, void *data) {
+  if(!ring_put(self, data)) return 0;
+
+  wake_waiters(self, &self->getters_waiting, &self->not_empty);
+  return 1;
+};
+
+static void *RingQueue_try_get(RingQueue self) {
+  void *result = ring_get(self);
+
+  if(result)
+    wake_waiters(self, &self->putters_waiting, &self->not_full);
+
+  return result;
+};
+
+static void make_deadline(struct timespec *deadline, int64_t timeout) {
+  struct timeval now;
+  int64_t usec;
+
+  gettimeofday(&now, NULL);
+  usec = now.tv_usec + timeout;
+
+  deadline->tv_sec = now.tv_sec + usec / 1000000;
+  deadline->tv_nsec = (usec % 1000000) * 1000;
+};
+
+/* The slow path - park until the operation succeeds or the deadline
+   passes. The waiters count is raised under the park_lock before we
+   retry, so a wake up can not be lost between the retry and the wait.
+*/
+static int RingQueue_put(RingQueue self, void *data, int64_t timeout) {
+  struct timespec deadline;
+  int result = CALL(self, try_put, data);
+
+  if(result) return result;
+
+  make_deadline(&deadline, timeout);
+
+  AFF4_BEGIN_ALLOW_THREADS;
+
+  pthread_mutex_lock(&self->park_lock);
+  __sync_fetch_and_add(&self->putters_waiting, 1);
+
+  while(!(result = ring_put(self, data))) {
+    if(pthread_cond_timedwait(&self->not_full, &self->park_lock, &deadline))
+      break;
+  };
+
+  __sync_fetch_and_sub(&self->putters_waiting, 1);
+  pthread_mutex_unlock(&self->park_lock);
+
+  if(result)
+    wake_waiters(self, &self->getters_waiting, &self->not_empty);
+
+  AFF4_END_ALLOW_THREADS;
+
+  return result;
+};
+
+static void *RingQueue_get(RingQueue self, int64_t timeout) {
+  struct timespec deadline;
+  void *result = CALL(self, try_get);
+
+  if(result) return result;
+
+  make_deadline(&deadline, timeout);
+
+  AFF4_BEGIN_ALLOW_THREADS;
+
+  pthread_mutex_lock(&self->park_lock);
+  __sync_fetch_and_add(&self->getters_waiting, 1);
+
+  while(!(result = ring_get(self))) {
+    if(pthread_cond_timedwait(&self->not_empty, &self->park_lock, &deadline))
+      break;
+  };
+
+  __sync_fetch_and_sub(&self->getters_waiting, 1);
+  pthread_mutex_unlock(&self->park_lock);
+
+  if(result)
+    wake_waiters(self, &self->putters_waiting, &self->not_full);
+
+  AFF4_END_ALLOW_THREADS;
+
+  return result;
+};
+
+VIRTUAL(RingQueue, Object) {
+  VMETHOD(Con) = RingQueue_Con;
+  VMETHOD(try_put) = RingQueue_try_put;
+  VMETHOD(try_get) = RingQueue_try_get;
+  VMETHOD(put) = RingQueue_put;
+  VMETHOD(get) = RingQueue_get;
+} END_VIRTUAL
@@ -5,200 +5,174 @@
     parsing
 */
 #include "aff4_internal.h"
+#include <ctype.h>
 
 
-/** Parsing URLs - basically a state machine */
-enum url_state {
-  STATE_METHOD,
-  STATE_COLLON,
-  STATE_NETLOCK,
-  STATE_QUERY,
-  STATE_FRAGMENT,
-  STATE_END
+/** Parsing URLs.
+
+    The components are found as spans of the url in a single pass and
+    then copied into one buffer, each null terminated. The query is
+    stored last in the buffer so append() can extend it in place.
+*/
+static char *copy_span(char **out, char *start, int length) {
+  char *result = *out;
+
+  memcpy(result, start, length);
+  result[length] = 0;
+  *out += length + 1;
+
+  return result;
+};
+
+static void set_components(URLParse self, char *scheme, int scheme_length,
+                           char *netloc, int netloc_length,
+                           char *query, int query_length,
+                           char *fragment, int fragment_length) {
+  // The spans may point into our old buffer so we only free it after
+  // copying.
+  char *old = self->buffer;
+  char *out = talloc_size(self, scheme_length + netloc_length + query_length +
+                          fragment_length + 4);
+
+  self->buffer = out;
+  self->scheme = copy_span(&out, scheme, scheme_length);
+  self->netloc = copy_span(&out, netloc, netloc_length);
+  self->fragment = copy_span(&out, fragment, fragment_length);
+  self->query = copy_span(&out, query, query_length);
+
+  talloc_free(old);
 };
 
 static URLParse URLParse_Con(URLParse self, char *url) {
   if(url)
     CALL(self, parse ,url);
-  self->ctx = talloc_size(self, 1);
   return self;
 };
 
 static int URLParse_parse(URLParse self, char *url) {
-  int i=0,j=0,end=0;
-  char buff[BUFF_SIZE];
-  enum url_state state = STATE_METHOD;
-
-  talloc_free(self->ctx);
-  self->ctx = talloc_size(self, 1);
-
-  // Initialise with defaults:
-  self->scheme = "";
-  self->netloc = "";
-  self->query = "";
-  self->fragment = "";
+  char *netloc = "", *query, *fragment = "", *i;
+  int scheme_length = 0, netloc_length = 0, query_length, fragment_length = 0;
 
   // Its ok to call us with NULL - we just wont parse anything.
-  if(!url) goto exit;
-
-  while(!end) {
-    if(url[i]==0) end=1;
-
-    switch(state) {
-    case STATE_METHOD: {
-      // This happens when the url contains no : at all - we interpret
-      // it as a file URL with no netloc
-      if(url[i]=='#' || url[i]=='/') {
-        i--;
-        state = STATE_QUERY;
-      } else if(url[i]==0) {
-	buff[j]=0; j=0;
-	self->query = talloc_strdup(self->ctx,buff);
-	state = STATE_QUERY;
-      }else if(url[i] == ':') {
-	buff[j]=0; j=0;
-	state = STATE_COLLON;
-	self->scheme = talloc_strdup(self->ctx, buff);
-      } else buff[j++] = url[i];
-      break;
-    };
+  if(!url) url = "";
 
-    case STATE_COLLON: {
-      if(url[i]=='/' && url[i+1]=='/') {
-	state = STATE_NETLOCK;
-	i+=1;
-      } else state = STATE_QUERY;
-      break;
-    };
+  // A url with no : before the first / or # is interpreted as a file
+  // URL with no netloc.
+  i = url + strcspn(url, ":/#");
+  query = url;
 
-    case STATE_NETLOCK: {
-      if(url[i]==0 || ((url[i]=='/' || url[i]=='#') && i--)) {
-	state = STATE_QUERY;
-	buff[j]=0; j=0;
-	self->netloc = talloc_strdup(self->ctx,buff);
-      } else buff[j++] = url[i];
-      break;
-    };
-
-    case STATE_QUERY: {
-      if(url[i]==0 || url[i]=='#') {
-	state = STATE_FRAGMENT;
-	buff[j]=0; j=0;
-	self->query = talloc_strdup(self->ctx,buff);
-      } else buff[j++] = url[i];
-      break;
-    };
+  if(*i == ':') {
+    scheme_length = i - url;
+    i++;
 
-    case STATE_FRAGMENT: {
-      if(url[i]==0) {
-	state = STATE_END;
-	buff[j]=0; j=0;
-	self->fragment = talloc_strdup(self->ctx,buff);
-      } else buff[j++] = url[i];
-      break;
+    if(i[0] == '/' && i[1] == '/') {
+      netloc = i + 2;
+      netloc_length = strcspn(netloc, "/#");
+      i = netloc + netloc_length;
     };
 
-    default:
-    case STATE_END:
-      goto exit;
-
-    };
+    query = i;
+  };
 
-    i++;
+  query_length = strcspn(query, "#");
+  if(query[query_length] == '#') {
+    fragment = query + query_length + 1;
+    fragment_length = strlen(fragment);
   };
 
-exit:
+  set_components(self, url, scheme_length, netloc, netloc_length,
+                 query, query_length, fragment, fragment_length);
+
   return 0;
 };
 
-struct path_element {
-  char *element;
-  int length;
-  struct list_head list;
+static void URLParse_append(URLParse self, char *path, int length) {
+  int scheme = self->scheme - self->buffer;
+  int netloc = self->netloc - self->buffer;
+  int fragment = self->fragment - self->buffer;
+  int query = self->query - self->buffer;
+  int query_length = strlen(self->query);
+
+  self->buffer = talloc_realloc(self, self->buffer, char,
+                                query + query_length + length + 2);
+  self->scheme = self->buffer + scheme;
+  self->netloc = self->buffer + netloc;
+  self->fragment = self->buffer + fragment;
+  self->query = self->buffer + query;
+
+  if(query_length > 0)
+    self->query[query_length++] = '/';
+
+  memcpy(self->query + query_length, path, length);
+  self->query[query_length + length] = 0;
 };
 
-static char *collapse_path(char *query, void *ctx) {
-  struct path_element *path = talloc(ctx, struct path_element);
-  char *i, *j;
-  struct path_element *current;
-  char *result;
+/* Appends path to the first length bytes of out, dropping empty and
+   . elements and popping an element for each .. element. We never pop
+   into the first root bytes. out must have room for one more byte
+   than path. Returns the new length of out.
+*/
+static int collapse_path(char *out, int length, int root, char *path,
+                         int path_length) {
+  char *end = path + path_length;
 
-  INIT_LIST_HEAD(&path->list);
-
-  // Split the path into components
-  for(i=query, j=query; ; i++) {
-    if(*i=='/' || *i==0) {
-      current = talloc(path, struct path_element);
-      current->element = talloc_size(current, i-j);
-      memcpy(current->element, j, i-j);
-      current->length = i-j;
-
-      // If this element is .. we pop the last element from the list
-      if(current->length == 2 && !memcmp(current->element, "..", 2)) {
-        talloc_free(current);
-        if(!list_empty(&path->list)) {
-          list_prev(current, &path->list, list);
-          list_del(&current->list);
-          talloc_free(current);
-        };
-		// Drop /./ sequences
-	  } else if(current->length==1 && current->element[0]=='.') {
-		talloc_free(current);
-        // Drop empty path elements
-      } else if(current->length==0) {
-        talloc_free(current);
-      } else {
-        list_add_tail(&current->list, &path->list);
-      };
-      j=i+1;
-    };
+  while(path < end) {
+    char *element = path;
+    int element_length;
 
-    // The last element is null terminated
-    if(*i==0) break;
-  };
+    while(path < end && *path != '/') path++;
+    element_length = path - element;
+    path++;
+
+    // Drop empty path elements and /./ sequences
+    if(element_length == 0 || (element_length == 1 && *element == '.'))
+      continue;
 
-  result = talloc_size(ctx, i - query + 20);
-  j=result;
-  list_for_each_entry(current, &path->list, list) {
-    // Dont write empty elements
-    if(current->length == 0) continue;
+    // If this element is .. we pop the last element
+    if(element_length == 2 && element[0] == '.' && element[1] == '.') {
+      while(length > root && out[--length] != '/');
+      continue;
+    };
 
-    *j++ = '/';
-    memcpy(j, current->element, current->length);
-    j+=current->length;
+    out[length++] = '/';
+    memcpy(out + length, element, element_length);
+    length += element_length;
   };
 
-  *j=0;
+  return length;
+};
 
-  talloc_free(path);
+/* The length of the part of the string() before the path. */
+static int root_length(URLParse self) {
+  char *scheme = self->scheme;
 
-  return result;
-};
+  if(!scheme || !*scheme)
+    scheme = "file";
 
+  return strlen(scheme) + 3 + strlen(self->netloc);
+};
 
 static char *URLParse_string(URLParse self, void *ctx) {
-  char *fmt;
   char *scheme = self->scheme;
-  char *query, *result;
-
-  if(strlen(self->fragment)>0)
-    fmt = "%s://%s%s#%s";
-  else if(strlen(self->query)>0) {
-    fmt = "%s://%s%s";
-  } else
-    fmt = "%s://%s";
+  int root = root_length(self);
+  int query_length = strlen(self->query);
+  int fragment_length = strlen(self->fragment);
+  char *result = talloc_size(ctx, root + query_length + fragment_length + 3);
+  int length;
 
-  if(!scheme || strlen(scheme)==0)
+  if(!scheme || !*scheme)
     scheme = "file";
 
-  query = collapse_path(self->query, NULL);
+  sprintf(result, "%s://%s", scheme, self->netloc);
+  length = collapse_path(result, root, root, self->query, query_length);
 
-  result = talloc_asprintf(ctx, fmt, scheme,
-                           self->netloc,
-                           query,
-                           self->fragment);
+  if(fragment_length > 0) {
+    result[length++] = '#';
+    memcpy(result + length, self->fragment, fragment_length);
+    length += fragment_length;
+  };
 
-  talloc_free(query);
+  result[length] = 0;
 
   return result;
 };
@@ -207,6 +181,7 @@ VIRTUAL(URLParse, Object) {
     VMETHOD(Con) = URLParse_Con;
     VMETHOD(string) = URLParse_string;
     VMETHOD(parse) = URLParse_parse;
+    VMETHOD(append) = URLParse_append;
 } END_VIRTUAL
 
 /** Following is the implementation of the basic RDFValue types */
@@ -433,7 +408,7 @@ static RDFValue RDFURN_Con(RDFValue self) {
   this->parser = CONSTRUCT(URLParse, URLParse, Con, this, NULL);
   this->value = talloc_strdup(self, "(unset)");
 
-  return self;
+  return SUPER(RDFValue, RDFValue, Con);
 };
 
 static RDFURN RDFURN_Con2(RDFURN self, char *urn) {
@@ -447,7 +422,20 @@ static RDFURN RDFURN_Con2(RDFURN self, char *urn) {
   return self;
 };
 
+/* Interned URNs are shared so they may never change. */
+static int check_mutable(RDFURN self) {
+  if(self->interned) {
+    RaiseError(EProgrammingError, "Interned URN %s can not be changed",
+               self->value);
+    return 0;
+  };
+
+  return 1;
+};
+
 static void RDFURN_set(RDFURN self, char *string) {
+  if(!check_mutable(self)) return;
+
   CALL(self->parser, parse, string);
 
   // Our value is the serialsed version of what the parser got:
@@ -462,6 +450,8 @@ static int RDFURN_decode(RDFValue this, DataStoreObject obj, RDFURN subject,
                          Resolver resolver) {
   RDFURN self = (RDFURN)this;
 
+  if(!check_mutable(self)) return 0;
+
   // NULL terminate just in case.
   obj->data[obj->length-1] = 0;
   CALL(self->parser, parse, obj->data);
@@ -480,8 +470,20 @@ static char *RDFURN_serialise(RDFValue self, void *ctx, RDFURN subject) {
 
 static RDFURN RDFURN_copy(RDFURN self, void *ctx) {
   RDFURN result = CONSTRUCT(RDFURN, RDFValue, Con, ctx);
-
-  CALL(result, set, self->value);
+  URLParse parser = self->parser;
+
+  // Interned URNs are parsed from their normalised value so we can
+  // just copy the components.
+  if(self->interned) {
+    set_components(result->parser, parser->scheme, strlen(parser->scheme),
+                   parser->netloc, strlen(parser->netloc),
+                   parser->query, strlen(parser->query),
+                   parser->fragment, strlen(parser->fragment));
+    talloc_free(result->value);
+    result->value = talloc_strdup(result, self->value);
+  } else {
+    CALL(result, set, self->value);
+  };
 
   return result;
 };
@@ -495,33 +497,55 @@ static int RDFURN_parse(RDFValue self, char *serialised, RDFURN subject) {
 // ourselves. If filename is an absolute URL we replace ourselve with
 // it.
 static void RDFURN_add(RDFURN self,  char *filename) {
-  URLParse parser = CONSTRUCT(URLParse, URLParse, Con, self, filename);
+  URLParse parser;
+
+  if(!check_mutable(self)) return;
+
+  // A plain relative path (which can not have a scheme or fragment)
+  // is appended to our value and query directly - this is the common
+  // case when building URNs in loops.
+  if(self->parser->buffer && !*self->parser->fragment &&
+     !strpbrk(filename, ":#")) {
+    int length = strlen(filename);
+    int value_length = strlen(self->value);
+
+    self->value = talloc_realloc(self, self->value, char,
+                                 value_length + length + 2);
+    value_length = collapse_path(self->value, value_length,
+                                 root_length(self->parser), filename, length);
+    self->value[value_length] = 0;
+
+    CALL(self->parser, append, filename, length);
+    return;
+  };
+
+  parser = CONSTRUCT(URLParse, URLParse, Con, self, filename);
 
   // Absolute URL
   if(strlen(parser->scheme)>0) {
     talloc_free(self->parser);
-    talloc_free(self->value);
-
     self->parser = parser;
-    self->value = CALL(parser, string, self);
   } else {
-    char *seperator = "/";
+    URLParse this = self->parser;
+    char *query, *fragment;
 
-    if(strlen(self->parser->query)==0) seperator="";
+    if(!this->buffer)
+      CALL(this, parse, NULL);
+
+    query = talloc_asprintf(parser, "%s%s%s", this->query,
+                                  *this->query ? "/" : "", parser->query);
+    fragment = talloc_asprintf(parser, "%s%s", this->fragment,
+                                     parser->fragment);
 
     // Relative URL
-    self->parser->query = talloc_asprintf(self, "%s%s%s",
-					  self->parser->query,
-					  seperator,
-					  parser->query);
-
-    self->parser->fragment = talloc_asprintf(self, "%s%s",
-                                             self->parser->fragment,
-                                             parser->fragment);
-    talloc_free(self->value);
-    self->value = CALL(self->parser, string, self);
+    set_components(this, this->scheme, strlen(this->scheme),
+                   this->netloc, strlen(this->netloc),
+                   query, strlen(query), fragment, strlen(fragment));
     talloc_free(parser);
   };
+
+  talloc_free(self->value);
+  self->value = CALL(self->parser, string, self);
 };
 
 /** This adds the binary buffer to the URL by escaping it
@@ -548,6 +572,58 @@ char *RDFURN_relative_name(RDFURN self, RDFURN volume) {
   return result;
 };
 
+/* The process wide table of interned URNs keyed by their value. */
+static Cache URN_Intern = NULL;
+
+static int interned_destructor(void *this) {
+  return -1;
+};
+
+DLL_PUBLIC RDFURN intern_urn(char *urn) {
+  RDFURN result, tmp;
+
+  AFF4_GL_LOCK;
+
+  if(!URN_Intern) {
+    URN_Intern = CONSTRUCT(Cache, Cache, Con, NULL, HASH_TABLE_SIZE, 0);
+    talloc_set_name_const(URN_Intern, "Interned URNs");
+  };
+
+  // Most URNs are already normalised so try the string as given
+  // first.
+  result = (RDFURN)CALL(URN_Intern, borrow, ZSTRING(urn));
+  if(result) goto exit;
+
+  tmp = new_RDFURN(NULL);
+  CALL(tmp, set, urn);
+
+  result = (RDFURN)CALL(URN_Intern, borrow, ZSTRING(tmp->value));
+  if(result) {
+    talloc_free(tmp);
+    goto exit;
+  };
+
+  // Parse the normalised value so the components match it (copy()
+  // relies on this).
+  CALL(tmp, set, tmp->value);
+  tmp->interned = 1;
+  talloc_set_destructor((void *)tmp, interned_destructor);
+
+  CALL(URN_Intern, put, ZSTRING(tmp->value), (Object)tmp);
+  result = tmp;
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static RDFURN RDFURN_intern(RDFURN self) {
+  if(self->interned)
+    return self;
+
+  return intern_urn(self->value);
+};
+
 VIRTUAL(RDFURN, RDFValue) {
    VATTR(super.raptor_type) = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
    VATTR(super.dataType) = DATATYPE_RDF_URN;
@@ -565,6 +641,7 @@ VIRTUAL(RDFURN, RDFValue) {
    VMETHOD(add_query) = RDFURN_add_query;
    VMETHOD(copy) = RDFURN_copy;
    VMETHOD(relative_name) = RDFURN_relative_name;
+   VMETHOD(intern) = RDFURN_intern;
 } END_VIRTUAL
 
 
@@ -869,12 +946,52 @@ AFF4_MODULE_INIT(A000_rdf) {
 };
 
 /** RDF parsing */
+
+/* Make the subject current, and make sure the volume contains it. */
+static void add_member(RDFParser self, char *subject) {
+  CALL(self->urn, set, subject);
+
+  if(strcmp(self->volume_urn->value, subject) &&
+     !CALL(self->member_cache, present, ZSTRING(subject))) {
+    CALL(self->resolver, batch_add, self->volume_urn, AFF4_VOLATILE_CONTAINS,
+         (RDFValue)self->urn);
+
+    CALL(self->member_cache, put, ZSTRING(subject), NULL);
+  };
+};
+
+/* Add a single parsed triple to the resolver's batch. type is the
+   literal's datatype (or NULL), resource is set when the object is a
+   URI.
+*/
+static void add_triple(RDFParser self, char *subject, char *attribute,
+                       char *value_str, char *type, int resource) {
+  RDFValue class_ref = (RDFValue)GETCLASS(XSDString);
+  RDFValue result;
+
+  // Consecutive triples mostly share their subject.
+  if(strcmp(self->urn->value, subject))
+    add_member(self, subject);
+
+  if(resource) {
+    class_ref = (RDFValue)GETCLASS(RDFURN);
+  } else if(type) {
+    class_ref = (RDFValue)CALL(RDF_Registry, borrow, ZSTRING(type));
+    if(!class_ref) return;
+  };
+
+  result = CONSTRUCT_FROM_REFERENCE(class_ref, Con, NULL);
+  if(result) {
+    CALL(result, parse, value_str, self->urn);
+    CALL(self->resolver, batch_add, self->urn, attribute, (RDFValue)result);
+    talloc_free(result);
+  };
+};
+
 static void triples_handler(void *data, const raptor_statement* triple) 
 {
   RDFParser self = (RDFParser)data;
   char *urn_str, *attribute, *value_str, *type_str;
-  RDFValue class_ref = (RDFValue)GETCLASS(XSDString);
-  RDFValue result = NULL;
 
   // Ignore anonymous and invalid triples.
   if(triple->subject_type != RAPTOR_IDENTIFIER_TYPE_RESOURCE ||
@@ -885,36 +1002,799 @@ static void triples_handler(void *data, const raptor_statement* triple)
   urn_str = (char *)raptor_uri_as_string((raptor_uri *)triple->subject);
   attribute = (char *)raptor_uri_as_string((raptor_uri *)triple->predicate);
   value_str = (char *)raptor_uri_as_string((raptor_uri *)triple->object);
-  type_str = (char *)raptor_uri_as_string((raptor_uri *)triple->object_literal_datatype);
+  type_str = triple->object_literal_datatype ?
+    (char *)raptor_uri_as_string((raptor_uri *)triple->object_literal_datatype) : NULL;
 
-  CALL(self->urn, set, urn_str);
+  add_triple(self, urn_str, attribute, value_str, type_str,
+             triple->object_type == RAPTOR_IDENTIFIER_TYPE_RESOURCE);
+}
 
-  if(strcmp(self->volume_urn->value, urn_str)) {
-    if(!CALL(self->member_cache, present, ZSTRING(urn_str))) {
-      // Make sure the volume contains this object
-      printf("!!! %s contains %s\n", self->volume_urn->value, urn_str);
+/** A native parser for the Turtle and N-Triples which AFF4 writes.
 
-      CALL(self->resolver, add, self->volume_urn, AFF4_VOLATILE_CONTAINS,
-           (RDFValue)self->urn);
+    The whole document is read into memory and tokenised in place -
+    IRIs and literals are terminated and unescaped inside the buffer
+    so most terms are never copied. Prefixed names and relative IRIs
+    are expanded once into the parse context.
+
+    Anything outside the subset (blank nodes, collections, long or
+    \u escaped strings, non-integer numbers) makes us give up, and
+    the caller falls back to raptor. Triples are only added to the
+    resolver once the whole document parsed, so giving up never
+    leaves partial results behind.
+*/
+struct native_triple_t {
+  char *subject;
+  char *predicate;
+  char *object;
+  char *type;
+  int resource;
+};
+
+struct native_parser_t {
+  void *ctx;
+  char *p;
+  char *end;
+  char *base;
+
+  /* Prefix name -> namespace, and prefixed name -> expanded IRI. */
+  Cache prefixes;
+  Cache names;
+
+  struct native_triple_t *triples;
+  int count;
+  int size;
+};
+
+static void native_skip(struct native_parser_t *self) {
+  while(self->p < self->end) {
+    switch(*self->p) {
+    case ' ': case '\t': case '\r': case '\n':
+      self->p++;
+      break;
 
-      CALL(self->member_cache, put, ZSTRING(urn_str), NULL);
+    case '#':
+      while(self->p < self->end && *self->p != '\n')
+        self->p++;
+      break;
+
+    default:
+      return;
     };
   };
+};
 
-  if(triple->object_type == RAPTOR_IDENTIFIER_TYPE_RESOURCE) {
-    class_ref = (RDFValue)GETCLASS(RDFURN);
-  } else if(triple->object_literal_datatype) {
-    class_ref = (RDFValue)CALL(RDF_Registry, borrow,
-                               ZSTRING(type_str));
+static int native_expect(struct native_parser_t *self, char c) {
+  native_skip(self);
+  if(self->p >= self->end || *self->p != c)
+    return 0;
+
+  self->p++;
+  return 1;
+};
+
+/* Resolve a relative IRI against the base (RFC 3986 section 5.2,
+   without dot segments which AFF4 never writes).
+*/
+static char *native_resolve(struct native_parser_t *self, char *iri) {
+  char *i, *base = self->base, *authority, *path;
+
+  // Absolute IRIs start with a scheme.
+  for(i=iri; isalnum(*i) || *i == '+' || *i == '-' || *i == '.'; i++);
+  if(*i == ':' && i > iri && isalpha(*iri))
+    return iri;
+
+  if(!base || strstr(iri, "./"))
+    return NULL;
+
+  if(!*iri)
+    return base;
+
+  authority = strstr(base, "://");
+  if(!authority) return NULL;
+  authority += 3;
+  path = authority + strcspn(authority, "/?#");
+
+  switch(*iri) {
+  case '#':
+    return talloc_asprintf(self->ctx, "%.*s%s",
+                           (int)strcspn(base, "#"), base, iri);
+
+  case '?':
+    return talloc_asprintf(self->ctx, "%.*s%s",
+                           (int)strcspn(base, "?#"), base, iri);
+
+  case '/':
+    if(iri[1] == '/')
+      return talloc_asprintf(self->ctx, "%.*s%s",
+                             (int)(authority - base - 2), base, iri);
+
+    return talloc_asprintf(self->ctx, "%.*s%s", (int)(path - base), base, iri);
+
+  default: {
+    // Merge with everything up to the last / of the base's path.
+    char *last = path;
+
+    for(i=path; *i && *i != '?' && *i != '#'; i++)
+      if(*i == '/') last = i + 1;
+
+    if(last == path)
+      return talloc_asprintf(self->ctx, "%.*s/%s", (int)(path - base), base, iri);
+
+    return talloc_asprintf(self->ctx, "%.*s%s", (int)(last - base), base, iri);
+  };
   };
+};
 
-  result = CONSTRUCT_FROM_REFERENCE(class_ref, Con, NULL);
-  if(result) {
-    CALL(result, parse, value_str, self->urn);
-    CALL(self->resolver, add, self->urn, attribute, (RDFValue)result);
-    talloc_free(result);
+/* <iri> - terminated in place. */
+static char *native_iri(struct native_parser_t *self) {
+  char *start = ++self->p;
+
+  while(self->p < self->end && *self->p != '>') {
+    if(*self->p == '\\' || *self->p == '\n') return NULL;
+    self->p++;
   };
-}
+
+  if(self->p >= self->end) return NULL;
+
+  *self->p++ = 0;
+  return native_resolve(self, start);
+};
+
+static int is_name_char(char c) {
+  return isalnum(c) || c == '_' || c == '-' || c == '.' || c == '%';
+};
+
+/* prefix:local - expanded once and then shared. */
+static char *native_pname(struct native_parser_t *self) {
+  char *start = self->p, *colon, *result, *namespace;
+
+  while(self->p < self->end && is_name_char(*self->p) && *self->p != '.')
+    self->p++;
+
+  if(self->p >= self->end || *self->p != ':') return NULL;
+  colon = self->p++;
+
+  while(self->p < self->end && is_name_char(*self->p))
+    self->p++;
+
+  // A trailing . ends the statement.
+  while(self->p > colon + 1 && self->p[-1] == '.')
+    self->p--;
+
+  result = (char *)CALL(self->names, borrow, start, self->p - start);
+  if(result) return result;
+
+  namespace = (char *)CALL(self->prefixes, borrow, start, colon - start);
+  if(!namespace) return NULL;
+
+  result = talloc_asprintf(self->ctx, "%s%.*s", namespace,
+                           (int)(self->p - colon - 1), colon + 1);
+  CALL(self->names, put, start, self->p - start, (Object)result);
+
+  return result;
+};
+
+/* "literal" - unescaped and terminated in place. */
+static char *native_literal(struct native_parser_t *self) {
+  char *start, *out;
+
+  // Long strings are left to raptor.
+  if(self->end - self->p >= 3 && !memcmp(self->p, "\"\"\"", 3))
+    return NULL;
+
+  start = out = ++self->p;
+  while(self->p < self->end && *self->p != '"') {
+    char c = *self->p++;
+
+    if(c == '\n') return NULL;
+
+    if(c == '\\') {
+      if(self->p >= self->end) return NULL;
+
+      switch(*self->p++) {
+      case 't': c = '\t'; break;
+      case 'b': c = '\b'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 'f': c = '\f'; break;
+      case '"': c = '"'; break;
+      case '\'': c = '\''; break;
+      case '\\': c = '\\'; break;
+      default:
+        return NULL;
+      };
+    };
+
+    *out++ = c;
+  };
+
+  if(self->p >= self->end) return NULL;
+
+  self->p++;
+  *out = 0;
+
+  return start;
+};
+
+static char *native_term(struct native_parser_t *self) {
+  native_skip(self);
+  if(self->p >= self->end) return NULL;
+
+  if(*self->p == '<')
+    return native_iri(self);
+
+  return native_pname(self);
+};
+
+static int native_object(struct native_parser_t *self,
+                         struct native_triple_t *triple) {
+  native_skip(self);
+  if(self->p >= self->end) return 0;
+
+  triple->type = NULL;
+  triple->resource = 0;
+
+  switch(*self->p) {
+  case '"':
+    triple->object = native_literal(self);
+    if(!triple->object) return 0;
+
+    if(self->end - self->p >= 2 && !memcmp(self->p, "^^", 2)) {
+      self->p += 2;
+      triple->type = native_term(self);
+      if(!triple->type) return 0;
+
+    } else if(self->p < self->end && *self->p == '@') {
+      // Language tags are dropped like raptor does for us.
+      self->p++;
+      while(self->p < self->end && (isalnum(*self->p) || *self->p == '-'))
+        self->p++;
+    };
+    return 1;
+
+  case '_': case '[': case '(':
+    return 0;
+
+  case '+': case '-': case '0': case '1': case '2': case '3': case '4':
+  case '5': case '6': case '7': case '8': case '9': {
+    char *start = self->p++;
+
+    while(self->p < self->end && isdigit(*self->p))
+      self->p++;
+
+    // Only integers - a . here ends the statement.
+    if(self->p < self->end && (*self->p == 'e' || *self->p == 'E' ||
+       (*self->p == '.' && self->p + 1 < self->end && isdigit(self->p[1]))))
+      return 0;
+
+    triple->object = talloc_strndup(self->ctx, start, self->p - start);
+    triple->type = DATATYPE_XSD_INTEGER;
+    return 1;
+  };
+
+  default:
+    triple->object = native_term(self);
+    triple->resource = 1;
+    return triple->object != NULL;
+  };
+};
+
+static int native_directive(struct native_parser_t *self) {
+  char *start = ++self->p;
+
+  while(self->p < self->end && isalpha(*self->p))
+    self->p++;
+
+  if(self->p - start == 6 && !memcmp(start, "prefix", 6)) {
+    char *name, *iri;
+    int length;
+
+    native_skip(self);
+    name = self->p;
+    while(self->p < self->end && is_name_char(*self->p))
+      self->p++;
+
+    length = self->p - name;
+    if(!native_expect(self, ':') || !native_expect(self, '<'))
+      return 0;
+
+    self->p--;
+    iri = native_iri(self);
+    if(!iri) return 0;
+
+    // The cache steals its data so it can not point into the buffer.
+    CALL(self->prefixes, put, name, length,
+         (Object)talloc_strdup(self->ctx, iri));
+
+  } else if(self->p - start == 4 && !memcmp(start, "base", 4)) {
+    if(!native_expect(self, '<')) return 0;
+
+    self->p--;
+    self->base = native_iri(self);
+    if(!self->base) return 0;
+
+  } else {
+    return 0;
+  };
+
+  return native_expect(self, '.');
+};
+
+static int native_statement(struct native_parser_t *self) {
+  struct native_triple_t triple;
+
+  triple.subject = native_term(self);
+  if(!triple.subject) return 0;
+
+  while(1) {
+    native_skip(self);
+    if(self->end - self->p > 1 && self->p[0] == 'a' && isspace(self->p[1])) {
+      self->p++;
+      triple.predicate = AFF4_TYPE;
+    } else {
+      triple.predicate = native_term(self);
+      if(!triple.predicate) return 0;
+    };
+
+    do {
+      if(!native_object(self, &triple)) return 0;
+
+      if(self->count >= self->size) {
+        self->size = self->size * 2 + 64;
+        self->triples = talloc_realloc(self->ctx, self->triples,
+                                       struct native_triple_t, self->size);
+      };
+
+      self->triples[self->count++] = triple;
+    } while(native_expect(self, ','));
+
+    if(!native_expect(self, ';')) break;
+
+    // Repeated and trailing ; are allowed.
+    while(native_expect(self, ';'));
+    native_skip(self);
+    if(self->p < self->end && *self->p == '.') break;
+  };
+
+  return native_expect(self, '.');
+};
+
+/* Returns 1 if the whole document was in our subset. */
+static int parse_native(RDFParser self, char *data, int length, char *base) {
+  struct native_parser_t parser;
+  int i, result = 0;
+
+  memset(&parser, 0, sizeof(parser));
+  parser.ctx = talloc_size(NULL, 0);
+  parser.p = data;
+  parser.end = data + length;
+  parser.base = base;
+  parser.prefixes = CONSTRUCT(Cache, Cache, Con, parser.ctx, 16, 0);
+  parser.names = CONSTRUCT(Cache, Cache, Con, parser.ctx, 64, 0);
+
+  while(1) {
+    native_skip(&parser);
+    if(parser.p >= parser.end) break;
+
+    if(*parser.p == '@') {
+      if(!native_directive(&parser)) goto exit;
+    } else if(!native_statement(&parser)) {
+      goto exit;
+    };
+  };
+
+  for(i=0; i<parser.count; i++) {
+    struct native_triple_t *triple = &parser.triples[i];
+
+    add_triple(self, triple->subject, triple->predicate, triple->object,
+               triple->type, triple->resource);
+  };
+
+  result = 1;
+
+ exit:
+  talloc_free(parser.ctx);
+  return result;
+};
+
+/* The binary format written by RDFBinarySerializer. Strings are kept
+   as spans of the data and only copied when they are needed.
+*/
+struct binary_string_t {
+  char *data;
+  int length;
+
+  // If the type is an integer - -1 until the string is used as a type.
+  int integer;
+
+  // A null terminated copy, made the first time it is needed.
+  char *value;
+};
+
+struct binary_parser_t {
+  void *ctx;
+  char *p;
+  char *end;
+
+  struct binary_string_t *strings;
+  uint64_t string_count;
+
+  /* The number of strings in strings. This is more than string_count
+     when we decode a part of the graph again.
+  */
+  uint64_t strings_defined;
+};
+
+struct binary_record_t {
+  uint64_t subject;
+  uint64_t attribute;
+  uint64_t type;
+
+  char *value;
+  uint64_t value_length;
+  uint64_t integer;
+};
+
+static int binary_varint(struct binary_parser_t *self, uint64_t *result) {
+  int shift;
+
+  *result = 0;
+  for(shift=0; self->p < self->end && shift < 64; shift += 7) {
+    unsigned char byte = *self->p++;
+
+    *result |= (uint64_t)(byte & 0x7f) << shift;
+    if(!(byte & 0x80))
+      return 1;
+  };
+
+  return 0;
+};
+
+/* Read a string reference, defining a new string if needed. */
+static int binary_string(struct binary_parser_t *self, uint64_t *index) {
+  struct binary_string_t *string;
+  uint64_t id, length;
+
+  if(!binary_varint(self, &id))
+    return 0;
+
+  if(id > 0) {
+    *index = id - 1;
+    return id <= self->string_count;
+  };
+
+  if(!binary_varint(self, &length) || length > self->end - self->p)
+    return 0;
+
+  // We already know this string from an earlier pass.
+  if(self->string_count < self->strings_defined)
+    goto exit;
+
+  if(self->strings_defined % 64 == 0) {
+    self->strings = talloc_realloc(self->ctx, self->strings, struct binary_string_t,
+                                   self->strings_defined + 64);
+  };
+
+  string = &self->strings[self->strings_defined++];
+  string->data = self->p;
+  string->length = length;
+  string->integer = -1;
+  string->value = NULL;
+
+ exit:
+  self->p += length;
+  *index = self->string_count++;
+
+  return 1;
+};
+
+/* XSDInteger and its subclasses are written as varints, so the
+   graph does not depend on the host's byte order.
+*/
+static int binary_integer_type(char *type) {
+  RDFValue class_ref = (RDFValue)CALL(RDF_Registry, borrow, ZSTRING(type));
+
+  return class_ref && ISSUBCLASS(class_ref, XSDInteger);
+};
+
+static char *binary_value(struct binary_parser_t *self, uint64_t index) {
+  struct binary_string_t *string = &self->strings[index];
+
+  if(!string->value)
+    string->value = talloc_strndup(self->ctx, string->data, string->length);
+
+  return string->value;
+};
+
+/* Read the next record. Integers are decoded into the record. */
+static int binary_record(struct binary_parser_t *self,
+                         struct binary_record_t *record) {
+  struct binary_string_t *type;
+
+  if(!binary_string(self, &record->subject) ||
+     !binary_string(self, &record->attribute) ||
+     !binary_string(self, &record->type))
+    return 0;
+
+  type = &self->strings[record->type];
+  if(type->integer < 0)
+    type->integer = binary_integer_type(binary_value(self, record->type));
+
+  if(type->integer) {
+    if(!binary_varint(self, &record->integer))
+      return 0;
+
+    record->value = (char *)&record->integer;
+    record->value_length = sizeof(record->integer);
+  } else {
+    if(!binary_varint(self, &record->value_length) ||
+       record->value_length > self->end - self->p)
+      return 0;
+
+    record->value = self->p;
+    self->p += record->value_length;
+  };
+
+  return 1;
+};
+
+static int binary_magic(struct binary_parser_t *self) {
+  if(self->end - self->p < strlen(RDF_BINARY_MAGIC) ||
+     memcmp(self->p, ZSTRING_NO_NULL(RDF_BINARY_MAGIC))) {
+    RaiseError(ERuntimeError, "Not a binary RDF graph");
+    return 0;
+  };
+
+  self->p += strlen(RDF_BINARY_MAGIC);
+  return 1;
+};
+
+/* Decode the records up to the parser's end into the store. If
+   parser is set the subjects are added to its volume. Nothing is added
+   unless all the records decode.
+*/
+static int binary_load(struct binary_parser_t *self, Resolver resolver,
+                       RDFParser parser) {
+  void *ctx = talloc_size(NULL, 0);
+  struct datastore_triple_t *triples = NULL;
+  struct binary_record_t record;
+  int i, count = 0, result = 0;
+
+  while(self->p < self->end) {
+    if(!binary_record(self, &record))
+      goto exit;
+
+    if(count % 256 == 0) {
+      triples = talloc_realloc(ctx, triples, struct datastore_triple_t,
+                               count + 256);
+    };
+
+    triples[count].uri = binary_value(self, record.subject);
+    triples[count].attribute = binary_value(self, record.attribute);
+    triples[count].value = CONSTRUCT(DataStoreObject, DataStoreObject, Con,
+                                     ctx, record.value, record.value_length,
+                                     binary_value(self, record.type));
+    count++;
+  };
+
+  // Subject strings are shared so comparing pointers is enough.
+  for(i=0; parser && i<count; i++) {
+    if(i == 0 || triples[i].uri != triples[i-1].uri)
+      add_member(parser, triples[i].uri);
+  };
+
+  CALL(resolver, flush_batch);
+  CALL(resolver->store, add_batch, triples, count);
+  result = 1;
+
+ exit:
+  talloc_free(ctx);
+  return result;
+};
+
+/* The values are already in the DataStore's encoding so they go
+   straight into the store.
+*/
+static int parse_binary(RDFParser self, char *data, int length) {
+  struct binary_parser_t parser;
+  int result = 0;
+
+  memset(&parser, 0, sizeof(parser));
+  parser.ctx = talloc_size(NULL, 0);
+  parser.p = data;
+  parser.end = data + length;
+
+  if(!binary_magic(&parser))
+    goto exit;
+
+  result = binary_load(&parser, self->resolver, self);
+  if(!result) {
+    RaiseError(ERuntimeError, "Binary RDF graph is corrupted at offset %u",
+               (unsigned int)(parser.p - data));
+  };
+
+ exit:
+  talloc_free(parser.ctx);
+  return result;
+};
+
+/* The records of one subject in a BinaryGraph. */
+struct binary_range_t {
+  int start;
+  int end;
+
+  // The number of strings defined before start.
+  uint64_t string_count;
+};
+
+static void add_range(BinaryGraph self, struct binary_range_t *range,
+                      uint64_t subject) {
+  struct binary_string_t *string = &self->parser->strings[subject];
+
+  if(!CALL(self->ranges, present, string->data, string->length)) {
+    if(self->subject_count % 256 == 0) {
+      self->subjects = talloc_realloc(self, self->subjects, uint64_t,
+                                      self->subject_count + 256);
+    };
+
+    self->subjects[self->subject_count++] = subject;
+  };
+
+  CALL(self->ranges, put, string->data, string->length, (Object)range);
+  talloc_unlink(NULL, range);
+  ((DeferredGraph)self)->pending++;
+};
+
+static BinaryGraph BinaryGraph_Con(BinaryGraph self, char *data, int length,
+                                   char *volume) {
+  struct binary_parser_t *parser;
+  struct binary_range_t *range = NULL;
+  struct binary_record_t record;
+  uint64_t subject = 0;
+
+  self->data = talloc_steal(self, data);
+  self->volume = talloc_strdup(self, volume);
+  self->ranges = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE, 0);
+
+  // One more load for the volume's contains triples.
+  ((DeferredGraph)self)->pending = 1;
+
+  parser = self->parser = talloc_zero(self, struct binary_parser_t);
+  parser->ctx = parser;
+  parser->p = data;
+  parser->end = data + length;
+
+  if(!binary_magic(parser))
+    goto error;
+
+  /* Find the runs of records with the same subject - the serializer
+     writes each subject in one go. */
+  while(parser->p < parser->end) {
+    int start = parser->p - data;
+    uint64_t string_count = parser->string_count;
+
+    if(!binary_record(parser, &record)) {
+      RaiseError(ERuntimeError, "Binary RDF graph is corrupted at offset %u",
+                 (unsigned int)(parser->p - data));
+      goto error;
+    };
+
+    if(!range || record.subject != subject) {
+      if(range)
+        add_range(self, range, subject);
+
+      range = talloc(NULL, struct binary_range_t);
+      range->start = start;
+      range->string_count = string_count;
+      subject = record.subject;
+    };
+
+    range->end = parser->p - data;
+  };
+
+  if(range)
+    add_range(self, range, subject);
+
+  return self;
+
+ error:
+  talloc_free(range);
+  talloc_free(self);
+  return NULL;
+};
+
+/* The volume contains everything in its graph. */
+static void load_contains(BinaryGraph self, Resolver resolver) {
+  void *ctx = talloc_size(NULL, 0);
+  struct datastore_triple_t *triples = talloc_array(ctx, struct datastore_triple_t,
+                                                    self->subject_count);
+  int i, count = 0;
+
+  for(i=0; i<self->subject_count; i++) {
+    char *subject = binary_value(self->parser, self->subjects[i]);
+
+    if(!strcmp(subject, self->volume))
+      continue;
+
+    triples[count].uri = self->volume;
+    triples[count].attribute = AFF4_VOLATILE_CONTAINS;
+    triples[count].value = CONSTRUCT(DataStoreObject, DataStoreObject, Con,
+                                     ctx, ZSTRING(subject), DATATYPE_RDF_URN);
+    count++;
+  };
+
+  CALL(resolver, flush_batch);
+  CALL(resolver->store, add_batch, triples, count);
+
+  talloc_free(ctx);
+  self->contains_loaded = 1;
+  ((DeferredGraph)self)->pending--;
+};
+
+static int BinaryGraph_load(DeferredGraph this, Resolver resolver, char *subject) {
+  BinaryGraph self = (BinaryGraph)this;
+  struct binary_parser_t *parser = self->parser;
+  struct binary_range_t *range;
+  int result = 0;
+
+  if(!self->contains_loaded && !strcmp(subject, self->volume)) {
+    load_contains(self, resolver);
+    result = 1;
+  };
+
+  while(CALL(self->ranges, present, ZSTRING_NO_NULL(subject))) {
+    range = (struct binary_range_t *)CALL(self->ranges, get, NULL,
+                                          ZSTRING_NO_NULL(subject));
+    parser->p = self->data + range->start;
+    parser->end = self->data + range->end;
+    parser->string_count = range->string_count;
+
+    // The graph was checked when we indexed it.
+    binary_load(parser, resolver, NULL);
+
+    talloc_free(range);
+    this->pending--;
+    result = 1;
+  };
+
+  return result;
+};
+
+static void BinaryGraph_load_all(DeferredGraph this, Resolver resolver) {
+  BinaryGraph self = (BinaryGraph)this;
+  int i;
+
+  if(!self->contains_loaded)
+    load_contains(self, resolver);
+
+  for(i=0; i<self->subject_count && this->pending > 0; i++) {
+    BinaryGraph_load(this, resolver, binary_value(self->parser, self->subjects[i]));
+  };
+};
+
+VIRTUAL(BinaryGraph, DeferredGraph) {
+  VMETHOD(Con) = BinaryGraph_Con;
+
+  VMETHOD_BASE(DeferredGraph, load) = BinaryGraph_load;
+  VMETHOD_BASE(DeferredGraph, load_all) = BinaryGraph_load_all;
+} END_VIRTUAL
+
+/* Read the rest of the fd into a new buffer. */
+static char *read_all(FileLikeObject fd, int *length) {
+  int size = BUFF_SIZE * 64, len;
+  char *data = talloc_size(NULL, size);
+
+  *length = 0;
+  while((len = CALL(fd, read, data + *length, size - *length)) > 0) {
+    *length += len;
+    if(*length == size) {
+      size *= 2;
+      data = talloc_realloc_size(NULL, data, size);
+    };
+  };
+
+  return data;
+};
 
 static void message_handler(void *data, raptor_locator* locator, 
 			    const char *message)
@@ -939,14 +1819,53 @@ static int RDFParser_parse(RDFParser self, FileLikeObject fd, char *format, char
   // Take a sensible default
   if(!format) format = "turtle";
 
+  CALL(self->volume_urn ,set , base);
+
+  if(!strcmp(format, RDF_BINARY_FORMAT)) {
+    int length, result;
+    char *data = read_all(fd, &length);
+
+    // In lazy mode we only index the graph now.
+    if(self->resolver->mode & RESOLVER_MODE_LAZY) {
+      BinaryGraph graph = CONSTRUCT(BinaryGraph, BinaryGraph, Con, NULL,
+                                    data, length, self->volume_urn->value);
+
+      if(!graph) return 0;
+
+      CALL(self->resolver, defer, (DeferredGraph)graph);
+      return 1;
+    };
+
+    result = parse_binary(self, data, length);
+    talloc_free(data);
+
+    return result;
+  };
+
+  /* Try our own parser first on the formats AFF4 writes. */
+  if(!strcmp(format, "turtle") || !strcmp(format, "ntriples")) {
+    uint64_t start = CALL(fd, tell);
+    int length, len;
+    char *data = read_all(fd, &length);
+
+    len = parse_native(self, data, length, base);
+    talloc_free(data);
+
+    if(len) {
+      CALL(self->resolver, flush_batch);
+      return 1;
+    };
+
+    // Not in our subset - start again with raptor.
+    CALL(fd, seek, start, SEEK_SET);
+  };
+
   rdf_parser = raptor_new_parser(format);
   if(!rdf_parser) {
     RaiseError(ERuntimeError, "Unable to create parser for RDF serialization %s", format);
     goto error;
   };
 
-  CALL(self->volume_urn ,set , base);
-
   // Dont talk to the internet
   raptor_set_feature(rdf_parser, RAPTOR_FEATURE_NO_NET, 1);
   raptor_set_statement_handler(rdf_parser, self, self->triples_handler);
@@ -981,13 +1900,16 @@ static int RDFParser_parse(RDFParser self, FileLikeObject fd, char *format, char
   // Done - flush the parser
   raptor_parse_chunk(rdf_parser, NULL, 0, 1); /* no data and is_end =
 						 1 */
-  // Cleanup
+  // Cleanup - the triples are queued up in the resolver.
+  CALL(self->resolver, flush_batch);
   if(uri)
     raptor_free_uri((raptor_uri *)uri);
   raptor_free_parser(rdf_parser);
   return 1;
 
  error:
+  // Keep whatever we managed to parse.
+  CALL(self->resolver, flush_batch);
   if(uri)
     raptor_free_uri((raptor_uri *)uri);
   raptor_free_parser(rdf_parser);
@@ -1017,7 +1939,7 @@ static int iostream_write_byte(void *context, const int byte) {
   self->buff[self->i] = (char)byte;
   self->i++;
 
-  if(self->i >= BUFF_SIZE) {
+  if(self->i >= RDF_SERIALIZER_BUFFER_SIZE) {
     CALL(self->fd, write, self->buff, self->i);
     self->i = 0;
   };
@@ -1031,10 +1953,10 @@ static int iostream_write_bytes(void *context, const void *ptr, size_t size, siz
   char *src = (char *)ptr;
   unsigned int available;
 
-  if(self->i > BUFF_SIZE) abort();
+  if(self->i > RDF_SERIALIZER_BUFFER_SIZE) abort();
 
   while(length > 0) {
-    available = min(length, BUFF_SIZE - self->i);
+    available = min(length, RDF_SERIALIZER_BUFFER_SIZE - self->i);
     if(available <= 0) {
       CALL(self->fd, write, self->buff, self->i);
       self->i = 0;
@@ -1116,69 +2038,108 @@ static void RDFSerializer_set_namespace(RDFSerializer self, char *prefix, char *
   raptor_free_uri(uri);
 };
 
+/* Serialise a single value of the attribute. */
+static void serialize_value(RDFSerializer self, raptor_statement *triple,
+                            RDFURN urn, char *attribute, RDFValue value) {
+  triple->object = CALL(value, serialise, value, urn);
+  if(!triple->object) {
+    AFF4_LOG(AFF4_LOG_MESSAGE, AFF4_SERVICE_RDF_SUBSYSYEM,
+             urn,
+             "Unable to serialise attribute %s\n",
+             attribute);
+    return;
+  };
+
+  triple->object_type = value->raptor_type;
+
+  // Default to something sensible
+  if(RAPTOR_IDENTIFIER_TYPE_UNKNOWN == triple->object_type)
+    triple->object_type = RAPTOR_IDENTIFIER_TYPE_LITERAL;
+
+  // If the dataType is emptry just have a NULL
+  // object_literal_datatype:
+  triple->object_literal_datatype = value->dataType[0] ?                \
+    raptor_new_uri((const unsigned char*)value->dataType) : 0;
+
+  raptor_serialize_statement(self->rdf_serializer, triple);
+  if(triple->object_literal_datatype)
+    raptor_free_uri((raptor_uri*)triple->object_literal_datatype);
+
+  // Special free function for URIs
+  if(triple->object_type == RAPTOR_IDENTIFIER_TYPE_RESOURCE) {
+    raptor_free_uri((raptor_uri*)triple->object);
+  };
+};
+
+/* We only visit the attributes the store actually has for the urn,
+   and decode each value into a single scratch context which is
+   cleared after every attribute.
+*/
 static int RDFSerializer_serialize_urn(RDFSerializer self, RDFURN urn) {
   raptor_statement triple;
-  void *raptor_urn;
-  RDFValue value = NULL;
-  Cache i;
+  DataStore store = self->resolver->store;
+  char *ctx;
+  char *attribute;
+  Object attributes;
+
+  AFF4_GL_LOCK;
+  // We use the store directly so the urn must be loaded first.
+  CALL(self->resolver, load_deferred, urn->value);
+  CALL(self->resolver, flush_batch);
+  CALL(store, lock);
+
+  attributes = CALL(store, iter_attributes, urn->value);
+  if(!attributes) {
+    CALL(store, unlock);
+    AFF4_GL_UNLOCK;
+    return 0;
+  };
 
-  printf(".");
-  fflush(stdout);
+  ctx = talloc_size(NULL, 0);
 
-  raptor_urn = (void*)raptor_new_uri((const unsigned char*)urn->value);
   memset(&triple, 0, sizeof(triple));
+  triple.subject = (void*)raptor_new_uri((const unsigned char*)urn->value);
+  triple.subject_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
+  triple.predicate_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
 
-  /* List all known attributes and serialize them */
-  list_for_each_entry(i, &RDF_Registry->cache_list, cache_list) {
-    RDFValue classref = *(RDFValue *)i->data;
-    char *ctx = talloc_strdup(NULL, "ctx");
-    char *attribute = classref->dataType;
-
-    value = CALL(self->resolver, resolve, ctx, urn, attribute);
-    if(value) {
-      RDFValue i;
-
-      list_for_each_entry(i, &value->list, list) {
-        triple.object = CALL(value, serialise, value, urn);
-        if(!triple.object) {
-          AFF4_LOG(AFF4_LOG_MESSAGE, AFF4_SERVICE_RDF_SUBSYSYEM,
-                   urn,
-                   "Unable to serialise attribute %s\n",
-                   attribute);
-        } else {
-          triple.subject = raptor_urn;
-          triple.subject_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
-
-          triple.predicate = (void*)raptor_new_uri((const unsigned char*)attribute);
-          triple.predicate_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
-          triple.object_type = value->raptor_type;
-
-          // Default to something sensible
-          if(RAPTOR_IDENTIFIER_TYPE_UNKNOWN == triple.object_type)
-            triple.object_type = RAPTOR_IDENTIFIER_TYPE_LITERAL;
-
-          // If the dataType is emptry just have a NULL
-          // object_literal_datatype:
-          triple.object_literal_datatype = value->dataType[0] ? \
-              raptor_new_uri((const unsigned char*)value->dataType) : 0;
-
-          raptor_serialize_statement(self->rdf_serializer, &triple);
-          raptor_free_uri((raptor_uri*)triple.predicate);
-          if(triple.object_literal_datatype)
-            raptor_free_uri((raptor_uri*)triple.object_literal_datatype);
-
-          // Special free function for URIs
-          if(triple.object_type == RAPTOR_IDENTIFIER_TYPE_RESOURCE) {
-            raptor_free_uri((raptor_uri*)triple.object);
-          };
-        };
-      };
+  while((attribute = CALL(store, next_attribute, &attributes))) {
+    Object iter;
+
+    // Volatile attributes are never written to the volume.
+    if(!strncmp(attribute, VOLATILE_NS, strlen(VOLATILE_NS)))
+      continue;
+
+    iter = CALL(store, iter, urn->value, attribute);
+    if(!iter) continue;
 
-      talloc_free(ctx);
+    triple.predicate = (void*)raptor_new_uri((const unsigned char*)attribute);
+
+    while(iter) {
+      DataStoreObject obj = CALL(store, next, &iter);
+      RDFValue class_ref, value;
+
+      if(!obj || !obj->rdf_type) continue;
+
+      class_ref = (RDFValue)CALL(RDF_Registry, borrow, ZSTRING(obj->rdf_type));
+      if(!class_ref) continue;
+
+      value = (RDFValue)CONSTRUCT_FROM_REFERENCE(class_ref, Con, ctx);
+      if(CALL(value, decode, obj, urn, self->resolver)) {
+        serialize_value(self, &triple, urn, attribute, value);
+      };
     };
+
+    raptor_free_uri((raptor_uri*)triple.predicate);
+
+    talloc_free(ctx);
+    ctx = talloc_size(NULL, 0);
   };
 
-  talloc_free(raptor_urn);
+  raptor_free_uri((raptor_uri*)triple.subject);
+  talloc_free(ctx);
+
+  CALL(store, unlock);
+  AFF4_GL_UNLOCK;
   return 1;
 };
 
@@ -1201,6 +2162,138 @@ VIRTUAL(RDFSerializer, Object) {
      VMETHOD(close) = RDFSerializer_close;
 } END_VIRTUAL
 
+/*** Binary RDF serialization - see aff4_rdf_serialise.h for the format */
+
+static void binary_write_varint(StringIO out, uint64_t value) {
+  unsigned char buffer[10];
+  int i = 0;
+
+  do {
+    buffer[i] = value & 0x7f;
+    value >>= 7;
+    if(value) buffer[i] |= 0x80;
+    i++;
+  } while(value);
+
+  CALL(out, write, (char *)buffer, i);
+};
+
+static void binary_write_string(RDFBinarySerializer self, char *string) {
+  XSDInteger id = (XSDInteger)CALL(self->strings, borrow, ZSTRING(string));
+  int length;
+
+  if(id) {
+    binary_write_varint(self->buffer, id->value);
+    return;
+  };
+
+  length = strlen(string);
+  binary_write_varint(self->buffer, 0);
+  binary_write_varint(self->buffer, length);
+  CALL(self->buffer, write, string, length);
+
+  id = new_XSDInteger(self->strings);
+  CALL(id, set, ++self->string_count);
+  CALL(self->strings, put, ZSTRING(string), (Object)id);
+};
+
+static RDFBinarySerializer RDFBinarySerializer_Con(RDFBinarySerializer self,
+                                                   FileLikeObject fd,
+                                                   Resolver resolver) {
+  if(!fd) {
+    RaiseError(EProgrammingError, "No file to serialise to");
+    goto error;
+  };
+
+  // Keep the fd alive while we write to it, as RDFSerializer does.
+  self->fd = fd;
+  (void)talloc_reference(self, fd);
+
+  self->resolver = resolver;
+  self->strings = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE, 0);
+  self->buffer = CONSTRUCT(StringIO, StringIO, Con, self);
+
+  CALL(self->buffer, write, ZSTRING_NO_NULL(RDF_BINARY_MAGIC));
+
+  return self;
+
+ error:
+  talloc_free(self);
+  return NULL;
+};
+
+static int RDFBinarySerializer_serialize_urn(RDFBinarySerializer self, RDFURN urn) {
+  DataStore store = self->resolver->store;
+  char *attribute;
+  Object attributes;
+
+  AFF4_GL_LOCK;
+  // We use the store directly so the urn must be loaded first.
+  CALL(self->resolver, load_deferred, urn->value);
+  CALL(self->resolver, flush_batch);
+  CALL(store, lock);
+
+  attributes = CALL(store, iter_attributes, urn->value);
+  if(!attributes) {
+    CALL(store, unlock);
+    AFF4_GL_UNLOCK;
+    return 0;
+  };
+
+  while((attribute = CALL(store, next_attribute, &attributes))) {
+    Object iter;
+
+    if(!strncmp(attribute, VOLATILE_NS, strlen(VOLATILE_NS)))
+      continue;
+
+    iter = CALL(store, iter, urn->value, attribute);
+    while(iter) {
+      DataStoreObject obj = CALL(store, next, &iter);
+      char *type;
+
+      if(!obj) continue;
+
+      type = obj->rdf_type ? obj->rdf_type : "";
+
+      binary_write_string(self, urn->value);
+      binary_write_string(self, attribute);
+      binary_write_string(self, type);
+
+      if(binary_integer_type(type)) {
+        uint64_t value = 0;
+
+        memcpy(&value, obj->data, min(obj->length, sizeof(value)));
+        binary_write_varint(self->buffer, value);
+      } else {
+        binary_write_varint(self->buffer, obj->length);
+        CALL(self->buffer, write, obj->data, obj->length);
+      };
+    };
+
+    if(self->buffer->size >= RDF_SERIALIZER_BUFFER_SIZE) {
+      CALL(self->fd, write, self->buffer->data, self->buffer->size);
+      CALL(self->buffer, truncate, 0);
+    };
+  };
+
+  CALL(store, unlock);
+  AFF4_GL_UNLOCK;
+  return 1;
+};
+
+static void RDFBinarySerializer_close(RDFBinarySerializer self) {
+  // Flush the buffer
+  CALL(self->fd, write, self->buffer->data, self->buffer->size);
+
+  talloc_free(self);
+};
+
+VIRTUAL(RDFBinarySerializer, Object) {
+     VMETHOD(Con) = RDFBinarySerializer_Con;
+     VMETHOD(serialize_urn) = RDFBinarySerializer_serialize_urn;
+     VMETHOD(close) = RDFBinarySerializer_close;
+} END_VIRTUAL
+
 
 /*** Convenience functions */
 RDFValue rdfvalue_from_int(void *ctx, uint64_t value) {
@@ -0,0 +1,266 @@
+/** This file implements the RescueReader - a ddrescue style reader
+    for acquiring damaged media.
+*/
+#include "aff4_internal.h"
+
+/* A contiguous region of the source. For rescued regions
+   target_offset is the offset in the rescued stream, bad regions
+   just use their own offset.
+*/
+struct rescue_region_t {
+  uint64_t offset;
+  uint64_t length;
+  uint64_t target_offset;
+
+  struct list_head list;
+};
+
+/* Insert a new region into the sorted list, merging it with its
+   predecessor if they are contiguous. Regions mostly arrive in
+   order, so we search from the end of the list.
+*/
+static void add_region(void *ctx, struct list_head *regions, uint64_t offset,
+                       uint64_t length, uint64_t target_offset) {
+  struct rescue_region_t *i, *region;
+
+  list_for_each_entry_prev(i, regions, list) {
+    if(i->offset < offset)
+      break;
+  };
+
+  /* i is now the region before us (or the list head). */
+  if(&i->list != regions && i->offset + i->length == offset &&
+     i->target_offset + i->length == target_offset) {
+    i->length += length;
+    return;
+  };
+
+  region = talloc(ctx, struct rescue_region_t);
+  region->offset = offset;
+  region->length = length;
+  region->target_offset = target_offset;
+
+  list_add(&region->list, &i->list);
+};
+
+static RescueReader RescueReader_Con(RescueReader self, FileLikeObject source,
+                                     unsigned int block_size,
+                                     unsigned int min_block_size) {
+  AFFObject backing = (AFFObject)source;
+
+  AFF4_GL_LOCK;
+
+  if(!source) {
+    RaiseError(EProgrammingError, "No source given.");
+    goto error;
+  };
+
+  SUPER(AFFObject, FileLikeObject, Con, backing->urn, 'r', backing->resolver);
+
+  if(min_block_size == 0)
+    min_block_size = 512;
+
+  if(block_size < min_block_size)
+    block_size = min_block_size;
+
+  self->source = source;
+  self->block_size = block_size;
+  self->min_block_size = min_block_size;
+  self->bad_bytes = 0;
+
+  INIT_LIST_HEAD(&self->bad_regions);
+  INIT_LIST_HEAD(&self->rescued_regions);
+
+  self->size = CALL(source, seek, 0, SEEK_END);
+  CALL(source, seek, 0, SEEK_SET);
+
+  ((FileLikeObject)self)->readptr = 0;
+  ((AFFObject)self)->complete = 1;
+
+  AFF4_GL_UNLOCK;
+  return self;
+
+ error:
+  talloc_free(self);
+  AFF4_GL_UNLOCK;
+  return NULL;
+};
+
+/* The first pass - read large blocks and skip over anything which
+   fails.
+*/
+static int RescueReader_read(FileLikeObject this, char *buffer, unsigned int length) {
+  RescueReader self = (RescueReader)this;
+  unsigned int offset = 0;
+
+  AFF4_GL_LOCK;
+  AFF4_OBJECT_LOCK(self);
+  AFF4_OBJECT_LOCK(self->source);
+
+  if(self->size > 0) {
+    if(this->readptr >= self->size) {
+      length = 0;
+    } else {
+      length = min(length, self->size - this->readptr);
+    };
+  };
+
+  while(offset < length) {
+    unsigned int want = min(length - offset, self->block_size);
+    int res;
+
+    CALL(self->source, seek, this->readptr, SEEK_SET);
+    res = CALL(self->source, read, buffer + offset, want);
+
+    // End of the source.
+    if(res == 0)
+      break;
+
+    if(res < 0) {
+      ClearError();
+
+      AFF4_LOG(AFF4_LOG_WARNING, AFF4_SERVICE_GENERIC, URNOF(self),
+               "Unable to read %u bytes at offset %llu - skipping",
+               want, (unsigned long long)this->readptr);
+
+      memset(buffer + offset, 0, want);
+      add_region(self, &self->bad_regions, this->readptr, want,
+                 this->readptr);
+      self->bad_bytes += want;
+      res = want;
+    };
+
+    offset += res;
+    this->readptr += res;
+  };
+
+  AFF4_OBJECT_UNLOCK(self->source);
+  AFF4_OBJECT_UNLOCK(self);
+  AFF4_GL_UNLOCK;
+  return offset;
+};
+
+static uint64_t RescueReader_retry(RescueReader self, FileLikeObject rescued) {
+  unsigned int block_size = self->block_size;
+  char *buffer;
+
+  AFF4_GL_LOCK;
+
+  buffer = talloc_size(NULL, self->block_size);
+
+  /* There is always at least one pass, even if the first pass
+     already used the smallest block size.
+  */
+  while(!list_empty(&self->bad_regions)) {
+    struct rescue_region_t *region, *tmp;
+    struct list_head still_bad;
+
+    block_size = max(block_size / 2, self->min_block_size);
+    INIT_LIST_HEAD(&still_bad);
+
+    list_for_each_entry_safe(region, tmp, &self->bad_regions, list) {
+      uint64_t offset = region->offset;
+      uint64_t end = region->offset + region->length;
+
+      list_del(&region->list);
+
+      while(offset < end) {
+        unsigned int length = min(block_size, end - offset);
+        int res;
+
+        CALL(self->source, seek, offset, SEEK_SET);
+        res = CALL(self->source, read, buffer, length);
+
+        if(res == length) {
+          uint64_t target_offset = CALL(rescued, tell);
+
+          CALL(rescued, write, buffer, length);
+          add_region(self, &self->rescued_regions, offset, length, target_offset);
+          self->bad_bytes -= length;
+        } else {
+          ClearError();
+          add_region(self, &still_bad, offset, length, offset);
+        };
+
+        offset += length;
+      };
+
+      talloc_free(region);
+    };
+
+    list_splice(&still_bad, &self->bad_regions);
+
+    if(block_size == self->min_block_size)
+      break;
+  };
+
+  talloc_free(buffer);
+
+  AFF4_GL_UNLOCK;
+  return self->bad_bytes;
+};
+
+static char *RescueReader_get_map(RescueReader self, void *ctx, RDFURN image,
+                                  RDFURN rescued) {
+  StringIO map;
+  char *result;
+  uint64_t offset = 0;
+  struct list_head *bad, *good;
+
+  AFF4_GL_LOCK;
+
+  map = CONSTRUCT(StringIO, StringIO, Con, NULL);
+
+  bad = self->bad_regions.next;
+  good = self->rescued_regions.next;
+
+  /* Merge the two sorted lists, filling the gaps from the image. */
+  while(bad != &self->bad_regions || good != &self->rescued_regions) {
+    struct rescue_region_t *region;
+    char *target;
+
+    if(good == &self->rescued_regions ||
+       (bad != &self->bad_regions &&
+        list_entry(bad, struct rescue_region_t, list)->offset <
+        list_entry(good, struct rescue_region_t, list)->offset)) {
+      region = list_entry(bad, struct rescue_region_t, list);
+      target = AFF4_SPECIAL_URN_ZERO;
+      bad = bad->next;
+    } else {
+      region = list_entry(good, struct rescue_region_t, list);
+      target = rescued ? rescued->value : AFF4_SPECIAL_URN_ZERO;
+      good = good->next;
+    };
+
+    if(region->offset > offset) {
+      CALL(map, sprintf, "%llu,%llu,%s\n", (unsigned long long)offset,
+           (unsigned long long)offset, image->value);
+    };
+
+    CALL(map, sprintf, "%llu,%llu,%s\n", (unsigned long long)region->offset,
+         (unsigned long long)region->target_offset, target);
+
+    offset = region->offset + region->length;
+  };
+
+  /* If we do not know the size the image carries on after the last
+     region. */
+  if(offset < self->size || self->size == 0) {
+    CALL(map, sprintf, "%llu,%llu,%s\n", (unsigned long long)offset,
+         (unsigned long long)offset, image->value);
+  };
+
+  result = talloc_strndup(ctx, map->data, map->size);
+  talloc_free(map);
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+VIRTUAL(RescueReader, FileLikeObject) {
+  VMETHOD(Con) = RescueReader_Con;
+  VMETHOD(retry) = RescueReader_retry;
+  VMETHOD(get_map) = RescueReader_get_map;
+
+  VMETHOD_BASE(FileLikeObject, read) = RescueReader_read;
+} END_VIRTUAL;
@@ -13,6 +13,33 @@ PRIVATE int Graph_add_value(RDFURN graph, RDFURN urn, char *attribute_str,
 
 #define RESOLVER_CACHE_SIZE 20
 
+/* The number of triples batch_add() queues before flushing */
+#define RESOLVER_BATCH_SIZE 1024
+
+/* What we know about each atom. The urn is only parsed when the atom
+   is first used as a subject.
+*/
+struct resolver_atom_t {
+  char *name;
+  uint32_t store_atom;
+  RDFURN urn;
+};
+
+/* Anything which uses a subject must load its deferred triples
+   first. A NULL subject loads everything.
+*/
+#define LOAD_DEFERRED(self, subject)                    \
+  do {                                                  \
+    if(!list_empty(&(self)->deferred))                  \
+      CALL(self, load_deferred, subject);               \
+  } while(0)
+
+/* Anything which uses the store must see the queued triples first. */
+#define FLUSH_BATCH(self)                               \
+  do {                                                  \
+    if((self)->batch_count > 0) CALL(self, flush_batch); \
+  } while(0)
+
 /* Thread control within the AFF4 library:
 
    In order to ensure the AFF4 library is thread safe, there is a
@@ -76,10 +103,23 @@ void register_type_dispatcher(char *type, AFFObject *classref) {
 
 
 
+/* Triples still queued by batch_add() go into the store before it is
+   freed with us - persistent stores would lose them otherwise.
+*/
+static int Resolver_destructor(void *this) {
+  Resolver self = (Resolver)this;
+
+  CALL(self, flush_batch);
+
+  return 0;
+};
+
 static Resolver Resolver_Con(Resolver self, DataStore store, int mode) {
   AFF4_GL_LOCK;
 
   self->logger = CONSTRUCT(Logger, Logger, Con, self);
+  self->mode = mode;
+  INIT_LIST_HEAD(&self->deferred);
 
   if(!store) {
     store = new_MemoryDataStore(self);
@@ -88,6 +128,7 @@ static Resolver Resolver_Con(Resolver self, DataStore store, int mode) {
   talloc_steal(self, store);
 
   self->store = store;
+  talloc_set_destructor((void *)self, Resolver_destructor);
 
   if(mode & RESOLVER_MODE_DEBUG_MEMORY)
     talloc_enable_leak_report_full();
@@ -98,6 +139,14 @@ static Resolver Resolver_Con(Resolver self, DataStore store, int mode) {
   // Cache this so we dont need to rebuilt it all the time.
   self->type = new_RDFURN(self);
 
+  self->atom_db = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE, 0);
+  talloc_set_name_const(self->atom_db, "Resolver Atoms");
+
+  // These are what we usually need to look up backwards.
+  CALL(self, add_index, AFF4_TYPE);
+  CALL(self, add_index, AFF4_STORED);
+  CALL(self, add_index, AFF4_VOLATILE_STORED);
+
   AFF4_GL_UNLOCK;
 
   return self;
@@ -112,6 +161,8 @@ static int Resolver_set(Resolver self, RDFURN urn, char *attribute_str,
   DataStoreObject obj;
 
   AFF4_GL_LOCK;
+  LOAD_DEFERRED(self, urn->value);
+  FLUSH_BATCH(self);
 
   obj = CALL(value, encode, urn, self);
 
@@ -126,6 +177,8 @@ static int Resolver_set(Resolver self, RDFURN urn, char *attribute_str,
  */
 static void Resolver_del(Resolver self, RDFURN urn, char *attribute_str) {
   AFF4_GL_LOCK;
+  LOAD_DEFERRED(self, urn->value);
+  FLUSH_BATCH(self);
 
   CALL(self->store, del, urn->value, attribute_str);
 
@@ -140,7 +193,8 @@ static int Resolver_add(Resolver self, RDFURN urn, char *attribute_str,
   DataStoreObject obj;
 
   AFF4_GL_LOCK;
-  CALL(self->store, unlock);
+  LOAD_DEFERRED(self, urn->value);
+  FLUSH_BATCH(self);
 
   obj = CALL(value, encode, urn, self);
 
@@ -151,43 +205,417 @@ static int Resolver_add(Resolver self, RDFURN urn, char *attribute_str,
   return 1;
 };
 
+/* Queue the triple. Loaders tend to add many attributes for the same
+   subject in a row so we share the strings with the previous triple
+   where we can.
+*/
+static void Resolver_batch_add(Resolver self, RDFURN urn, char *attribute_str,
+                               RDFValue value) {
+  struct datastore_triple_t *triple;
 
-/* Allocate and return all the RDFValues which match the urn and attribute.
- */
-static RDFValue Resolver_resolve(Resolver self, void *ctx, RDFURN urn, char *attribute) {
-  Object iter;
-  RDFValue result = NULL;
+  AFF4_GL_LOCK;
+  LOAD_DEFERRED(self, urn->value);
 
+  if(!self->batch_ctx) {
+    self->batch_ctx = talloc_size(self, 0);
+    self->batch = talloc_array(self->batch_ctx, struct datastore_triple_t,
+                               RESOLVER_BATCH_SIZE);
+  };
+
+  triple = &self->batch[self->batch_count];
+
+  if(self->batch_count > 0 && !strcmp(triple[-1].uri, urn->value)) {
+    triple->uri = triple[-1].uri;
+  } else {
+    triple->uri = talloc_strdup(self->batch_ctx, urn->value);
+  };
+
+  if(self->batch_count > 0 && !strcmp(triple[-1].attribute, attribute_str)) {
+    triple->attribute = triple[-1].attribute;
+  } else {
+    triple->attribute = talloc_strdup(self->batch_ctx, attribute_str);
+  };
+
+  triple->value = CALL(value, encode, urn, self);
+  if(!triple->value) {
+    // The slot is reused by the next triple so drop our copies.
+    if(self->batch_count == 0 || triple->uri != triple[-1].uri)
+      talloc_free(triple->uri);
+
+    if(self->batch_count == 0 || triple->attribute != triple[-1].attribute)
+      talloc_free(triple->attribute);
+
+    goto exit;
+  };
+
+  talloc_steal(self->batch_ctx, triple->value);
+  self->batch_count++;
+
+  if(self->batch_count >= RESOLVER_BATCH_SIZE)
+    CALL(self, flush_batch);
+
+ exit:
+  AFF4_GL_UNLOCK;
+};
+
+static void Resolver_flush_batch(Resolver self) {
   AFF4_GL_LOCK;
-  CALL(self->store, lock);
 
-  iter = CALL(self->store, iter, urn->value, attribute);
+  if(self->batch_count > 0) {
+    // The DataStore will steal the values, leaving just the strings.
+    CALL(self->store, add_batch, self->batch, self->batch_count);
+
+    talloc_free(self->batch_ctx);
+    self->batch_ctx = NULL;
+    self->batch = NULL;
+    self->batch_count = 0;
+  };
+
+  AFF4_GL_UNLOCK;
+};
+
+
+static void Resolver_defer(Resolver self, DeferredGraph graph) {
+  AFF4_GL_LOCK;
+
+  talloc_steal(self, graph);
+  list_add_tail(&graph->list, &self->deferred);
+
+  AFF4_GL_UNLOCK;
+};
+
+static void Resolver_load_deferred(Resolver self, char *subject) {
+  DeferredGraph graph, tmp;
+
+  AFF4_GL_LOCK;
+
+  list_for_each_entry_safe(graph, tmp, &self->deferred, list) {
+    if(subject) {
+      CALL(graph, load, self, subject);
+    } else {
+      CALL(graph, load_all, self);
+    };
+
+    // Nothing more to load from this graph.
+    if(graph->pending <= 0) {
+      list_del(&graph->list);
+      talloc_free(graph);
+    };
+  };
+
+  AFF4_GL_UNLOCK;
+};
+
+/* Decode all the values from the store iterator. The store must be
+   locked.
+*/
+static RDFValue decode_values(Resolver self, void *ctx, RDFURN urn, Object iter) {
+  RDFValue result = NULL;
 
   while(iter) {
     DataStoreObject obj = CALL(self->store, next, &iter);
     RDFValue rdf_value_class = (RDFValue)CALL(RDF_Registry, borrow, ZSTRING(obj->rdf_type));
     RDFValue item = NULL;
 
-    if(rdf_value_class) {
-      item = (RDFValue)CONSTRUCT_FROM_REFERENCE(rdf_value_class, Con, ctx);
-    };
+    // We do not know how to decode this type.
+    if(!rdf_value_class) continue;
+
+    item = (RDFValue)CONSTRUCT_FROM_REFERENCE(rdf_value_class, Con, ctx);
 
     // Decode it.
     CALL(item, decode, obj, urn, self);
 
     // Add to the list
     if(result) {
-      list_add_tail(&result->list, &item->list);
+      list_add_tail(&item->list, &result->list);
     } else {
       result = item;
     };
   };
 
+  return result;
+};
+
+/* Allocate and return all the RDFValues which match the urn and attribute.
+ */
+static RDFValue Resolver_resolve(Resolver self, void *ctx, RDFURN urn, char *attribute) {
+  RDFValue result;
+
+  AFF4_GL_LOCK;
+  LOAD_DEFERRED(self, urn->value);
+  FLUSH_BATCH(self);
+  CALL(self->store, lock);
+
+  result = decode_values(self, ctx, urn,
+                         CALL(self->store, iter, urn->value, attribute));
+
+  CALL(self->store, unlock);
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+/* Lock the store for a lookup which does not allocate or call back
+   into the library. Stores with shared reads only need the global
+   lock to load pending triples first - reading these without it
+   just misses triples which are being added concurrently. Returns
+   whether the global lock was taken.
+*/
+static int begin_read(Resolver self, char *subject) {
+  int global = !self->store->shared_reads || self->batch_count > 0 ||
+    !list_empty(&self->deferred);
+
+  if(global) {
+    AFF4_GL_LOCK;
+    LOAD_DEFERRED(self, subject);
+    FLUSH_BATCH(self);
+  };
+
+  CALL(self->store, lock);
+  return global;
+};
+
+static void end_read(Resolver self, int global) {
+  CALL(self->store, unlock);
+
+  if(global) {
+    AFF4_GL_UNLOCK;
+  };
+};
+
+/* The fast paths below decode the first value straight from the
+   store's copy so nothing needs to be allocated.
+*/
+static int Resolver_resolve_value(Resolver self, RDFURN urn, char *attribute,
+                                  RDFValue value) {
+  DataStoreObject obj;
+  int result = 0;
+
+  // Integers are just copied out so they do not need the global lock.
+  if(!strcmp(value->dataType, DATATYPE_XSD_INTEGER))
+    return CALL(self, resolve_uint64, urn, attribute,
+                (uint64_t *)&((XSDInteger)value)->value);
+
+  AFF4_GL_LOCK;
+  LOAD_DEFERRED(self, urn->value);
+  FLUSH_BATCH(self);
+  CALL(self->store, lock);
+
+  obj = CALL(self->store, get, urn->value, attribute);
+  if(obj && obj->rdf_type && !strcmp(obj->rdf_type, value->dataType)) {
+    result = CALL(value, decode, obj, urn, self) ? 1 : 0;
+  };
+
   CALL(self->store, unlock);
   AFF4_GL_UNLOCK;
   return result;
 };
 
+static int Resolver_resolve_uint64(Resolver self, RDFURN urn, char *attribute,
+                                   uint64_t *value) {
+  DataStoreObject obj;
+  int result = 0;
+  int global = begin_read(self, urn->value);
+
+  // This is how XSDInteger encodes itself.
+  obj = CALL(self->store, get, urn->value, attribute);
+  if(obj && obj->length == sizeof(*value) && obj->rdf_type &&
+     !strcmp(obj->rdf_type, DATATYPE_XSD_INTEGER)) {
+    memcpy(value, obj->data, sizeof(*value));
+    result = 1;
+  };
+
+  end_read(self, global);
+  return result;
+};
+
+static uint32_t Resolver_intern(Resolver self, char *string) {
+  XSDInteger atom;
+  struct resolver_atom_t *new_atom;
+  uint32_t result = 0;
+
+  AFF4_GL_LOCK;
+
+  atom = (XSDInteger)CALL(self->atom_db, borrow, ZSTRING_NO_NULL(string));
+  if(atom) {
+    result = atom->value;
+    goto exit;
+  };
+
+  // Grow the array in powers of 2
+  if((self->atom_count & (self->atom_count - 1)) == 0) {
+    self->atoms = talloc_realloc(self, self->atoms, struct resolver_atom_t,
+                                 max(self->atom_count * 2, 16));
+  };
+
+  new_atom = &self->atoms[self->atom_count];
+  new_atom->name = talloc_strdup(self->atoms, string);
+  new_atom->store_atom = CALL(self->store, intern, string);
+  new_atom->urn = NULL;
+
+  result = ++self->atom_count;
+
+  atom = CONSTRUCT(XSDInteger, XSDInteger, Con, NULL, result);
+  CALL(self->atom_db, put, ZSTRING_NO_NULL(string), (Object)atom);
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static struct resolver_atom_t *get_atom(Resolver self, uint32_t atom) {
+  if(atom == 0 || atom > self->atom_count) {
+    RaiseError(EProgrammingError, "Invalid atom %u", atom);
+    return NULL;
+  };
+
+  return &self->atoms[atom - 1];
+};
+
+static RDFURN atom_urn(Resolver self, struct resolver_atom_t *atom) {
+  if(!atom->urn)
+    atom->urn = intern_urn(atom->name);
+
+  return atom->urn;
+};
+
+/* Store the value using the store's atoms if it has them. */
+static int store_atom_value(Resolver self, uint32_t urn, uint32_t attribute,
+                            RDFValue value, int replace) {
+  struct resolver_atom_t *urn_atom, *attribute_atom;
+  DataStoreObject obj;
+
+  AFF4_GL_LOCK;
+  FLUSH_BATCH(self);
+
+  urn_atom = get_atom(self, urn);
+  attribute_atom = get_atom(self, attribute);
+  if(!urn_atom || !attribute_atom)
+    goto error;
+
+  LOAD_DEFERRED(self, urn_atom->name);
+
+  obj = CALL(value, encode, atom_urn(self, urn_atom), self);
+
+  // The DataStore will steal the object.
+  if(urn_atom->store_atom && attribute_atom->store_atom) {
+    if(replace) {
+      CALL(self->store, set_atoms, urn_atom->store_atom,
+           attribute_atom->store_atom, obj);
+    } else {
+      CALL(self->store, add_atoms, urn_atom->store_atom,
+           attribute_atom->store_atom, obj);
+    };
+  } else if(replace) {
+    CALL(self->store, set, urn_atom->name, attribute_atom->name, obj);
+  } else {
+    CALL(self->store, add, urn_atom->name, attribute_atom->name, obj);
+  };
+
+  AFF4_GL_UNLOCK;
+  return 1;
+
+ error:
+  AFF4_GL_UNLOCK;
+  return 0;
+};
+
+static int Resolver_set_atom(Resolver self, uint32_t urn, uint32_t attribute,
+                             RDFValue value) {
+  return store_atom_value(self, urn, attribute, value, 1);
+};
+
+static int Resolver_add_atom(Resolver self, uint32_t urn, uint32_t attribute,
+                             RDFValue value) {
+  return store_atom_value(self, urn, attribute, value, 0);
+};
+
+static RDFValue Resolver_resolve_atom(Resolver self, void *ctx, uint32_t urn,
+                                      uint32_t attribute) {
+  struct resolver_atom_t *urn_atom, *attribute_atom;
+  RDFValue result = NULL;
+  Object iter;
+
+  AFF4_GL_LOCK;
+  FLUSH_BATCH(self);
+
+  urn_atom = get_atom(self, urn);
+  attribute_atom = get_atom(self, attribute);
+  if(!urn_atom || !attribute_atom)
+    goto exit;
+
+  LOAD_DEFERRED(self, urn_atom->name);
+
+  CALL(self->store, lock);
+
+  if(urn_atom->store_atom && attribute_atom->store_atom) {
+    iter = CALL(self->store, iter_atoms, urn_atom->store_atom,
+                attribute_atom->store_atom);
+  } else {
+    iter = CALL(self->store, iter, urn_atom->name, attribute_atom->name);
+  };
+
+  result = decode_values(self, ctx, atom_urn(self, urn_atom), iter);
+
+  CALL(self->store, unlock);
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+
+static int Resolver_add_index(Resolver self, char *attribute) {
+  int result;
+
+  AFF4_GL_LOCK;
+  FLUSH_BATCH(self);
+
+  result = CALL(self->store, add_index, attribute);
+
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
+static RDFURN Resolver_resolve_subjects(Resolver self, void *ctx, char *attribute,
+                                       RDFValue value) {
+  DataStoreObject obj;
+  RDFURN result = NULL;
+  Object iter;
+
+  AFF4_GL_LOCK;
+  LOAD_DEFERRED(self, NULL);
+  FLUSH_BATCH(self);
+
+  obj = CALL(value, encode, NULL, self);
+  if(!obj)
+    goto exit;
+
+  CALL(self->store, lock);
+
+  iter = CALL(self->store, iter_subjects, attribute, obj);
+  while(iter) {
+    char *subject = CALL(self->store, next_subject, &iter);
+    RDFURN item = new_RDFURN(ctx);
+
+    CALL(item, set, subject);
+    INIT_LIST_HEAD(&((RDFValue)item)->list);
+
+    // Add to the list
+    if(result) {
+      list_add_tail(&((RDFValue)item)->list, &((RDFValue)result)->list);
+    } else {
+      result = item;
+    };
+  };
+
+  CALL(self->store, unlock);
+  talloc_free(obj);
+
+ exit:
+  AFF4_GL_UNLOCK;
+  return result;
+};
+
 
 static AFFObject create_new_object(Resolver self, RDFURN urn, char *type, char mode) {
   AFFObject result = NULL;
@@ -238,19 +666,23 @@ error:
 /* Instantiates a single instance of the class using this resolver. The returned
  * object MUST be returned to the cache using cache_return(). The object is
  * owned by the resolver for the entire time users use it - users must not free
- * it. While it is in use the object is locked to the calling thread.
-
- * In read mode, the object is created from scratch, and destroyed when
- * returned. This means there could be multiple copies of the same object in
- * simultaneous use. Its ok for clients to hold for an indefinite time.
-
- * In write mode only a single instance of the object may exist. The object is
- * locked between this call and the cache_return() call. Writer threads are
- * blocked waiting for it.
+ * it.
+
+ * In read mode, an idle instance returned to the read cache is handed out
+ * if there is one, otherwise a new one is created. Each instance is only
+ * used by one caller at a time, but there could be multiple copies of the
+ * same object in simultaneous use. Its ok for clients to hold for an
+ * indefinite time.
+
+ * In write mode only a single instance of the object may exist and every
+ * caller gets that instance from the write cache. It is not locked -
+ * callers sharing it must serialise their use of it (e.g. with
+ * AFF4_OBJECT_LOCK).
  */
 static AFFObject Resolver_open(Resolver self, RDFURN urn, char mode) {
   AFFObject result = NULL;
   DataStoreObject type_obj;
+  char *type = NULL;
 
   AFF4_GL_LOCK;
   ClearError();
@@ -262,18 +694,29 @@ static AFFObject Resolver_open(Resolver self, RDFURN urn, char mode) {
 
   DEBUG_OBJECT("Opening %s for mode %c\n", urn->value, mode);
 
-  // Object must already exist.
+  // Object must already exist. The type_obj is only valid while the
+  // store is locked so we take a copy.
+  LOAD_DEFERRED(self, urn->value);
+  FLUSH_BATCH(self);
   CALL(self->store, lock);
   type_obj = CALL(self->store, get, urn->value, AFF4_TYPE);
+  if(type_obj)
+    type = talloc_strndup(NULL, type_obj->data, type_obj->length);
   CALL(self->store, unlock);
 
-  if(!type_obj) {
+  if(!type) {
     RaiseError(ERuntimeError, "Object does not exist.");
     goto exit;
   };
 
   if(mode == 'r') {
-    result = create_new_object(self, urn, type_obj->data, mode);
+    // Reuse an idle instance - taking it out of the cache means
+    // nobody else can have it until it is returned.
+    if(CALL(self->read_cache, present, ZSTRING(urn->value))) {
+      result = (AFFObject)CALL(self->read_cache, get, self, ZSTRING(urn->value));
+    } else {
+      result = create_new_object(self, urn, type, mode);
+    };
 
     goto exit;
   } else if(mode =='w') {
@@ -283,20 +726,24 @@ static AFFObject Resolver_open(Resolver self, RDFURN urn, char mode) {
       goto exit;
     } else {
       // Need to make a new object
-      result = create_new_object(self, urn, type_obj->data, mode);
+      result = create_new_object(self, urn, type, mode);
 
       goto exit;
     };
   };
 
 exit:
+  if(type)
+    talloc_free(type);
+
   AFF4_GL_UNLOCK;
   return result;
 };
 
 
 /** Return the object to the cache. Callers may not make a reference
-    to it after that. We also trim back the cache if needed.
+    to it after that. The read cache is bounded so returning an
+    object may free the least recently used idle instance.
 */
 static void Resolver_cache_return(Resolver self, AFFObject obj) {
   AFF4_GL_LOCK;
@@ -306,8 +753,12 @@ static void Resolver_cache_return(Resolver self, AFFObject obj) {
     cache = self->write_cache;
   };
 
-  // Return it back to the cache.
-  CALL(cache, put, ZSTRING(obj->urn->value), (Object)obj);
+  // Objects we handed out with own() never left their cache - adding
+  // them again would leave a stale entry which frees them on expiry.
+  if(talloc_parent(obj) != self->managed && talloc_parent(obj) != cache) {
+    // Return it back to the cache.
+    CALL(cache, put, ZSTRING(obj->urn->value), (Object)obj);
+  };
 
   ClearError();
 
@@ -345,7 +796,7 @@ static int remove_object_from_cache(void *ctx) {
 
 
 static void Resolver_manage(Resolver self, AFFObject obj) {
-  Cache cache = self->read_cache;
+  Cache cache = self->managed;
   AFF4_GL_LOCK;
 
   if(obj->mode == 'w')
@@ -362,7 +813,7 @@ static void Resolver_manage(Resolver self, AFFObject obj) {
 static AFFObject Resolver_own(Resolver self, RDFURN urn, char mode) {
   /* Check that the object is not already in the write cache */
   AFFObject result;
-  Cache cache = self->read_cache;
+  Cache cache = self->managed;
 
   AFF4_GL_LOCK;
 
@@ -453,12 +904,20 @@ static void Resolver_flush(Resolver self) {
   if(self->write_cache)
     talloc_free(self->write_cache);
 
-  self->read_cache = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE, 0);
+  // The idle readers above may still refer to managed objects.
+  if(self->managed)
+    talloc_free(self->managed);
+
+  self->read_cache = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE,
+                               RESOLVER_CACHE_SIZE);
   talloc_set_name_const(self->read_cache, "Resolver Read Cache");
 
   self->write_cache = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE, 0);
   talloc_set_name_const(self->write_cache, "Resolver Write Cache");
   //  NAMEOF(self->write_cache) = "Resolver Write Cache";
+
+  self->managed = CONSTRUCT(Cache, Cache, Con, self, HASH_TABLE_SIZE, 0);
+  talloc_set_name_const(self->managed, "Resolver Managed Objects");
   AFF4_GL_UNLOCK;
 };
 
@@ -489,9 +948,23 @@ VIRTUAL(Resolver, Object) {
      VMETHOD(cache_return) = Resolver_cache_return;
 
      VMETHOD(resolve) = Resolver_resolve;
+     VMETHOD(resolve_value) = Resolver_resolve_value;
+     VMETHOD(resolve_uint64) = Resolver_resolve_uint64;
      VMETHOD(open) = Resolver_open;
      VMETHOD(set) = Resolver_set;
      VMETHOD(add) = Resolver_add;
+     VMETHOD(batch_add) = Resolver_batch_add;
+     VMETHOD(flush_batch) = Resolver_flush_batch;
+     VMETHOD(defer) = Resolver_defer;
+     VMETHOD(load_deferred) = Resolver_load_deferred;
+
+     VMETHOD(intern) = Resolver_intern;
+     VMETHOD(set_atom) = Resolver_set_atom;
+     VMETHOD(add_atom) = Resolver_add_atom;
+     VMETHOD(resolve_atom) = Resolver_resolve_atom;
+
+     VMETHOD(add_index) = Resolver_add_index;
+     VMETHOD(resolve_subjects) = Resolver_resolve_subjects;
      VMETHOD(del) = Resolver_del;
 
      VMETHOD(register_rdf_value_class) = Resolver_register_rdf_value_class;
@@ -510,9 +983,26 @@ VIRTUAL(Resolver, Object) {
 /************************************************************
   AFFObject - This is the base class for all other objects
 ************************************************************/
+static int AFFObject_lock_destructor(void *lock) {
+  pthread_mutex_destroy((pthread_mutex_t *)lock);
+  return 0;
+};
+
 static AFFObject AFFObject_Con(AFFObject self, RDFURN uri, char mode, Resolver resolver) {
+  pthread_mutexattr_t mutex_attr;
+
   AFF4_GL_LOCK;
 
+  /* The lock is a separate allocation so subclasses remain free to
+     set their own destructors.
+  */
+  self->lock = talloc(self, pthread_mutex_t);
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(self->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+  talloc_set_destructor((void *)self->lock, AFFObject_lock_destructor);
+
   self->resolver = resolver;
 
   if(uri) {
@@ -565,16 +1055,23 @@ static int AFFObject_finish(AFFObject self) {
 };
 
 static int AFFObject_close(AFFObject self) {
-  Cache cache;
+  Cache read_cache;
 
   AFF4_GL_LOCK;
 
-  cache = self->resolver->read_cache;
-  if(self->mode == 'w')
-    cache = self->resolver->write_cache;
+  /* Readers are never in the cache while they are in use. */
+  if(self->mode == 'w') {
+    read_cache = self->resolver->read_cache;
 
-  /* Remove us from the cache */
-  CALL(cache, get, NULL, ZSTRING(self->urn->value));
+    /* Remove us from the cache */
+    if(CALL(self->resolver->write_cache, present, ZSTRING(self->urn->value)))
+      CALL(self->resolver->write_cache, get, NULL, ZSTRING(self->urn->value));
+
+    /* Idle readers of this object are now out of date. */
+    while(CALL(read_cache, present, ZSTRING(self->urn->value))) {
+      talloc_free(CALL(read_cache, get, NULL, ZSTRING(self->urn->value)));
+    };
+  };
 
   AFF4_GL_UNLOCK;
   return 1;
@@ -608,6 +1105,11 @@ VIRTUAL(Logger, Object) {
   VMETHOD(message) = Logger_message;
 } END_VIRTUAL
 
+VIRTUAL(DeferredGraph, Object) {
+  UNIMPLEMENTED(DeferredGraph, load);
+  UNIMPLEMENTED(DeferredGraph, load_all);
+} END_VIRTUAL
+
 
 /* The global lock object. */
 AFF4GlobalLock aff4_gl_lock;
@@ -651,6 +1153,10 @@ DLL_PUBLIC void aff4_end() {
   talloc_free(AFF4_SECURITY_PROVIDER);
   raptor_finish();
 
+#ifdef AFF4_LOCK_STATS
+  aff4_lock_stats_report(stderr);
+#endif
+
   current_error = aff4_get_current_error(&buff);
   if(current_error) {
     talloc_free(current_error);
@@ -3,6 +3,8 @@ This file tests the various aff4 objects.
 ***************************************************/
 
 #include "aff4_internal.h"
+#include <signal.h>
+#include <sys/resource.h>
 
 extern char TEMP_DIR[];
 
@@ -75,3 +77,385 @@ TEST(FileBackedObjectTest) {
 
   talloc_free(oracle);
 };
+
+/*************************************************
+Test the BufferedWriter
+***************************************************/
+TEST(BufferedWriterTest) {
+  Resolver oracle = AFF4_get_resolver(NULL, NULL);
+  FileLikeObject fd;
+  BufferedWriter writer;
+  RDFURN urn = new_RDFURN(oracle);
+  struct rlimit limit, old_limit;
+  char buff[BUFF_SIZE];
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "BufferedWriter.dd");
+  unlink(urn->parser->query);
+
+  fd = (FileLikeObject)CALL(oracle, create, urn, AFF4_FILE, 'w');
+  CU_ASSERT_FATAL(fd != NULL && CALL((AFFObject)fd, finish));
+
+  writer = CONSTRUCT(BufferedWriter, BufferedWriter, Con, oracle, fd, 100);
+  CU_ASSERT_FATAL(writer != NULL);
+
+  // Small writes stay in the buffer.
+  CALL((FileLikeObject)writer, write, ZSTRING_NO_NULL("0123456789"));
+  CALL((FileLikeObject)writer, write, ZSTRING_NO_NULL("abcdef"));
+  CU_ASSERT_EQUAL(((FileBackedObject)fd)->size, 0);
+
+  // The file can only grow to 4 bytes so the first write is short and
+  // the next one fails.
+  signal(SIGXFSZ, SIG_IGN);
+  getrlimit(RLIMIT_FSIZE, &old_limit);
+  limit = old_limit;
+  limit.rlim_cur = 4;
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  CU_ASSERT_FALSE(CALL(writer, flush));
+  ClearError();
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+
+  // The rest is still pending.
+  CU_ASSERT_EQUAL(((FileBackedObject)fd)->size, 4);
+  CU_ASSERT_EQUAL(writer->buffer_offset, 4);
+  CU_ASSERT_EQUAL(writer->buffer_used, 12);
+
+  // Now it can all be written.
+  CU_ASSERT_TRUE(CALL((AFFObject)writer, close));
+  CU_ASSERT_EQUAL(((FileBackedObject)fd)->size, 16);
+
+  CALL(fd, seek, 0, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL(fd, read, buff, sizeof(buff)), 16);
+  CU_ASSERT(!memcmp(buff, "0123456789abcdef", 16));
+
+  talloc_free(oracle);
+};
+
+/*************************************************
+Test the RescueReader
+***************************************************/
+
+/* Reads overlapping [bad_start, bad_end) fail. A positive
+   bad_failures only fails that many times.
+*/
+static uint64_t bad_start, bad_end;
+static int bad_failures;
+static int (*good_read)(FileLikeObject self, char *buffer, unsigned int length);
+
+static int bad_read(FileLikeObject self, char *buffer, unsigned int length) {
+  if(self->readptr < bad_end && self->readptr + length > bad_start &&
+     bad_failures != 0) {
+    if(bad_failures > 0)
+      bad_failures--;
+
+    RaiseError(EIOError, "Bad sector");
+    return -1;
+  };
+
+  return good_read(self, buffer, length);
+};
+
+/* Make a source of size bytes with a bad range. */
+static FileLikeObject make_bad_source(Resolver oracle, RDFURN urn, int size,
+                                      uint64_t start, uint64_t end,
+                                      int failures) {
+  FileLikeObject fd;
+  char buff[BUFF_SIZE];
+  int i;
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "RescueSource.dd");
+  unlink(urn->parser->query);
+
+  fd = (FileLikeObject)CALL(oracle, create, urn, AFF4_FILE, 'w');
+  if(!fd || !CALL((AFFObject)fd, finish))
+    return NULL;
+
+  for(i=0; i<sizeof(buff); i++)
+    buff[i] = i;
+
+  for(i=0; i<size; i+=sizeof(buff))
+    CALL(fd, write, buff, min(sizeof(buff), size - i));
+
+  bad_start = start;
+  bad_end = end;
+  bad_failures = failures;
+  good_read = fd->read;
+  fd->read = bad_read;
+
+  return fd;
+};
+
+static FileLikeObject make_rescued(Resolver oracle, RDFURN urn) {
+  FileLikeObject fd;
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "Rescued.dd");
+  unlink(urn->parser->query);
+
+  fd = (FileLikeObject)CALL(oracle, create, urn, AFF4_FILE, 'w');
+  if(!fd || !CALL((AFFObject)fd, finish))
+    return NULL;
+
+  return fd;
+};
+
+TEST(RescueReaderRetryTest) {
+  Resolver oracle = AFF4_get_resolver(NULL, NULL);
+  RDFURN image = new_RDFURN(oracle);
+  RDFURN rescued_urn = new_RDFURN(oracle);
+  FileLikeObject source, rescued;
+  RescueReader reader;
+  char buff[16384];
+  char *map, *expected;
+
+  source = make_bad_source(oracle, new_RDFURN(oracle), 16384, 5000, 5100, -1);
+  rescued = make_rescued(oracle, rescued_urn);
+  CU_ASSERT_FATAL(source != NULL && rescued != NULL);
+
+  reader = CONSTRUCT(RescueReader, RescueReader, Con, oracle, source, 4096, 512);
+  CU_ASSERT_FATAL(reader != NULL);
+
+  // The whole bad block is skipped.
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)reader, read, buff, sizeof(buff)), 16384);
+  CU_ASSERT_EQUAL(reader->bad_bytes, 4096);
+
+  // Halving down to 512 bytes leaves only the block with the bad range.
+  CU_ASSERT_EQUAL(CALL(reader, retry, rescued), 512);
+  CU_ASSERT_EQUAL(((FileBackedObject)rescued)->size, 3584);
+
+  CALL(image, set, "aff4://image");
+  map = CALL(reader, get_map, reader, image, rescued_urn);
+  expected = talloc_asprintf(reader,
+                             "0,0,aff4://image\n"
+                             "4096,3072,%s\n"
+                             "4608,4608," AFF4_SPECIAL_URN_ZERO "\n"
+                             "5120,2048,%s\n"
+                             "6144,0,%s\n"
+                             "8192,8192,aff4://image\n",
+                             rescued_urn->value, rescued_urn->value,
+                             rescued_urn->value);
+  CU_ASSERT_STRING_EQUAL(map, expected);
+
+  talloc_free(oracle);
+};
+
+/* A retry is still made when the first pass used the smallest block
+   size. If the size is unknown the image carries on after the last
+   region.
+*/
+TEST(RescueReaderMinBlockTest) {
+  Resolver oracle = AFF4_get_resolver(NULL, NULL);
+  RDFURN image = new_RDFURN(oracle);
+  RDFURN rescued_urn = new_RDFURN(oracle);
+  FileLikeObject source, rescued;
+  RescueReader reader;
+  char buff[16384];
+  char *map, *expected;
+
+  source = make_bad_source(oracle, new_RDFURN(oracle), 16384, 5000, 5100, 1);
+  rescued = make_rescued(oracle, rescued_urn);
+  CU_ASSERT_FATAL(source != NULL && rescued != NULL);
+
+  reader = CONSTRUCT(RescueReader, RescueReader, Con, oracle, source, 512, 512);
+  CU_ASSERT_FATAL(reader != NULL);
+  reader->size = 0;
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)reader, read, buff, sizeof(buff)), 16384);
+  CU_ASSERT_EQUAL(reader->bad_bytes, 512);
+  CU_ASSERT_EQUAL(CALL(reader, retry, rescued), 0);
+
+  CALL(image, set, "aff4://image");
+  map = CALL(reader, get_map, reader, image, rescued_urn);
+  expected = talloc_asprintf(reader,
+                             "0,0,aff4://image\n"
+                             "4608,0,%s\n"
+                             "5120,5120,aff4://image\n",
+                             rescued_urn->value);
+  CU_ASSERT_STRING_EQUAL(map, expected);
+
+  talloc_free(oracle);
+};
+
+/* Regions at the start and end of the source need no image runs
+   around them.
+*/
+TEST(RescueReaderMapEdgesTest) {
+  Resolver oracle = AFF4_get_resolver(NULL, NULL);
+  RDFURN image = new_RDFURN(oracle);
+  FileLikeObject source;
+  RescueReader reader;
+  char buff[16384];
+
+  CALL(image, set, "aff4://image");
+
+  source = make_bad_source(oracle, new_RDFURN(oracle), 16384, 16300, 16384, -1);
+  CU_ASSERT_FATAL(source != NULL);
+  reader = CONSTRUCT(RescueReader, RescueReader, Con, oracle, source, 4096, 4096);
+  CU_ASSERT_FATAL(reader != NULL);
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)reader, read, buff, sizeof(buff)), 16384);
+  CU_ASSERT_STRING_EQUAL(CALL(reader, get_map, reader, image, NULL),
+                         "0,0,aff4://image\n"
+                         "12288,12288," AFF4_SPECIAL_URN_ZERO "\n");
+
+  source = make_bad_source(oracle, new_RDFURN(oracle), 16384, 0, 100, -1);
+  CU_ASSERT_FATAL(source != NULL);
+  reader = CONSTRUCT(RescueReader, RescueReader, Con, oracle, source, 4096, 4096);
+  CU_ASSERT_FATAL(reader != NULL);
+
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)reader, read, buff, sizeof(buff)), 16384);
+  CU_ASSERT_STRING_EQUAL(CALL(reader, get_map, reader, image, NULL),
+                         "0,0," AFF4_SPECIAL_URN_ZERO "\n"
+                         "4096,4096,aff4://image\n");
+
+  talloc_free(oracle);
+};
+
+/* Readers returned to the cache are handed out again, but never to
+   two users at once.
+*/
+TEST(ResolverReadCacheTest) {
+  Resolver oracle = AFF4_get_resolver(NULL, NULL);
+  FileLikeObject fd, fd2;
+  RDFURN urn = new_RDFURN(oracle);
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "ResolverReadCache.dd");
+
+  fd = (FileLikeObject)CALL(oracle, create, urn, AFF4_FILE, 'w');
+  CALL((AFFObject)fd, finish);
+  CALL(fd, write, ZSTRING("hello"));
+  CALL((AFFObject)fd, close);
+
+  // open() needs to know what the object is.
+  CALL(oracle, set, urn, AFF4_TYPE, rdfvalue_from_string(urn, AFF4_FILE));
+
+  fd = (FileLikeObject)CALL(oracle, open, urn, 'r');
+  CU_ASSERT_FATAL(fd != NULL);
+  CALL(oracle, cache_return, (AFFObject)fd);
+
+  // We get the same instance back.
+  fd2 = (FileLikeObject)CALL(oracle, open, urn, 'r');
+  CU_ASSERT_PTR_EQUAL(fd, fd2);
+
+  // It is in use so we need a new one.
+  fd = (FileLikeObject)CALL(oracle, open, urn, 'r');
+  CU_ASSERT_PTR_NOT_NULL(fd);
+  CU_ASSERT_PTR_NOT_EQUAL(fd, fd2);
+
+  CALL(oracle, cache_return, (AFFObject)fd);
+  CALL(oracle, cache_return, (AFFObject)fd2);
+
+  talloc_free(oracle);
+};
+
+/* Independent streams may be read from several threads at once. */
+struct parallel_read_t {
+  FileLikeObject fd;
+  char buff[BUFF_SIZE];
+  int length;
+};
+
+static void *parallel_reader(void *data) {
+  struct parallel_read_t *job = (struct parallel_read_t *)data;
+  int i;
+
+  for(i=0; i<100; i++) {
+    CALL(job->fd, seek, 0, SEEK_SET);
+    job->length = CALL(job->fd, read, job->buff, sizeof(job->buff));
+  };
+
+  return NULL;
+};
+
+TEST(FileBackedObjectParallelReadTest) {
+  Resolver oracle = AFF4_get_resolver(NULL, NULL);
+  struct parallel_read_t jobs[2];
+  pthread_t threads[2];
+  char *names[] = {"parallel1.dd", "parallel2.dd"};
+  int i;
+
+  for(i=0; i<2; i++) {
+    RDFURN urn = new_RDFURN(oracle);
+    FileLikeObject fd;
+
+    CALL(urn, set, TEMP_DIR);
+    CALL(urn, add, names[i]);
+
+    fd = (FileLikeObject)CALL(oracle, create, urn, AFF4_FILE, 'w');
+    CALL((AFFObject)fd, finish);
+    CALL(fd, write, ZSTRING(names[i]));
+    CALL((AFFObject)fd, close);
+
+    CALL(oracle, set, urn, AFF4_TYPE, rdfvalue_from_string(urn, AFF4_FILE));
+
+    jobs[i].fd = (FileLikeObject)CALL(oracle, open, urn, 'r');
+    CU_ASSERT_FATAL(jobs[i].fd != NULL);
+    CU_ASSERT_FATAL(CALL((AFFObject)jobs[i].fd, finish));
+  };
+
+  for(i=0; i<2; i++)
+    pthread_create(&threads[i], NULL, parallel_reader, &jobs[i]);
+
+  for(i=0; i<2; i++) {
+    pthread_join(threads[i], NULL);
+
+    CU_ASSERT_EQUAL(jobs[i].length, strlen(names[i]) + 1);
+    CU_ASSERT_STRING_EQUAL(jobs[i].buff, names[i]);
+    CALL(oracle, cache_return, (AFFObject)jobs[i].fd);
+  };
+
+  talloc_free(oracle);
+};
+
+/* Asynchronous reads complete through the batch's queue without
+   moving the stream's readptr.
+*/
+TEST(ReadBatchTest) {
+  Resolver oracle = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(oracle);
+  FileLikeObject fd;
+  ReadBatch batch;
+  AsyncRead request;
+  char buffers[100][4];
+  int i, count = 0;
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "async.dd");
+
+  fd = (FileLikeObject)CALL(oracle, create, urn, AFF4_FILE, 'w');
+  CALL((AFFObject)fd, finish);
+  for(i=0; i<100; i++)
+    CALL(fd, write, (char *)&i, sizeof(i));
+  CALL((AFFObject)fd, close);
+
+  CALL(oracle, set, urn, AFF4_TYPE, rdfvalue_from_string(urn, AFF4_FILE));
+
+  fd = (FileLikeObject)CALL(oracle, open, urn, 'r');
+  CU_ASSERT_FATAL(fd != NULL);
+  CU_ASSERT_FATAL(CALL((AFFObject)fd, finish));
+
+  batch = CONSTRUCT(ReadBatch, ReadBatch, Con, oracle, NULL);
+  for(i=0; i<100; i++) {
+    request = CALL(batch, read, fd, i * sizeof(i), buffers[i], sizeof(i));
+    CU_ASSERT_PTR_NOT_NULL(request);
+  };
+
+  while((request = CALL(batch, poll, NULL, 10))) {
+    int index = request->offset / sizeof(i);
+
+    CU_ASSERT_EQUAL(request->result, sizeof(i));
+    CU_ASSERT_EQUAL(*(int *)request->buffer, index);
+    count ++;
+    talloc_free(request);
+  };
+
+  CU_ASSERT_EQUAL(count, 100);
+  CU_ASSERT_EQUAL(CALL(fd, tell), 0);
+
+  talloc_free(batch);
+  CALL(oracle, cache_return, (AFFObject)fd);
+  talloc_free(oracle);
+};
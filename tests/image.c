@@ -53,6 +53,35 @@ TEST(ImageWriter) {
   talloc_free(resolver);
 };
 
+/* Bevies which can not be written make close() fail. */
+TEST(ImageWriterFailure) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  FileLikeObject image = (FileLikeObject)CALL(resolver, create,
+                                              NULL, AFF4_IMAGE, 'w');
+  int i;
+
+  // There is no such volume.
+  ((AFF4Image)image)->stored = new_RDFURN(image);
+  CALL(((AFF4Image)image)->stored, set, "aff4://no_such_volume");
+
+  ((AFF4Image)image)->chunk_size = 32;
+  ((AFF4Image)image)->chunks_in_segment = 10;
+  ((AFF4Image)image)->thread_count = 2;
+
+  CALL((AFFObject)image, finish);
+
+  for(i=0; i<100; i++) {
+    CALL(image, write, ZSTRING_NO_NULL("hello world!"));
+  };
+
+  CU_ASSERT_EQUAL(CALL((AFFObject)image, close), 0);
+  CU_ASSERT_TRUE(CheckError(EIOError));
+  ClearError();
+
+  talloc_free(image);
+  talloc_free(resolver);
+};
+
 
 TEST(ImageReader) {
   Resolver resolver = AFF4_get_resolver(NULL, NULL);
@@ -62,7 +91,8 @@ TEST(ImageReader) {
 
   char buffer[BUFF_SIZE];
 
-  CALL(zip->storage_urn, set, "/tmp/Image.zip");
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Image.zip");
 
   CALL((AFFObject)zip, finish);
 
@@ -85,6 +115,52 @@ TEST(ImageReader) {
 
   CALL((AFFObject)image, finish);
 
-  CALL(image, read, buffer, 10);
+  CU_ASSERT_EQUAL(CALL(image, read, buffer, 10), 10);
+  CU_ASSERT(!memcmp(buffer, "hello worl", 10));
 
+  /* Reads span chunks and bevies. */
+  CALL(image, seek, 12 * 500 + 6, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL(image, read, buffer, 1000), 1000);
+  CU_ASSERT(!memcmp(buffer, "world!hello ", 12));
+
+  /* Short read at the end of the image. */
+  CALL(image, seek, 12 * 999, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL(image, read, buffer, 100), 12);
+
+  CU_ASSERT_EQUAL(CALL((AFFObject)image, close), 1);
+  talloc_free(resolver);
+};
+
+/* The parameters recorded by the writer are used when the caller
+   does not set them.
+*/
+TEST(ImageReaderParameters) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  AFF4Image image = (AFF4Image)CALL(resolver, create, NULL, AFF4_IMAGE, 'r');
+  char buffer[BUFF_SIZE];
+
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "Image.zip");
+
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  URNOF(image) = CALL(URNOF(zip), copy, image);
+  CALL(URNOF(image), add, "image");
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  CU_ASSERT_FATAL(CALL((AFFObject)image, finish));
+  CU_ASSERT_STRING_EQUAL(image->stored->value, URNOF(zip)->value);
+  CU_ASSERT_EQUAL(image->chunk_size, 32);
+  CU_ASSERT_EQUAL(image->chunks_in_segment, 10);
+  CU_ASSERT_EQUAL(image->compression, ZIP_DEFLATE);
+  CU_ASSERT_EQUAL(image->size, 12000);
+
+  CALL((FileLikeObject)image, seek, 12 * 500 + 6, SEEK_SET);
+  CU_ASSERT_EQUAL(CALL((FileLikeObject)image, read, buffer, 12), 12);
+  CU_ASSERT(!memcmp(buffer, "world!hello ", 12));
+
+  CU_ASSERT_EQUAL(CALL((AFFObject)image, close), 1);
+  talloc_free(resolver);
 };
@@ -78,6 +78,32 @@ TEST(URLParserTraversal2) {
   aff4_free(url);
 };
 
+TEST(URLParserAppend) {
+  RDFURN url = new_RDFURN(NULL);
+
+  url->set(url, "aff4://1234/stream");
+
+  /* Plain relative paths are appended in place */
+  url->add(url, "0000001A");
+  url->add(url, "idx");
+  CU_ASSERT_STRING_EQUAL(url->value, "aff4://1234/stream/0000001A/idx");
+  CU_ASSERT_STRING_EQUAL(url->parser->query, "/stream/0000001A/idx");
+  CU_ASSERT_STRING_EQUAL(url->parser->netloc, "1234");
+
+  /* Appended elements are still reduced */
+  url->add(url, "..//./map");
+  CU_ASSERT_STRING_EQUAL(url->value, "aff4://1234/stream/0000001A/map");
+  url->add(url, "../../../..");
+  CU_ASSERT_STRING_EQUAL(url->value, "aff4://1234");
+
+  /* Fragments are kept at the end */
+  url->add(url, "a#frag");
+  url->add(url, "b");
+  CU_ASSERT_STRING_EQUAL(url->value, "aff4://1234/a/b#frag");
+
+  aff4_free(url);
+};
+
 /********************************************
    Tests for XSDInteger
 ********************************************/
@@ -237,3 +263,28 @@ TEST(RDFURNRelativeName) {
 
   aff4_free(url);
 };
+
+TEST(RDFURNIntern) {
+  RDFURN url = new_RDFURN(NULL);
+  RDFURN interned = intern_urn("aff4://1234/a/b/../c");
+  RDFURN copy;
+
+  /* All spellings of a URN give the same handle */
+  url->set(url, "aff4://1234/a//c");
+  CU_ASSERT_PTR_EQUAL(url->intern(url), interned);
+  CU_ASSERT_PTR_EQUAL(intern_urn("aff4://1234/a/c"), interned);
+  CU_ASSERT_STRING_EQUAL(interned->value, "aff4://1234/a/c");
+
+  /* Interned handles can not be changed */
+  interned->add(interned, "d");
+  CU_ASSERT_STRING_EQUAL(interned->value, "aff4://1234/a/c");
+  ClearError();
+
+  /* But copies can */
+  copy = interned->copy(interned, url);
+  copy->add(copy, "d");
+  CU_ASSERT_STRING_EQUAL(copy->value, "aff4://1234/a/c/d");
+  CU_ASSERT_STRING_EQUAL(copy->parser->query, "/a/c/d");
+
+  aff4_free(url);
+};
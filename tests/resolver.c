@@ -4,6 +4,8 @@ This file tests the resolver.
 
 #include "aff4_internal.h"
 
+extern char TEMP_DIR[];
+
 INIT() {
   Cache_init((Object)&__Cache);
 
@@ -22,18 +24,30 @@ TEST(MemoryDataStoreTestSet) {
                                     ZSTRING("world"), "xsd:string");
   DataStoreObject test;
 
-  /* Lock the store */
-  CALL(store, lock);
-
   /* Check that we can set and get the same string */
   CALL(store, set, "url", "attribute", value);
+
+  CALL(store, lock);
   test = CALL(store, get, "url", "attribute");
   CU_ASSERT_NSTRING_EQUAL(test->data, value->data, value->length);
   CU_ASSERT_STRING_EQUAL(test->data, "hello");
   CU_ASSERT_EQUAL(test->length, value->length);
+  CALL(store, unlock);
 
   /* Check that setting again displaces old values. */
   CALL(store, set, "url", "attribute", value1);
+
+  CALL(store, lock);
+  test = CALL(store, get, "url", "attribute");
+  CU_ASSERT_STRING_EQUAL(test->data, "world");
+
+  /* A thread can not write to a store it has locked */
+  CALL(store, set, "url", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("again"), "xsd:string"));
+  CU_ASSERT_TRUE(CheckError(EProgrammingError));
+  ClearError();
+
   test = CALL(store, get, "url", "attribute");
   CU_ASSERT_STRING_EQUAL(test->data, "world");
 
@@ -53,14 +67,12 @@ TEST(MemoryDataStoreTestAdd) {
 
   Object iter;
 
-  /* Lock the store */
-  CALL(store, lock);
-
   /* Check that we can set and get the same string */
   CALL(store, set, "url", "attribute", value);
   CALL(store, add, "url", "attribute", value1);
 
   /* Now iterate */
+  CALL(store, lock);
   iter = CALL(store, iter, "url", "attribute");
   CU_ASSERT_PTR_NOT_NULL(iter);
 
@@ -77,6 +89,221 @@ TEST(MemoryDataStoreTestAdd) {
   aff4_free(store);
 };
 
+TEST(MemoryDataStoreTestAttributes) {
+  DataStore store = new_MemoryDataStore(NULL);
+  Object iter;
+
+  CALL(store, add, "url", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("hello"), "xsd:string"));
+  CALL(store, add, "url", "attribute2",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("world"), "xsd:string"));
+  CALL(store, add, "url", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("again"), "xsd:string"));
+  CALL(store, set, "url2", "attribute3",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("foo"), "xsd:string"));
+
+  /* Each attribute is listed once, in the order it was added */
+  CALL(store, lock);
+  iter = CALL(store, iter_attributes, "url");
+  CU_ASSERT_STRING_EQUAL(CALL(store, next_attribute, &iter), "attribute");
+  CU_ASSERT_STRING_EQUAL(CALL(store, next_attribute, &iter), "attribute2");
+  CU_ASSERT_PTR_NULL(iter);
+  CALL(store, unlock);
+
+  /* Setting a deleted attribute again does not list it twice */
+  CALL(store, del, "url2", "attribute3");
+  CALL(store, set, "url2", "attribute3",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("bar"), "xsd:string"));
+
+  CALL(store, lock);
+  iter = CALL(store, iter_attributes, "url2");
+  CU_ASSERT_STRING_EQUAL(CALL(store, next_attribute, &iter), "attribute3");
+  CU_ASSERT_PTR_NULL(iter);
+
+  CU_ASSERT_PTR_NULL(CALL(store, iter_attributes, "url3"));
+
+  CALL(store, unlock);
+  aff4_free(store);
+};
+
+
+/**********************************************
+Test TDBDataStore object
+***********************************************/
+TEST(TDBDataStoreTest) {
+  char *filename = talloc_asprintf(NULL, "%s/aff4_test_store.tdb", TEMP_DIR);
+  DataStore store;
+  DataStoreObject test;
+  Object iter;
+
+  unlink(filename);
+  store = new_TDBDataStore(NULL, filename);
+  CU_ASSERT_PTR_NOT_NULL(store);
+
+  CALL(store, lock);
+  CALL(store, set, "url", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("hello"), "xsd:string"));
+  CALL(store, add, "url", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("world"), "xsd:string"));
+
+  test = CALL(store, get, "url", "attribute");
+  CU_ASSERT_STRING_EQUAL(test->data, "hello");
+  CU_ASSERT_STRING_EQUAL(test->rdf_type, "xsd:string");
+  CALL(store, unlock);
+
+  aff4_free(store);
+
+  /* The data should still be there when we open it again */
+  store = new_TDBDataStore(NULL, filename);
+  CALL(store, lock);
+
+  iter = CALL(store, iter, "url", "attribute");
+  CU_ASSERT_PTR_NOT_NULL(iter);
+
+  test = CALL(store, next, &iter);
+  CU_ASSERT_STRING_EQUAL(test->data, "hello");
+  CU_ASSERT_PTR_NOT_NULL(iter);
+
+  test = CALL(store, next, &iter);
+  CU_ASSERT_STRING_EQUAL(test->data, "world");
+  CU_ASSERT_PTR_NULL(iter);
+
+  iter = CALL(store, iter_attributes, "url");
+  CU_ASSERT_STRING_EQUAL(CALL(store, next_attribute, &iter), "attribute");
+  CU_ASSERT_PTR_NULL(iter);
+
+  /* Deleting removes all values */
+  CALL(store, del, "url", "attribute");
+  CU_ASSERT_PTR_NULL(CALL(store, get, "url", "attribute"));
+  CU_ASSERT_PTR_NULL(CALL(store, iter, "url", "attribute"));
+
+  /* Setting it again lists the attribute only once. */
+  CALL(store, set, "url", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                 ZSTRING("again"), "xsd:string"));
+
+  iter = CALL(store, iter_attributes, "url");
+  CU_ASSERT_STRING_EQUAL(CALL(store, next_attribute, &iter), "attribute");
+  CU_ASSERT_PTR_NULL(iter);
+  CALL(store, unlock);
+
+  /* A value set again after it was deleted is only written once. */
+  {
+    Resolver resolver = AFF4_get_resolver(store, NULL);
+    RDFURN urn = new_RDFURN(resolver);
+    XSDString value = new_XSDString(resolver);
+    FileLikeObject fd;
+    RDFSerializer serializer;
+    char buffer[BUFF_SIZE];
+    int length;
+
+    CALL(urn, set, "aff4://subject");
+    CALL(value, set, ZSTRING_NO_NULL("first"));
+    CALL(resolver, set, urn, PREDICATE_NAMESPACE "description", (RDFValue)value);
+    CALL(resolver, del, urn, PREDICATE_NAMESPACE "description");
+
+    CALL(value, set, ZSTRING_NO_NULL("second"));
+    CALL(resolver, set, urn, PREDICATE_NAMESPACE "description", (RDFValue)value);
+
+    CALL(urn, set, TEMP_DIR);
+    CALL(urn, add, "del_set.turtle");
+    fd = (FileLikeObject)CALL(resolver, create, urn, AFF4_FILE, 'w');
+    CU_ASSERT_FATAL(CALL((AFFObject)fd, finish));
+
+    serializer = CONSTRUCT(RDFSerializer, RDFSerializer, Con, resolver,
+                           "aff4://", fd, resolver);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(serializer);
+
+    CALL(urn, set, "aff4://subject");
+    CALL(serializer, serialize_urn, urn);
+    CALL(serializer, close);
+
+    CALL(fd, seek, 0, SEEK_SET);
+    length = CALL(fd, read, buffer, BUFF_SIZE - 1);
+    CU_ASSERT_FATAL(length > 0);
+    buffer[length] = 0;
+
+    CU_ASSERT_PTR_NOT_NULL(strstr(buffer, "second"));
+    CU_ASSERT_PTR_NULL(strstr(strstr(buffer, "second") + 1, "second"));
+    CU_ASSERT_PTR_NULL(strstr(buffer, "first"));
+
+    CALL((AFFObject)fd, close);
+
+    // The resolver owns the store now.
+    talloc_free(resolver);
+  };
+
+  unlink(filename);
+  talloc_free(filename);
+};
+
+
+/**********************************************
+Test SnapshotDataStore object
+***********************************************/
+TEST(SnapshotDataStoreTest) {
+  char *filename = talloc_asprintf(NULL, "%s/aff4_test_store.snapshot", TEMP_DIR);
+  MemoryDataStore memory = (MemoryDataStore)new_MemoryDataStore(NULL);
+  DataStore store;
+  DataStoreObject test;
+  Object iter;
+
+  CALL((DataStore)memory, set, "url", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, memory,
+                 ZSTRING("hello"), "xsd:string"));
+  CALL((DataStore)memory, add, "url", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, memory,
+                 ZSTRING("world"), "xsd:string"));
+  CALL((DataStore)memory, set, "url2", "attribute",
+       CONSTRUCT(DataStoreObject, DataStoreObject, Con, memory,
+                 ZSTRING("foo"), "xsd:string"));
+
+  CU_ASSERT(CALL(memory, snapshot, filename, NULL));
+  aff4_free(memory);
+
+  store = new_SnapshotDataStore(NULL, filename);
+  CU_ASSERT_PTR_NOT_NULL(store);
+  CALL(store, lock);
+
+  /* Values come back in the order they were added */
+  iter = CALL(store, iter, "url", "attribute");
+  test = CALL(store, next, &iter);
+  CU_ASSERT_STRING_EQUAL(test->data, "hello");
+  CU_ASSERT_STRING_EQUAL(test->rdf_type, "xsd:string");
+  test = CALL(store, next, &iter);
+  CU_ASSERT_STRING_EQUAL(test->data, "world");
+  CU_ASSERT_PTR_NULL(iter);
+
+  test = CALL(store, get, "url2", "attribute");
+  CU_ASSERT_STRING_EQUAL(test->data, "foo");
+
+  CU_ASSERT_PTR_NULL(CALL(store, get, "url3", "attribute"));
+  CU_ASSERT_PTR_NULL(CALL(store, iter, "url", "missing"));
+
+  iter = CALL(store, iter_attributes, "url");
+  CU_ASSERT_STRING_EQUAL(CALL(store, next_attribute, &iter), "attribute");
+  CU_ASSERT_PTR_NULL(iter);
+
+  /* Subjects are found by scanning the triples. */
+  test = CONSTRUCT(DataStoreObject, DataStoreObject, Con, store,
+                   ZSTRING("world"), "xsd:string");
+  iter = CALL(store, iter_subjects, "attribute", test);
+  CU_ASSERT_STRING_EQUAL(CALL(store, next_subject, &iter), "url");
+  CU_ASSERT_PTR_NULL(iter);
+
+  CALL(store, unlock);
+  aff4_free(store);
+  unlink(filename);
+  talloc_free(filename);
+};
+
 
 /**********************************************
 Test Resolver object
@@ -98,3 +325,345 @@ TEST(AFF4ResolverTest) {
 
   aff4_free(resolver);
 };
+
+TEST(AFF4ResolverBatchTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(resolver);
+  XSDString value = new_XSDString(resolver);
+  XSDString test;
+
+  urn->set(urn, "http://www.test.com/foobar");
+
+  value->set(value, ZSTRING("hello"));
+  CALL(resolver, batch_add, urn, "attribute", (RDFValue)value);
+
+  value->set(value, ZSTRING("world"));
+  CALL(resolver, batch_add, urn, "attribute", (RDFValue)value);
+  CU_ASSERT_EQUAL(resolver->batch_count, 2);
+
+  /* Resolving flushes the batch - the values keep their order. */
+  test = (XSDString)CALL(resolver, resolve, resolver, urn, "attribute");
+  CU_ASSERT_EQUAL(resolver->batch_count, 0);
+  CU_ASSERT_STRING_EQUAL(test->value, "hello");
+
+  test = (XSDString)list_entry(((RDFValue)test)->list.next, struct RDFValue_t, list);
+  CU_ASSERT_STRING_EQUAL(test->value, "world");
+
+  aff4_free(resolver);
+};
+
+TEST(AFF4ResolverBatchFreeTest) {
+  char *filename = talloc_asprintf(NULL, "%s/aff4_test_batch.tdb", TEMP_DIR);
+  Resolver resolver;
+  RDFURN urn;
+  XSDString value;
+  DataStore store;
+  DataStoreObject test;
+
+  unlink(filename);
+  resolver = AFF4_get_resolver(new_TDBDataStore(NULL, filename), NULL);
+  urn = new_RDFURN(resolver);
+  value = new_XSDString(resolver);
+
+  urn->set(urn, "http://www.test.com/foobar");
+  value->set(value, ZSTRING("hello"));
+  CALL(resolver, batch_add, urn, "attribute", (RDFValue)value);
+  CU_ASSERT_EQUAL(resolver->batch_count, 1);
+
+  /* Freeing the resolver flushes the queued triples to the store */
+  aff4_free(resolver);
+
+  store = new_TDBDataStore(NULL, filename);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(store);
+
+  CALL(store, lock);
+  test = CALL(store, get, "http://www.test.com/foobar", "attribute");
+  CU_ASSERT_PTR_NOT_NULL(test);
+  if(test)
+    CU_ASSERT_STRING_EQUAL(test->data, "hello");
+  CALL(store, unlock);
+
+  aff4_free(store);
+  unlink(filename);
+  talloc_free(filename);
+};
+
+TEST(AFF4ResolverAtomTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(resolver);
+  XSDInteger value = new_XSDInteger(resolver);
+  uint32_t urn_atom, attribute_atom;
+
+  urn->set(urn, "http://www.test.com/foobar");
+
+  urn_atom = CALL(resolver, intern, urn->value);
+  attribute_atom = CALL(resolver, intern, "attribute");
+  CU_ASSERT_NOT_EQUAL(urn_atom, 0);
+  CU_ASSERT_NOT_EQUAL(urn_atom, attribute_atom);
+
+  /* Interning again gives the same atom */
+  CU_ASSERT_EQUAL(CALL(resolver, intern, "attribute"), attribute_atom);
+
+  /* Values set with atoms can be resolved with strings and atoms */
+  value->set(value, 42);
+  CALL(resolver, set_atom, urn_atom, attribute_atom, (RDFValue)value);
+
+  value = (XSDInteger)CALL(resolver, resolve, resolver, urn, "attribute");
+  CU_ASSERT_EQUAL(value->value, 42);
+
+  value = (XSDInteger)CALL(resolver, resolve_atom, resolver, urn_atom, attribute_atom);
+  CU_ASSERT_EQUAL(value->value, 42);
+
+  /* Unknown atoms are an error */
+  CU_ASSERT_EQUAL(CALL(resolver, set_atom, 1000, attribute_atom, (RDFValue)value), 0);
+  ClearError();
+
+  aff4_free(resolver);
+};
+
+TEST(AFF4ResolverIndexTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(resolver);
+  RDFURN volume = new_RDFURN(resolver);
+  RDFURN result;
+
+  volume->set(volume, "aff4://volume");
+
+  urn->set(urn, "aff4://stream1");
+  CALL(resolver, set, urn, AFF4_STORED, (RDFValue)volume);
+
+  urn->set(urn, "aff4://stream2");
+  CALL(resolver, set, urn, AFF4_STORED, (RDFValue)volume);
+
+  /* Both streams are found in the order they were added */
+  result = CALL(resolver, resolve_subjects, resolver, AFF4_STORED, (RDFValue)volume);
+  CU_ASSERT_STRING_EQUAL(result->value, "aff4://stream1");
+
+  result = (RDFURN)list_entry(((RDFValue)result)->list.next, struct RDFValue_t, list);
+  CU_ASSERT_STRING_EQUAL(result->value, "aff4://stream2");
+
+  /* Removing the value removes it from the index */
+  CALL(resolver, del, urn, AFF4_STORED);
+  result = CALL(resolver, resolve_subjects, resolver, AFF4_STORED, (RDFValue)volume);
+  CU_ASSERT_STRING_EQUAL(result->value, "aff4://stream1");
+  CU_ASSERT_EQUAL(((RDFValue)result)->list.next, &((RDFValue)result)->list);
+
+  aff4_free(resolver);
+};
+
+TEST(AFF4ResolverResolveValueTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(resolver);
+  XSDInteger value = new_XSDInteger(resolver);
+  XSDString string = new_XSDString(resolver);
+  uint64_t result = 0;
+
+  urn->set(urn, "http://www.test.com/foobar");
+
+  value->set(value, 32768);
+  CALL(resolver, set, urn, AFF4_CHUNK_SIZE, (RDFValue)value);
+
+  string->set(string, ZSTRING_NO_NULL("hello"));
+  CALL(resolver, set, urn, "attribute", (RDFValue)string);
+
+  /* Decode into an existing value */
+  value->set(value, 0);
+  CU_ASSERT_EQUAL(CALL(resolver, resolve_value, urn, AFF4_CHUNK_SIZE,
+                       (RDFValue)value), 1);
+  CU_ASSERT_EQUAL(value->value, 32768);
+
+  CU_ASSERT_EQUAL(CALL(resolver, resolve_uint64, urn, AFF4_CHUNK_SIZE, &result), 1);
+  CU_ASSERT_EQUAL(result, 32768);
+
+  /* The types must match */
+  CU_ASSERT_EQUAL(CALL(resolver, resolve_uint64, urn, "attribute", &result), 0);
+  CU_ASSERT_EQUAL(CALL(resolver, resolve_value, urn, "attribute",
+                       (RDFValue)value), 0);
+
+  aff4_free(resolver);
+};
+
+struct concurrent_read_t {
+  Resolver resolver;
+  RDFURN urn;
+  uint64_t value;
+  int found;
+  volatile int done;
+};
+
+static void *concurrent_reader(void *data) {
+  struct concurrent_read_t *job = (struct concurrent_read_t *)data;
+
+  job->found = CALL(job->resolver, resolve_uint64, job->urn, AFF4_CHUNK_SIZE,
+                    &job->value);
+  job->done = 1;
+
+  return NULL;
+};
+
+/* Integer lookups do not wait for the global lock. */
+TEST(AFF4ResolverConcurrentReadTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  struct concurrent_read_t job;
+  pthread_t thread;
+  int i;
+
+  memset(&job, 0, sizeof(job));
+  job.resolver = resolver;
+  job.urn = new_RDFURN(resolver);
+  CALL(job.urn, set, "http://www.test.com/foobar");
+  CALL(resolver, set, job.urn, AFF4_CHUNK_SIZE, rdfvalue_from_int(resolver, 32768));
+
+  AFF4_GL_LOCK;
+  pthread_create(&thread, NULL, concurrent_reader, &job);
+
+  for(i=0; i<500 && !job.done; i++)
+    usleep(10000);
+
+  CU_ASSERT(job.done);
+  AFF4_GL_UNLOCK;
+
+  pthread_join(thread, NULL);
+  CU_ASSERT_EQUAL(job.found, 1);
+  CU_ASSERT_EQUAL(job.value, 32768);
+
+  aff4_free(resolver);
+};
+
+/* The Turtle AFF4 writes is parsed without raptor. */
+TEST(RDFParserNativeTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(resolver);
+  RDFParser parser = CONSTRUCT(RDFParser, RDFParser, Con, resolver, resolver);
+  FileLikeObject fd;
+  XSDInteger value = new_XSDInteger(resolver);
+  RDFURN stored = new_RDFURN(resolver);
+  char *turtle =
+    "@prefix aff4: <" PREDICATE_NAMESPACE "> .\n"
+    "@prefix xsd: <" XSD_NAMESPACE "> .\n"
+    "# A comment\n"
+    "<image> aff4:stored <> ;\n"
+    "    aff4:size \"12000\"^^xsd:integer, 5 .\n";
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "information.turtle");
+
+  fd = (FileLikeObject)CALL(resolver, create, urn, AFF4_FILE, 'w');
+  CALL((AFFObject)fd, finish);
+  CALL(fd, write, ZSTRING_NO_NULL(turtle));
+  CALL(fd, seek, 0, SEEK_SET);
+
+  CU_ASSERT_EQUAL(CALL(parser, parse, fd, "turtle", "aff4://volume"), 1);
+
+  CALL(urn, set, "aff4://volume/image");
+  CU_ASSERT_EQUAL(CALL(resolver, resolve_value, urn, AFF4_STORED,
+                       (RDFValue)stored), 1);
+  CU_ASSERT_STRING_EQUAL(stored->value, "aff4://volume");
+
+  /* Both values are kept, in order. */
+  value = (XSDInteger)CALL(resolver, resolve, resolver, urn, AFF4_SIZE);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(value);
+  CU_ASSERT_EQUAL(value->value, 12000);
+
+  value = (XSDInteger)list_entry(((RDFValue)value)->list.next, struct RDFValue_t, list);
+  CU_ASSERT_STRING_EQUAL(NAMEOF(value), "XSDInteger");
+  CU_ASSERT_EQUAL(value->value, 5);
+
+  CALL((AFFObject)fd, close);
+  aff4_free(resolver);
+};
+
+/* Documents outside the native parser's subset still load through
+   raptor.
+*/
+TEST(RDFParserFallbackTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(resolver);
+  RDFParser parser = CONSTRUCT(RDFParser, RDFParser, Con, resolver, resolver);
+  FileLikeObject fd;
+  XSDInteger value = new_XSDInteger(resolver);
+  XSDString description = new_XSDString(resolver);
+  char *turtle =
+    "@prefix aff4: <" PREDICATE_NAMESPACE "> .\n"
+    "@prefix xsd: <" XSD_NAMESPACE "> .\n"
+    "<aff4://volume/image> aff4:size \"12000\"^^xsd:integer ;\n"
+    "    aff4:description \"\"\"A long\nstring\"\"\" .\n";
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "fallback.turtle");
+
+  fd = (FileLikeObject)CALL(resolver, create, urn, AFF4_FILE, 'w');
+  CALL((AFFObject)fd, finish);
+  CALL(fd, write, ZSTRING_NO_NULL(turtle));
+  CALL(fd, seek, 0, SEEK_SET);
+
+  CU_ASSERT_EQUAL(CALL(parser, parse, fd, "turtle", "aff4://volume"), 1);
+
+  CALL(urn, set, "aff4://volume/image");
+  CU_ASSERT_EQUAL(CALL(resolver, resolve_value, urn, AFF4_SIZE,
+                       (RDFValue)value), 1);
+  CU_ASSERT_EQUAL(value->value, 12000);
+
+  CU_ASSERT_EQUAL(CALL(resolver, resolve_value, urn,
+                       PREDICATE_NAMESPACE "description",
+                       (RDFValue)description), 1);
+  CU_ASSERT_STRING_EQUAL(description->value, "A long\nstring");
+
+  CALL((AFFObject)fd, close);
+  aff4_free(resolver);
+};
+
+/* Values of XSDInteger subclasses are written as varints, not in the
+   host's byte order.
+*/
+TEST(RDFBinarySerializerTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  Resolver reader = AFF4_get_resolver(NULL, NULL);
+  RDFURN urn = new_RDFURN(resolver);
+  XSDDatetime time = new_XSDDateTime(resolver);
+  XSDDatetime result = new_XSDDateTime(reader);
+  uint64_t value = 1234567890123456LL;
+  RDFBinarySerializer serializer;
+  RDFParser parser;
+  FileLikeObject fd;
+  char buffer[BUFF_SIZE];
+  int length, i, raw = 0;
+
+  CALL(urn, set, "aff4://subject");
+  ((XSDInteger)time)->value = value;
+  CALL(resolver, set, urn, AFF4_TIMESTAMP, (RDFValue)time);
+
+  CALL(urn, set, TEMP_DIR);
+  CALL(urn, add, "graph.binary");
+  fd = (FileLikeObject)CALL(resolver, create, urn, AFF4_FILE, 'w');
+  CU_ASSERT_FATAL(CALL((AFFObject)fd, finish));
+  CALL(fd, truncate, 0);
+
+  serializer = CONSTRUCT(RDFBinarySerializer, RDFBinarySerializer, Con, resolver,
+                         fd, resolver);
+  CALL(urn, set, "aff4://subject");
+  CU_ASSERT(CALL(serializer, serialize_urn, urn));
+  CALL(serializer, close);
+
+  CALL(fd, seek, 0, SEEK_SET);
+  length = CALL(fd, read, buffer, BUFF_SIZE);
+  CU_ASSERT_FATAL(length > 0);
+
+  for(i=0; i + sizeof(value) <= length; i++) {
+    if(!memcmp(buffer + i, &value, sizeof(value)))
+      raw = 1;
+  };
+  CU_ASSERT_FALSE(raw);
+
+  CALL(fd, seek, 0, SEEK_SET);
+  parser = CONSTRUCT(RDFParser, RDFParser, Con, reader, reader);
+  CU_ASSERT_EQUAL(CALL(parser, parse, fd, RDF_BINARY_FORMAT, "aff4://volume"), 1);
+
+  CU_ASSERT_EQUAL(CALL(reader, resolve_value, urn, AFF4_TIMESTAMP,
+                       (RDFValue)result), 1);
+  CU_ASSERT_EQUAL(((XSDInteger)result)->value, value);
+
+  CALL((AFFObject)fd, close);
+  aff4_free(reader);
+  aff4_free(resolver);
+};
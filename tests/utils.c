@@ -85,6 +85,46 @@ TEST(CacheTestExpiry) {
   aff4_free(test);
 };
 
+/* Check that the hash table grows and we can still find everything */
+TEST(CacheTestRehash) {
+  Cache test = CONSTRUCT(Cache, Cache, Con, NULL, 16, 0);
+  unsigned int width = test->hash_table_width;
+  Object iter;
+  char key[100];
+  int i;
+
+  for(i=0; i < 10000; i++) {
+    snprintf(key, sizeof(key), "aff4://%d", i);
+    test->put(test, ZSTRING(key), (Object)talloc_strdup(NULL, key));
+  };
+
+  // Several objects with the same key
+  for(i=0; i < 5; i++) {
+    test->put(test, ZSTRING("duplicate"), (Object)talloc_asprintf(NULL, "%d", i));
+  };
+
+  CU_ASSERT(test->hash_table_width > width);
+  CU_ASSERT_EQUAL(test->cache_size, 10005);
+
+  for(i=0; i < 10000; i++) {
+    snprintf(key, sizeof(key), "aff4://%d", i);
+    CU_ASSERT_STRING_EQUAL((char *)test->borrow(test, ZSTRING(key)), key);
+  };
+
+  // The iterator returns them in the order they were added
+  iter = test->iter(test, ZSTRING("duplicate"));
+  for(i=0; i < 5; i++) {
+    char *value = (char *)test->next(test, &iter);
+
+    CU_ASSERT_PTR_NOT_NULL(value);
+    if(value)
+      CU_ASSERT_EQUAL(atoi(value), i);
+  };
+  CU_ASSERT_PTR_NULL(iter);
+
+  aff4_free(test);
+};
+
 
 static int time_difference(struct timeval *prev, struct timeval *now) {
   uint64_t prev_usec = prev->tv_sec * 1000000 + prev->tv_usec;
@@ -133,10 +173,53 @@ TEST(QueueTest) {
 };
 
 
+/*********************************************
+  Tests the lock free ring queue.
+*********************************************/
+TEST(RingQueueTest) {
+  RingQueue queue = CONSTRUCT(RingQueue, RingQueue, Con, NULL, 3);
+  int timeout = 1000000;
+  struct timeval now, prev;
+  char *items[] = {"1", "2", "3", "4", "5"};
+  int i;
+
+  /* The size is rounded up to a power of 2 */
+  for(i=0; i<4; i++) {
+    CU_ASSERT(1 == CALL(queue, try_put, items[i]));
+  };
+
+  /* This should now fail because the queue is full */
+  CU_ASSERT(0 == CALL(queue, try_put, items[4]));
+
+  gettimeofday(&prev, NULL);
+  CU_ASSERT(0 == CALL(queue, put, items[4], timeout));
+  gettimeofday(&now, NULL);
+  CU_ASSERT(time_difference(&prev, &now) >= timeout);
+
+  /* Items come out in order */
+  CU_ASSERT_STRING_EQUAL("1", CALL(queue, get, timeout));
+  CU_ASSERT(1 == CALL(queue, put, items[4], timeout));
+
+  for(i=1; i<5; i++) {
+    CU_ASSERT_STRING_EQUAL(items[i], CALL(queue, get, timeout));
+  };
+
+  /* Nothing left */
+  CU_ASSERT(NULL == CALL(queue, try_get));
+
+  gettimeofday(&prev, NULL);
+  CU_ASSERT(NULL == CALL(queue, get, timeout));
+  gettimeofday(&now, NULL);
+  CU_ASSERT(time_difference(&prev, &now) >= timeout);
+
+  talloc_free(queue);
+};
+
+
 /*********************************************
   Tests the thread pool implementation.
 *********************************************/
-static int results[10] = {0, 0};
+static int results[16] = {0, 0};
 
 CLASS(TestThreadPoolJob, ThreadPoolJob)
     int number;
@@ -192,3 +275,122 @@ TEST(ThreadPoolTest) {
 
   talloc_free(pool);
 };
+
+
+/* Jobs can be waited on individually and are completed in the main
+   thread.
+*/
+TEST(ThreadPoolCompleteTest) {
+  ThreadPool pool = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL, 2);
+  ThreadPoolJob jobs[3];
+  int i;
+
+  TestThreadPoolJob_init((Object)&__TestThreadPoolJob);
+
+  for(i=0; i<3; i++) {
+    jobs[i] = (ThreadPoolJob)CONSTRUCT(TestThreadPoolJob, TestThreadPoolJob,
+                                       Con, NULL, i + 5);
+    CU_ASSERT(CALL(pool, schedule, jobs[i], 2) == 1);
+  };
+
+  /* Nothing is finished yet */
+  CU_ASSERT_EQUAL(CALL(pool, complete, NULL), 0);
+
+  for(i=0; i<3; i++) {
+    CU_ASSERT_EQUAL(CALL(jobs[i], wait, 5), 1);
+    CU_ASSERT_EQUAL(results[i + 5], 1);
+  };
+
+  /* Now they are all done and get freed. */
+  CU_ASSERT_EQUAL(CALL(pool, complete, NULL), 3);
+  CU_ASSERT_EQUAL(CALL(pool, complete, NULL), 0);
+
+  CALL(pool, join);
+  talloc_free(pool);
+};
+
+/* A shared pool only completes the caller's own jobs. */
+TEST(ThreadPoolOwnerTest) {
+  ThreadPool pool = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL, 2);
+  ThreadPoolJob jobs[2];
+  int owners[2];
+  int i;
+
+  TestThreadPoolJob_init((Object)&__TestThreadPoolJob);
+
+  for(i=0; i<2; i++) {
+    jobs[i] = (ThreadPoolJob)CONSTRUCT(TestThreadPoolJob, TestThreadPoolJob,
+                                       Con, NULL, i + 8);
+    jobs[i]->owner = &owners[i];
+    CU_ASSERT(CALL(pool, schedule, jobs[i], 2) == 1);
+  };
+
+  for(i=0; i<2; i++)
+    CU_ASSERT_EQUAL(CALL(jobs[i], wait, 5), 1);
+
+  CU_ASSERT_EQUAL(CALL(pool, complete, NULL), 0);
+  CU_ASSERT_EQUAL(CALL(pool, complete, &owners[1]), 1);
+  CU_ASSERT_EQUAL(CALL(pool, complete, &owners[0]), 1);
+  CU_ASSERT_EQUAL(CALL(pool, complete, &owners[0]), 0);
+
+  CALL(pool, join);
+  talloc_free(pool);
+};
+
+/* Jobs which can not be queued in time are run by the caller rather
+   than dropped.
+*/
+TEST(ThreadPoolTimeoutTest) {
+  ThreadPool pool = CONSTRUCT(ThreadPool, ThreadPool, Con, NULL, 1);
+  int i;
+
+  TestThreadPoolJob_init((Object)&__TestThreadPoolJob);
+
+  for(i=10; i<15; i++) {
+    ThreadPoolJob job = (ThreadPoolJob)CONSTRUCT(
+        TestThreadPoolJob, TestThreadPoolJob, Con, NULL, i);
+
+    CU_ASSERT(CALL(pool, schedule, job, 0) == 1);
+  };
+
+  CALL(pool, join);
+
+  for(i=10; i<15; i++) {
+    CU_ASSERT_EQUAL(results[i], 1);
+  };
+
+  talloc_free(pool);
+};
+
+
+/*********************************************
+  Tests thread local arenas.
+*********************************************/
+static void *arena_worker(void *data) {
+  void *shared = data;
+  char *result;
+
+  /* This is allowed without the global lock. */
+  result = talloc_strdup(aff4_arena(), "from a thread");
+  talloc_strdup(aff4_arena(), "scratch");
+
+  aff4_arena_handoff(shared, result);
+  aff4_arena_reset();
+
+  return result;
+};
+
+TEST(ArenaTest) {
+  void *shared = talloc_named_const(NULL, 0, "shared");
+  pthread_t thread;
+  char *result;
+
+  pthread_create(&thread, NULL, arena_worker, shared);
+  pthread_join(thread, (void **)&result);
+
+  /* The result survived the arena reset and the thread exiting. */
+  CU_ASSERT_STRING_EQUAL(result, "from a thread");
+  CU_ASSERT_PTR_EQUAL(talloc_parent(result), shared);
+
+  talloc_free(shared);
+};
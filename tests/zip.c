@@ -6,6 +6,9 @@ This file tests the zip file volume implementation.
 
 extern char TEMP_DIR[];
 
+/* More readers than the resolver keeps idle */
+#define ZIP_TEST_READERS 25
+
 TEST(ZipTestWriter) {
   Resolver resolver = AFF4_get_resolver(NULL, NULL);
   ZipFile zip;
@@ -67,3 +70,251 @@ TEST(ZipTestReader) {
   talloc_free(zip);
   talloc_free(resolver);
 };
+
+TEST(ZipInformationTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip;
+  RDFURN urn, volume;
+  uint64_t size = 0;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "InformationTest.zip");
+  CALL((AFFObject)zip, finish);
+
+  volume = CALL(URNOF(zip), copy, resolver);
+  urn = CALL(volume, copy, resolver);
+  CALL(urn, add, "stream");
+
+  // The stream's attributes are written with the volume, except the
+  // volatile ones.
+  CALL(resolver, set, urn, AFF4_STORED, (RDFValue)volume);
+  CALL(resolver, set, urn, AFF4_SIZE, rdfvalue_from_int(urn, 1LL << 40));
+  CALL(resolver, set, urn, AFF4_VOLATILE_SIZE, rdfvalue_from_int(urn, 5));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+  talloc_free(resolver);
+
+  // A new resolver only knows what it loads from the volume.
+  resolver = AFF4_get_resolver(NULL, NULL);
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "InformationTest.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  urn = CALL(URNOF(zip), copy, resolver);
+  CALL(urn, add, "stream");
+
+  CU_ASSERT(CALL(resolver, resolve_uint64, urn, AFF4_SIZE, &size));
+  CU_ASSERT_EQUAL(size, 1LL << 40);
+  CU_ASSERT(!CALL(resolver, resolve_uint64, urn, AFF4_VOLATILE_SIZE, &size));
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+  talloc_free(resolver);
+};
+
+/* Stores without an index still find the streams in the volume. */
+TEST(ZipTDBInformationTest) {
+  char *filename = talloc_asprintf(NULL, "%s/zip_test_store.tdb", TEMP_DIR);
+  Resolver resolver;
+  ZipFile zip;
+  RDFURN urn, volume;
+  uint64_t size = 0;
+
+  unlink(filename);
+  resolver = AFF4_get_resolver(new_TDBDataStore(NULL, filename), NULL);
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "TDBInformationTest.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  volume = CALL(URNOF(zip), copy, resolver);
+  urn = CALL(volume, copy, resolver);
+  CALL(urn, add, "stream");
+
+  CALL(resolver, set, urn, AFF4_STORED, (RDFValue)volume);
+  CALL(resolver, set, urn, AFF4_SIZE, rdfvalue_from_int(urn, 5));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  CU_ASSERT_EQUAL(CALL((AFFObject)zip, close), 1);
+  talloc_free(zip);
+  talloc_free(resolver);
+  unlink(filename);
+  talloc_free(filename);
+
+  resolver = AFF4_get_resolver(NULL, NULL);
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "TDBInformationTest.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  urn = CALL(URNOF(zip), copy, resolver);
+  CALL(urn, add, "stream");
+
+  CU_ASSERT(CALL(resolver, resolve_uint64, urn, AFF4_SIZE, &size));
+  CU_ASSERT_EQUAL(size, 5);
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+  talloc_free(resolver);
+};
+
+TEST(ZipLazyInformationTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip;
+  RDFURN a, b, volume;
+  uint64_t size = 0;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "LazyTest.zip");
+  CALL((AFFObject)zip, finish);
+
+  volume = CALL(URNOF(zip), copy, resolver);
+  a = CALL(volume, copy, resolver);
+  CALL(a, add, "a");
+  b = CALL(volume, copy, resolver);
+  CALL(b, add, "b");
+
+  CALL(resolver, set, a, AFF4_STORED, (RDFValue)volume);
+  CALL(resolver, set, a, AFF4_SIZE, rdfvalue_from_int(a, 1));
+  CALL(resolver, set, b, AFF4_STORED, (RDFValue)volume);
+  CALL(resolver, set, b, AFF4_SIZE, rdfvalue_from_int(b, 2));
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+  talloc_free(resolver);
+
+  resolver = CONSTRUCT(Resolver, Resolver, Con, NULL, NULL, RESOLVER_MODE_LAZY);
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'r');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "LazyTest.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  a = CALL(URNOF(zip), copy, resolver);
+  CALL(a, add, "a");
+  b = CALL(URNOF(zip), copy, resolver);
+  CALL(b, add, "b");
+
+  // Nothing is decoded until a subject is used.
+  CU_ASSERT(CALL(resolver->store, iter_attributes, a->value) == NULL);
+
+  CU_ASSERT(CALL(resolver, resolve_uint64, a, AFF4_SIZE, &size));
+  CU_ASSERT_EQUAL(size, 1);
+  CU_ASSERT(CALL(resolver->store, iter_attributes, b->value) == NULL);
+
+  CU_ASSERT(CALL(resolver, resolve_uint64, b, AFF4_SIZE, &size));
+  CU_ASSERT_EQUAL(size, 2);
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+  talloc_free(resolver);
+};
+
+/* A volume opened without a storage_urn is found through the
+   resolver.
+*/
+TEST(ZipStoredTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip;
+  RDFURN volume, urn;
+  FileLikeObject segment;
+  char buffer[BUFF_SIZE];
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "StoredTest.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  volume = CALL(URNOF(zip), copy, resolver);
+  urn = CALL(volume, copy, resolver);
+  CALL(urn, add, "foobar");
+
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_DEFLATE);
+  CALL(segment, write, ZSTRING_NO_NULL("hello"));
+  CALL((AFFObject)segment, close);
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, volume, AFF4_ZIP_VOLUME, 'r');
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+  CU_ASSERT(strstr(zip->storage_urn->value, "StoredTest.zip") != NULL);
+
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+  CU_ASSERT_EQUAL(CALL(segment, read, buffer, BUFF_SIZE), 5);
+
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+  talloc_free(resolver);
+};
+
+/* Returning many readers must not expire the volumes they live in. */
+TEST(ZipManagedTest) {
+  Resolver resolver = AFF4_get_resolver(NULL, NULL);
+  ZipFile zip;
+  RDFURN volume, urn;
+  FileLikeObject segment, readers[ZIP_TEST_READERS];
+  AFFObject fd;
+  char buffer[BUFF_SIZE];
+  int i;
+
+  zip = (ZipFile)CALL(resolver, create, NULL, AFF4_ZIP_VOLUME, 'w');
+  CALL(zip->storage_urn, set, TEMP_DIR);
+  CALL(zip->storage_urn, add, "ManagedTest.zip");
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+
+  volume = CALL(URNOF(zip), copy, resolver);
+  urn = CALL(volume, copy, resolver);
+  CALL(urn, add, "foobar");
+
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'w', ZIP_DEFLATE);
+  CALL(segment, write, ZSTRING_NO_NULL("hello"));
+  CALL((AFFObject)segment, close);
+
+  CALL(resolver, cache_return, (AFFObject)zip);
+  CALL((AFFObject)zip, close);
+  talloc_free(zip);
+
+  zip = (ZipFile)CALL(resolver, create, volume, AFF4_ZIP_VOLUME, 'r');
+  CU_ASSERT_FATAL(CALL((AFFObject)zip, finish));
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  // Fill the read cache with idle readers of the volume's file.
+  CALL(resolver, set, zip->storage_urn, AFF4_TYPE,
+       rdfvalue_from_string(resolver, AFF4_FILE));
+
+  for(i=0; i<ZIP_TEST_READERS; i++) {
+    readers[i] = (FileLikeObject)CALL(resolver, open, zip->storage_urn, 'r');
+    CU_ASSERT_FATAL(readers[i] != NULL);
+  };
+
+  for(i=0; i<ZIP_TEST_READERS; i++)
+    CALL(resolver, cache_return, (AFFObject)readers[i]);
+
+  // The volume is still the one we manage.
+  CU_ASSERT_PTR_EQUAL(CALL(resolver, own, volume, 'r'), (AFFObject)zip);
+  CALL(resolver, cache_return, (AFFObject)zip);
+
+  segment = CALL((AFF4Volume)zip, open_member, urn, 'r', 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(segment);
+  CU_ASSERT_EQUAL(CALL(segment, read, buffer, BUFF_SIZE), 5);
+  CU_ASSERT(!memcmp(buffer, ZSTRING_NO_NULL("hello")));
+
+  // open() makes a new instance rather than handing out ours.
+  CALL(resolver, set, volume, AFF4_TYPE,
+       rdfvalue_from_string(resolver, AFF4_ZIP_VOLUME));
+  fd = CALL(resolver, open, volume, 'r');
+  CU_ASSERT_PTR_NOT_NULL(fd);
+  CU_ASSERT_PTR_NOT_EQUAL(fd, (AFFObject)zip);
+  CU_ASSERT_PTR_EQUAL(CALL(resolver, own, volume, 'r'), (AFFObject)zip);
+
+  talloc_free(fd);
+  talloc_free(resolver);
+};
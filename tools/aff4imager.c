@@ -246,14 +246,58 @@ int aff4_make_map(char *driver, char *output_file, char *stream_name,
   return 0;
 };
 
+/** Retry the unreadable parts of the source into a second stream
+    and store the map of what was recovered next to the image.
+*/
+static int aff4_rescue(AFF4Volume zipfile, RescueReader reader, RDFURN image_urn) {
+  Image rescued;
+  RDFURN rescued_urn = CALL(image_urn, copy, reader);
+  RDFURN map_urn = CALL(image_urn, copy, reader);
+  FileLikeObject map_fd;
+  AFF4Volume volume;
+  uint64_t bad_bytes;
+  char *map;
+
+  CALL(rescued_urn, add, "rescued");
+  CALL(map_urn, add, "map");
+
+  rescued = (Image)CALL(oracle, create, AFF4_IMAGE, 'w');
+  if(!rescued) return 0;
+
+  CALL(URNOF(rescued), set, rescued_urn->value);
+  CALL((AFFObject)rescued, set, AFF4_STORED, (RDFValue)URNOF(zipfile));
+  if(!CALL((AFFObject)rescued, finish))
+    return 0;
+
+  bad_bytes = CALL(reader, retry, (FileLikeObject)rescued);
+  CALL((AFFObject)rescued, close);
+
+  printf("\n%llu bytes could not be read\n", (unsigned long long)bad_bytes);
+
+  map = CALL(reader, get_map, reader, image_urn, rescued_urn);
+
+  volume = (AFF4Volume)CALL(oracle, open, URNOF(zipfile), 'w');
+  if(!volume) return 0;
+
+  map_fd = CALL(volume, open_member, map_urn, 'w', ZIP_DEFLATE);
+  if(map_fd) {
+    CALL(map_fd, write, map, strlen(map));
+    CALL((AFFObject)map_fd, close);
+  };
+
+  CALL(oracle, cache_return, (AFFObject)volume);
+  return map_fd != NULL;
+};
+
 /** This one creates a regular image on the output_file */
 int aff4_image(AFF4Volume *zipfile, char *driver, 
                char *output_file,
                char *stream_name,
                unsigned int chunks_in_segment,
                uint64_t max_size,
-               char *in_urn) {
+               char *in_urn, int rescue) {
   Image image;
+  RDFURN image_urn;
   char buffer[IMAGE_BUFF_SIZE];
   int length;
   int count = 0;
@@ -261,11 +305,22 @@ int aff4_image(AFF4Volume *zipfile, char *driver,
   RDFURN output_urn = new_RDFURN(directory_offset);
   RDFURN input_urn = (RDFURN)rdfvalue_from_urn(directory_offset, in_urn);
   FileLikeObject in_fd = (FileLikeObject)CALL(oracle, open, input_urn, 'r');
+  FileLikeObject source = in_fd;
+  RescueReader reader = NULL;
 
   if(!in_fd) {
     goto error;
   };
 
+  // Read errors are skipped and retried once the image is done.
+  if(rescue) {
+    reader = CONSTRUCT(RescueReader, RescueReader, Con, directory_offset, in_fd,
+                       IMAGE_BUFF_SIZE, 512);
+    if(!reader) goto error;
+
+    source = (FileLikeObject)reader;
+  };
+
   CALL(output_urn, set, output_file);
 
   // Need to make a new zipfile
@@ -354,14 +409,19 @@ int aff4_image(AFF4Volume *zipfile, char *driver,
 	CALL(oracle, cache_return, (AFFObject)*zipfile);
     };
 
-    length = CALL(in_fd, read, buffer, IMAGE_BUFF_SIZE);
+    length = CALL(source, read, buffer, IMAGE_BUFF_SIZE);
     if(length == 0) break;
 
     CALL((FileLikeObject)image, write, buffer, length);
   };
 
+  image_urn = CALL(URNOF(image), copy, directory_offset);
   CALL((AFFObject)image, close);
 
+  if(reader && reader->bad_bytes > 0 &&
+     !aff4_rescue(*zipfile, reader, image_urn))
+    goto error;
+
   if(in_fd) CALL((AFFObject)in_fd, close);
 
   talloc_free(directory_offset);
@@ -505,6 +565,7 @@ int main(int argc, char **argv)
   char *key_file = NULL;
   int verify = 0;
   uint64_t max_size=0;
+  int rescue = 0;
 
   oracle = AFF4_get_resolver();
 
@@ -534,6 +595,9 @@ int main(int argc, char **argv)
       {"max_size\0"
        "When a volume exceeds this size, a new volume is created (default 0-unlimited)",
        1, 0, 0},
+      {"rescue\0"
+       "Carry on past read errors, retry them at the end and store a map of what was recovered",
+       0, 0, 0},
       {"stream\0"
        "If specified a link will be added with this name to the new stream", 1, 0, 's'},
       {"cert\0"
@@ -571,6 +635,9 @@ int main(int argc, char **argv)
       } if(!strcmp(option, "max_size")) {
 	max_size = parse_int(optarg);
 	break;
+      } if(!strcmp(option, "rescue")) {
+	rescue = 1;
+	break;
       } else {
 	printf("Unknown long option %s", optarg);
 	break;
@@ -661,7 +728,7 @@ int main(int argc, char **argv)
                      in_stream_name,
                      chunks_per_segment,
                      max_size,
-                     in_urn);
+                     in_urn, rescue);
 
           optind++;
         };